@@ -1,6 +1,11 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,278 +16,7257 @@
 #include <sys/inotify.h>
 #include <sys/select.h>
 #include <sys/statfs.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <utmp.h>
+#include <endian.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <zlib.h>
 
 #define LOG_INTERVAL 5
 #define MAX_LINE_LEN 256
 #define CONFIG_FILE "/var/lib/system_logger/config.conf"
-#define LOG_FILE "/var/log/system_logger.log"
+#define LOG_DIR "/var/log"
+#define LOG_BASENAME "system_logger.log"
+#define LOG_FILE LOG_DIR "/" LOG_BASENAME
+#define LOG_INDEX_SUFFIX ".idx"
+#define LOG_BLOCKS_SUFFIX ".blk"
+#define LOG_BLOOM_SUFFIX ".bloom"
+#define LOG_FRAMES_SUFFIX ".frm"
+#define LOG_CHECKSUM_SUFFIX ".crc"
+#define LOG_DURABILITY_NONE 0
+#define LOG_DURABILITY_INTERVAL 1
+#define LOG_DURABILITY_EVERY_RECORD 2
+#define LOG_SYNC_INTERVAL_MS 1000
+#define LOG_SYNC_BYTES (1024 * 1024)
+#define LOG_RECOVERY_WINDOW (4 * 1024 * 1024)
+#define LOG_FRAMES_DATA_SUFFIX ".gz.part"
+#define LOG_FRAMES_MAGIC 0x4d415246u
+#define LOG_FRAME_SIZE (256 * 1024)
+#define LOG_COMPRESS_GZIP 1
+#define LOG_COMPRESS_FRAMES 2
+#define MAX_COMPRESS_TIERS 4
+#define RECOMPRESS_INTERVAL 3600
+#define BLOOM_MAGIC 0x4d4f4f42u
+#define BLOOM_SEGMENT_BITS (1u << 20)
+#define BLOOM_SEGMENT_HASHES 7
+#define BLOOM_BLOCK_BITS 4096
+#define BLOOM_BLOCK_HASHES 4
+#define MAX_QUERY_TOKENS 16
+#define JSON_ARENA_SIZE 16384
+#define LOG_INDEX_INTERVAL 65536
+#define LOG_ROTATE_KEEP 10
+#define LOG_TAIL_DEFAULT 20
+#define FOLLOW_CHUNK_SIZE 65536
+#define GREP_CHUNK_SIZE (8 * 1024 * 1024)
+#define GREP_MAX_THREADS 64
 #define MAX_CONFIG_LINE 512
 #define MAX_PATH_LEN 512
+#define SELF_STATS_INTERVAL 60
+#define STATS_FILE "/var/lib/system_logger/self_stats"
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define MAX_POLL_FDS 64
+#define MAX_HTTP_CLIENTS 16
+#define HTTP_REQUEST_MAX 4096
+#define HTTP_IDLE_TIMEOUT 10
+#define METRICS_BUFFER_SIZE 65536
+#define SHM_PATH "/dev/shm/system_logger"
+#define SHM_MAGIC 0x534c4f47u
+#define SHM_VERSION 1
+#define SHM_NAME_LEN 64
+#define SHM_LABELS_LEN 48
+#define TOP_REFRESH_US 100000
+#define STATSD_DEFAULT_PAYLOAD 1432
+#define STATSD_MAX_PAYLOAD 8932
+#define STATSD_MAX_PACKETS 64
+#define FORWARD_SPOOL_FILE "/var/lib/system_logger/forward.spool"
+#define FORWARD_SEQ_FILE "/var/lib/system_logger/forward.seq"
+#define FORWARD_SEQ_RESERVE (1ULL << 20)
+#define FORWARD_WINDOW (1024 * 1024)
+#define FORWARD_SPOOL_MAX (64LL * 1024 * 1024)
+#define FORWARD_FRAME_HEADER 12
+#define FORWARD_MAX_BACKOFF 30
+#define RECEIVE_BUFFER_SIZE (1024 * 1024)
+#define SINK_RING_BYTES (8 * 1024 * 1024)
+#define SINK_ENTRY_ALIGN 64
+#define SINK_BATCH_BYTES (256 * 1024)
+#define LOG_BUFFER_SIZE SINK_BATCH_BYTES
+#define SINK_PRIORITY_BYTES (256 * 1024)
+#define SINK_PRIORITY_QUEUE 256
+#define SINK_PRIORITY_LEVEL LOG_WARNING
+#define SINK_QUEUE_DEFAULT 4096
+#define SINK_FIELD_MAX 4096
+#define SINK_MESSAGE_MAX JSON_ARENA_SIZE
+#define SINK_ENTRY_MAX (64 + JSON_ARENA_SIZE + SINK_FIELD_MAX + SINK_MESSAGE_MAX + SINK_ENTRY_ALIGN)
+#define SINK_DRAIN_BUFFER (SINK_PRIORITY_BYTES + SINK_BATCH_BYTES + 2 * SINK_ENTRY_MAX)
+#define JOURNALD_SOCKET "/run/systemd/journal/socket"
+#define REDACT_REPLACEMENT "[REDACTED]"
+#define REDACT_MAX_RULES 65536
+#define REDACT_EXTEND_LEFT 1
+#define REDACT_EXTEND_RIGHT 2
+#define REDACT_MATCH_BIT 0x80000000u
+#define TSDB_DIR "/var/lib/system_logger/tsdb"
+#define ANOMALY_STATE_FILE "/var/lib/system_logger/anomaly.state"
+#define ANOMALY_STATE_MAGIC 0x4c4d4e41u
+#define ANOMALY_BUCKETS 25
+#define ANOMALY_SAVE_INTERVAL 300
+#define RULE_MAX_CODE 64
+#define KMSG_STATE_FILE "/var/lib/system_logger/kmsg.seq"
+#define KMSG_RECORD_MAX 8192
+#define KMSG_BATCH 256
+#define TAIL_STATE_FILE "/var/lib/system_logger/tail.offsets"
+#define MAX_TAILS 32
+#define TAIL_CHUNK_SIZE (1024 * 1024)
+#define TAIL_READ_BUDGET (64 * 1024 * 1024)
+#define TAIL_LINE_MAX 8192
+#define TAIL_CHECKPOINTS 16
+#define SYSLOG_MAX_LISTENERS 4
+#define SYSLOG_BATCH 64
+#define SYSLOG_BATCHES_PER_WAKEUP 16
+#define SYSLOG_MESSAGE_MAX 8192
+#define SYSLOG_RCVBUF (4 * 1024 * 1024)
+#define WTMP_STATE_FILE "/var/lib/system_logger/wtmp.offset"
+#define WTMP_BATCH 256
+#define MAX_LOGIN_SESSIONS 4096
+#define NETLINK_BUFFER_SIZE (64 * 1024)
+#define NETLINK_RCVBUF (1024 * 1024)
+#define NETLINK_BATCH 64
+#define MAX_INTERFACES 256
+#define MAX_INTERFACE_ADDRS 16
+#define RULE_MAX_RULES 65536
+#define ANOMALY_DEFAULT_METRICS "tcp_connections,tcp_established,free_inodes,directory_events_total_etc," \
+                                "directory_events_total_var_log,directory_events_total_tmp"
+#define TSDB_CHUNK_SIZE 4096
+#define TSDB_CHUNK_MAGIC 0x43524f47u
+#define TSDB_MAX_SAMPLE_BITS (4 + 32 + 2 + 5 + 6 + 64)
+#define SECONDS_PER_DAY 86400
+#define ROLLUP_MAGIC 0x4c4c4f52u
+#define NUM_ROLLUPS 3
 
 static FILE *log_file = NULL;
+static uint64_t log_offset = 0;
+static int log_index_fd = -1;
+static uint64_t log_index_next = 0;
+static int64_t log_index_ts = INT64_MIN;
+static long log_index_interval = LOG_INDEX_INTERVAL;
+static long long log_rotate_size = 0;
+static int log_rotate_keep = LOG_ROTATE_KEEP;
+static int log_rotate_compress = 0;
+static long log_frame_size = LOG_FRAME_SIZE;
+static int log_format_jsonl = 0;
+static int log_durability = LOG_DURABILITY_NONE;
+static long log_sync_interval_ms = LOG_SYNC_INTERVAL_MS;
+static long long log_sync_bytes = LOG_SYNC_BYTES;
+static int log_checksum_fd = -1;
+static uint64_t log_sync_deadline_ns = 0;
+static uint64_t log_unsynced_bytes = 0;
+static uint64_t log_recovered_bytes = 0;
 static int log_interval = LOG_INTERVAL;
 static int inotify_fd = -1;
 static int use_syslog = 1;
+static int self_stats_interval = SELF_STATS_INTERVAL;
+static volatile sig_atomic_t stop_requested = 0;
+
+/*
+ * Level filtering. Records more verbose than LOG_LEVEL_FLOOR are compiled out (build with
+ * -DLOG_LEVEL_FLOOR=LOG_INFO to drop every DEBUG call); above that the global LOG_LEVEL and the
+ * per-collector LOG_LEVEL_<NAME> settings are checked before a message is formatted.
+ */
+#ifndef LOG_LEVEL_FLOOR
+#define LOG_LEVEL_FLOOR LOG_DEBUG
+#endif
+
+enum {
+    COLLECTOR_CORE,
+    COLLECTOR_UPTIME,
+    COLLECTOR_NETWORK,
+    COLLECTOR_INODES,
+    COLLECTOR_INOTIFY,
+    COLLECTOR_DIRECTORY,
+    COLLECTOR_SELF,
+    COLLECTOR_FORWARD,
+    COLLECTOR_ANOMALY,
+    COLLECTOR_KMSG,
+    COLLECTOR_TAIL,
+    COLLECTOR_SYSLOG,
+    COLLECTOR_LOGINS,
+    COLLECTOR_NETLINK,
+    NUM_COLLECTORS
+};
+
+static const char *collector_names[NUM_COLLECTORS] = {
+    "CORE", "UPTIME", "NETWORK", "INODES", "INOTIFY", "DIRECTORY", "SELF", "FORWARD", "ANOMALY", "KMSG", "TAIL", "SYSLOG",
+    "LOGINS", "NETLINK"
+};
+
+static int log_level = LOG_INFO;
+static int collector_levels[NUM_COLLECTORS];  /* 0 means the global log_level */
+
+static inline int log_enabled(int collector, int priority) {
+    if (priority > LOG_LEVEL_FLOOR) return 0;
+    int level = collector_levels[collector];
+    return priority <= (level ? level : log_level);
+}
+
+/* Optional typed fields of a record; only the jsonl format writes them out */
+typedef struct {
+    const char *name;
+    double value;
+} record_metric_t;
+
+typedef struct {
+    const char *collector;
+    const record_metric_t *metrics;
+    int num_metrics;
+    const char *event_dir;
+    const char *event_file;
+    const char *event_type;
+} record_fields_t;
+
+/*
+ * A record that does not fit is cut at an escape and UTF-8 boundary and the arena marked truncated;
+ * JSON_ARENA_RESERVE bytes stay free for the closing quote and "}\n".
+ */
+#define JSON_ARENA_RESERVE 3
+
+typedef struct {
+    char data[JSON_ARENA_SIZE];
+    size_t len;
+    int truncated;
+} json_arena_t;
+
+static json_arena_t record_arena;
+
+/*
+ * Sidecar LOG_FILE.idx: one entry per LOG_INDEX_INTERVAL bytes, pointing at a record start. ts is
+ * the latest timestamp written up to that record, not its own: priority records overtake older
+ * ones, and the lookup's binary search needs timestamps that never decrease.
+ */
+typedef struct {
+    int64_t ts;
+    uint64_t offset;
+} log_index_entry_t;
+
+typedef struct {
+    char path[MAX_PATH_LEN];
+    char base[MAX_PATH_LEN];
+    char index_path[MAX_PATH_LEN + 8];
+    int compressed;
+} log_segment_t;
+
+static const char *log_sidecar_suffixes[] = {
+    LOG_INDEX_SUFFIX, LOG_BLOCKS_SUFFIX, LOG_BLOOM_SUFFIX, LOG_FRAMES_SUFFIX, LOG_FRAMES_DATA_SUFFIX, LOG_CHECKSUM_SUFFIX
+};
+
+/*
+ * Sidecar LOG_FILE.crc, written in the durable modes: offset, length and CRC32C of every record.
+ * A record counts as committed once both files have been fdatasync'ed (the log first), so on
+ * startup any tail record without a matching entry is a torn write and is cut off.
+ */
+typedef struct {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t crc;
+} log_checksum_t;
+#define NUM_LOG_SIDECARS (sizeof(log_sidecar_suffixes) / sizeof(log_sidecar_suffixes[0]))
+
+/*
+ * Framed compression (LOG_ROTATE_COMPRESS=frames): while the text file is written, every
+ * log_frame_size bytes of finished records are deflated into one gzip member appended to
+ * LOG_FILE.gz.part, and LOG_FILE.frm gets an entry with the member's first timestamp and its raw
+ * and compressed offsets. At rotation the .gz.part becomes the segment, which zcat still reads as
+ * a whole while range readers inflate only the members they need.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t level;
+    uint32_t frame_size;
+    uint32_t reserved;
+} log_frames_header_t;
+
+typedef struct {
+    int64_t first_ts;
+    uint64_t raw_offset;
+    uint64_t gz_offset;
+    uint32_t raw_len;
+    uint32_t gz_len;
+} log_frame_entry_t;
+
+typedef struct {
+    const log_frames_header_t *header;
+    const log_frame_entry_t *entries;
+    size_t count;
+    size_t frames_size;
+    const unsigned char *data;
+    size_t data_size;
+} log_frames_t;
+
+/* Deflate level by segment age: tier 0 is used while writing, older tiers by recompression */
+typedef struct {
+    int64_t age;
+    int level;
+} compress_tier_t;
+
+static compress_tier_t compress_tiers[MAX_COMPRESS_TIERS] = {{0, 1}};
+static int num_compress_tiers = 1;
+static int frames_fd = -1;
+static int frames_data_fd = -1;
+static int frames_source_fd = -1;
+static uint64_t frames_raw_end = 0;
+static uint64_t frames_gz_end = 0;
+static int64_t frames_last_ts = 0;
+static char *frame_raw = NULL;
+static unsigned char *frame_out = NULL;
+static size_t frame_out_capacity = 0;
+static z_stream frame_stream;
+static int frame_stream_level = -1;
+
+/*
+ * Token filters: LOG_FILE.blk gets one Bloom filter per index block as the block is finished,
+ * LOG_FILE.bloom one larger filter for the whole segment, written when the segment is rotated.
+ * Tokens are runs of [A-Za-z0-9._-], so "/etc: modification of file sudoers" yields etc,
+ * modification, of, file, sudoers. The whole formatted line is tokenized, not just the message,
+ * since a grep pattern may span the level, the source or a jsonl key.
+ */
+typedef struct {
+    uint64_t offset;
+    uint8_t bits[BLOOM_BLOCK_BITS / 8];
+} block_filter_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t hashes;
+    uint64_t bits;
+} bloom_header_t;
+
+static uint8_t *segment_bloom = NULL;
+static int segment_bloom_complete = 0;
+static block_filter_t current_block;
+static int current_block_used = 0;
+static int log_blocks_fd = -1;
+static char metrics_listen[MAX_PATH_LEN] = "";
+static char statsd_target[MAX_PATH_LEN] = "";
+static char statsd_prefix[MAX_CONFIG_LINE] = "system_logger";
+static char statsd_tags[MAX_CONFIG_LINE] = "";
+static int statsd_graphite = 0;
+static int statsd_payload = STATSD_DEFAULT_PAYLOAD;
+static char forward_target[MAX_PATH_LEN] = "";
+static size_t forward_window_size = FORWARD_WINDOW;
+static long long forward_spool_max = FORWARD_SPOOL_MAX;
+static int tsdb_enabled = 1;
+static int64_t tsdb_raw_retention = 7 * SECONDS_PER_DAY;
+static double anomaly_zscore = 0;
+static double anomaly_alpha = 0.05;
+static int anomaly_seasonal = 0;
+static int anomaly_warmup = 30;
+static double anomaly_min_stddev = 1.0;
+static char anomaly_metrics[MAX_CONFIG_LINE] = ANOMALY_DEFAULT_METRICS;
+static char **rule_texts = NULL;
+static int kmsg_enabled = 0;
+static int logins_enabled = 0;
+static int netlink_enabled = 0;
+static char syslog_listen[SYSLOG_MAX_LISTENERS][MAX_PATH_LEN];
+static int num_syslog_listen = 0;
+static int num_rule_texts = 0;
+
+/* Log-linear (HDR-style) latency histogram: 8 sub-buckets per power of two of nanoseconds */
+typedef struct {
+    const char *name;
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[HIST_BUCKETS];
+} latency_hist_t;
+
+enum {
+    HIST_UPTIME,
+    HIST_NETWORK,
+    HIST_INODES,
+    HIST_INOTIFY,
+    HIST_DIR_PERIODIC,
+    HIST_FILE_WRITE,
+    HIST_SYSLOG_WRITE,
+    HIST_LOG_SYNC,
+    HIST_ENQUEUE_TO_DISK,
+    HIST_ENQUEUE_TO_DISK_PRIORITY,
+    HIST_REDACT,
+    NUM_HISTS
+};
+
+static latency_hist_t hists[NUM_HISTS] = {
+    [HIST_UPTIME] = {.name = "log_uptime"},
+    [HIST_NETWORK] = {.name = "log_network_connections"},
+    [HIST_INODES] = {.name = "log_free_inodes"},
+    [HIST_INOTIFY] = {.name = "check_directory_changes"},
+    [HIST_DIR_PERIODIC] = {.name = "check_directory_changes_periodic"},
+    [HIST_FILE_WRITE] = {.name = "log_file_write"},
+    [HIST_SYSLOG_WRITE] = {.name = "syslog_write"},
+    [HIST_LOG_SYNC] = {.name = "log_sync"},
+    [HIST_ENQUEUE_TO_DISK] = {.name = "enqueue_to_disk"},
+    [HIST_ENQUEUE_TO_DISK_PRIORITY] = {.name = "enqueue_to_disk_priority"},
+    [HIST_REDACT] = {.name = "redact"},
+};
+
+/* bytes_written and records_dropped are also updated from the sink threads, so they are accessed atomically */
+typedef struct {
+    uint64_t records_logged;
+    uint64_t bytes_written;
+    uint64_t records_dropped;
+    uint64_t inotify_events;
+    uint64_t inotify_overflows;
+    int inotify_queue_bytes;
+    int inotify_queue_peak;
+} self_counters_t;
+
+static self_counters_t self_counters;
+
+typedef struct {
+    const char *name;
+    const char *labels;
+    const char *type;
+    const char *help;
+    double value;
+} metric_t;
+
+enum {
+    METRIC_UPTIME_SECONDS,
+    METRIC_TCP_CONNECTIONS,
+    METRIC_TCP_ESTABLISHED,
+    METRIC_FREE_INODES,
+    METRIC_TOTAL_INODES,
+    METRIC_DIR_EVENTS_ETC,
+    METRIC_DIR_EVENTS_VAR_LOG,
+    METRIC_DIR_EVENTS_TMP,
+    METRIC_RECORDS_LOGGED,
+    METRIC_BYTES_WRITTEN,
+    METRIC_RECORDS_DROPPED,
+    METRIC_INOTIFY_OVERFLOWS,
+    METRIC_CPU_USER_SECONDS,
+    METRIC_CPU_SYSTEM_SECONDS,
+    METRIC_MAX_RSS_BYTES,
+    METRIC_FORWARD_WINDOW_BYTES,
+    METRIC_FORWARD_SPOOL_BYTES,
+    METRIC_FORWARD_DROPPED,
+    METRIC_FORWARD_OVERSIZE,
+    METRIC_LOG_RECORDS_DEBUG,
+    METRIC_LOG_RECORDS_INFO,
+    METRIC_LOG_RECORDS_WARNING,
+    METRIC_LOG_RECORDS_ERROR,
+    METRIC_ALERTS_FIRING,
+    METRIC_KMSG_RECORDS,
+    METRIC_KMSG_DROPPED,
+    METRIC_TAIL_BYTES,
+    METRIC_TAIL_LINES,
+    METRIC_SYSLOG_RECEIVED,
+    METRIC_SYSLOG_MALFORMED,
+    METRIC_LOGINS,
+    METRIC_SESSIONS,
+    METRIC_NETLINK_EVENTS,
+    METRIC_NETLINK_OVERRUNS,
+    METRIC_INTERFACES,
+    METRIC_INTERFACES_UP,
+    METRIC_SINK_DELIVERED,
+    METRIC_SINK_DROPPED = METRIC_SINK_DELIVERED + 5,
+    METRIC_STATSD_DATAGRAMS = METRIC_SINK_DROPPED + 5,
+    METRIC_STATSD_SEND_ERRORS,
+    NUM_METRICS
+};
+
+static metric_t metrics[NUM_METRICS] = {
+    [METRIC_UPTIME_SECONDS] = {"system_logger_uptime_seconds", NULL, "gauge", "System uptime from /proc/uptime", 0},
+    [METRIC_TCP_CONNECTIONS] = {"system_logger_tcp_connections", NULL, "gauge", "Entries in /proc/net/tcp", 0},
+    [METRIC_TCP_ESTABLISHED] = {"system_logger_tcp_established", NULL, "gauge", "Established entries in /proc/net/tcp", 0},
+    [METRIC_FREE_INODES] = {"system_logger_free_inodes", NULL, "gauge", "Free inodes on /", 0},
+    [METRIC_TOTAL_INODES] = {"system_logger_total_inodes", NULL, "gauge", "Total inodes on /", 0},
+    [METRIC_DIR_EVENTS_ETC] = {"system_logger_directory_events_total", "dir=\"/etc\"", "counter", "inotify events per watched directory", 0},
+    [METRIC_DIR_EVENTS_VAR_LOG] = {"system_logger_directory_events_total", "dir=\"/var/log\"", "counter", NULL, 0},
+    [METRIC_DIR_EVENTS_TMP] = {"system_logger_directory_events_total", "dir=\"/tmp\"", "counter", NULL, 0},
+    [METRIC_RECORDS_LOGGED] = {"system_logger_records_total", NULL, "counter", "Records passed to log_message()", 0},
+    [METRIC_BYTES_WRITTEN] = {"system_logger_written_bytes_total", NULL, "counter", "Bytes written to the log file", 0},
+    [METRIC_RECORDS_DROPPED] = {"system_logger_dropped_records_total", NULL, "counter", "Records that failed to reach the log file", 0},
+    [METRIC_INOTIFY_OVERFLOWS] = {"system_logger_inotify_overflows_total", NULL, "counter", "inotify queue overflows", 0},
+    [METRIC_CPU_USER_SECONDS] = {"system_logger_cpu_user_seconds_total", NULL, "counter", "User CPU time used by the daemon", 0},
+    [METRIC_CPU_SYSTEM_SECONDS] = {"system_logger_cpu_system_seconds_total", NULL, "counter", "System CPU time used by the daemon", 0},
+    [METRIC_MAX_RSS_BYTES] = {"system_logger_max_rss_bytes", NULL, "gauge", "Peak resident set size of the daemon", 0},
+    [METRIC_FORWARD_WINDOW_BYTES] = {"system_logger_forward_window_bytes", NULL, "gauge", "Forwarded bytes not yet acknowledged", 0},
+    [METRIC_FORWARD_SPOOL_BYTES] = {"system_logger_forward_spool_bytes", NULL, "gauge", "Bytes waiting in the forward spool", 0},
+    [METRIC_FORWARD_DROPPED] = {"system_logger_forward_dropped_records_total", NULL, "counter", "Records dropped because the forward spool was full", 0},
+    [METRIC_FORWARD_OVERSIZE] = {"system_logger_forward_oversize_records_total", NULL, "counter", "Records skipped because they do not fit in the forward window", 0},
+    [METRIC_LOG_RECORDS_DEBUG] = {"system_logger_log_records_total", "level=\"DEBUG\"", "counter", "Records seen by the metrics sink per level", 0},
+    [METRIC_LOG_RECORDS_INFO] = {"system_logger_log_records_total", "level=\"INFO\"", "counter", NULL, 0},
+    [METRIC_LOG_RECORDS_WARNING] = {"system_logger_log_records_total", "level=\"WARNING\"", "counter", NULL, 0},
+    [METRIC_LOG_RECORDS_ERROR] = {"system_logger_log_records_total", "level=\"ERROR\"", "counter", NULL, 0},
+    [METRIC_ALERTS_FIRING] = {"system_logger_alerts_firing", NULL, "gauge", "Alert rules currently firing", 0},
+    [METRIC_KMSG_RECORDS] = {"system_logger_kmsg_records_total", NULL, "counter", "Records read from /dev/kmsg", 0},
+    [METRIC_KMSG_DROPPED] = {"system_logger_kmsg_dropped_total", NULL, "counter", "Kernel log records overwritten before they were read", 0},
+    [METRIC_TAIL_BYTES] = {"system_logger_tail_read_bytes_total", NULL, "counter", "Bytes read from tailed files", 0},
+    [METRIC_TAIL_LINES] = {"system_logger_tail_lines_total", NULL, "counter", "Lines read from tailed files", 0},
+    [METRIC_SYSLOG_RECEIVED] = {"system_logger_syslog_received_total", NULL, "counter", "Messages received on the syslog sockets", 0},
+    [METRIC_SYSLOG_MALFORMED] = {"system_logger_syslog_malformed_total", NULL, "counter", "Syslog messages without a valid header, logged as they are", 0},
+    [METRIC_LOGINS] = {"system_logger_logins_total", NULL, "counter", "Logins read from wtmp", 0},
+    [METRIC_SESSIONS] = {"system_logger_sessions", NULL, "gauge", "Login sessions currently in utmp", 0},
+    [METRIC_NETLINK_EVENTS] = {"system_logger_netlink_events_total", NULL, "counter", "Link, address and route notifications from rtnetlink", 0},
+    [METRIC_NETLINK_OVERRUNS] = {"system_logger_netlink_overruns_total", NULL, "counter", "rtnetlink overruns, each followed by a resync dump", 0},
+    [METRIC_INTERFACES] = {"system_logger_interfaces", NULL, "gauge", "Network interfaces known from rtnetlink", 0},
+    [METRIC_INTERFACES_UP] = {"system_logger_interfaces_up", NULL, "gauge", "Network interfaces that are up with carrier", 0},
+    [METRIC_SINK_DELIVERED + 0] = {"system_logger_sink_delivered_records_total", "sink=\"file\"", "counter", "Records delivered per output sink", 0},
+    [METRIC_SINK_DELIVERED + 1] = {"system_logger_sink_delivered_records_total", "sink=\"syslog\"", "counter", NULL, 0},
+    [METRIC_SINK_DELIVERED + 2] = {"system_logger_sink_delivered_records_total", "sink=\"journald\"", "counter", NULL, 0},
+    [METRIC_SINK_DELIVERED + 3] = {"system_logger_sink_delivered_records_total", "sink=\"forward\"", "counter", NULL, 0},
+    [METRIC_SINK_DELIVERED + 4] = {"system_logger_sink_delivered_records_total", "sink=\"metrics\"", "counter", NULL, 0},
+    [METRIC_SINK_DROPPED + 0] = {"system_logger_sink_dropped_records_total", "sink=\"file\"", "counter", "Records dropped per output sink by its queue policy or a failed write", 0},
+    [METRIC_SINK_DROPPED + 1] = {"system_logger_sink_dropped_records_total", "sink=\"syslog\"", "counter", NULL, 0},
+    [METRIC_SINK_DROPPED + 2] = {"system_logger_sink_dropped_records_total", "sink=\"journald\"", "counter", NULL, 0},
+    [METRIC_SINK_DROPPED + 3] = {"system_logger_sink_dropped_records_total", "sink=\"forward\"", "counter", NULL, 0},
+    [METRIC_SINK_DROPPED + 4] = {"system_logger_sink_dropped_records_total", "sink=\"metrics\"", "counter", NULL, 0},
+    [METRIC_STATSD_DATAGRAMS] = {"system_logger_statsd_datagrams_total", NULL, "counter", "Datagrams sent to STATSD_TARGET", 0},
+    [METRIC_STATSD_SEND_ERRORS] = {"system_logger_statsd_send_errors_total", NULL, "counter", "Datagrams that sendmmsg() failed to send to STATSD_TARGET", 0},
+};
+
+typedef void (*poll_handler_t)(int fd, short revents, void *arg);
+
+static struct pollfd poll_fds[MAX_POLL_FDS];
+static poll_handler_t poll_handlers[MAX_POLL_FDS];
+static void *poll_args[MAX_POLL_FDS];
+static int num_poll_fds = 0;
+
+/* Prometheus exposition is rendered once per tick into the back buffer and then swapped in */
+typedef struct {
+    char data[METRICS_BUFFER_SIZE];
+    size_t len;
+    int readers;
+} metrics_snapshot_t;
+
+static metrics_snapshot_t metrics_snapshots[2];
+static int metrics_front = 0;
+
+typedef struct {
+    int fd;
+    char request[HTTP_REQUEST_MAX];
+    size_t request_len;
+    char header[256];
+    size_t header_len;
+    const char *body;
+    size_t body_len;
+    size_t sent;
+    metrics_snapshot_t *snapshot;
+    uint64_t idle_deadline_ns;
+} http_client_t;
+
+static int metrics_listen_fd = -1;
+static http_client_t http_clients[MAX_HTTP_CLIENTS];
+
+/* Layout of SHM_PATH. Readers must check magic/version and retry while seq is odd or changes */
+typedef struct {
+    char name[SHM_NAME_LEN];
+    char labels[SHM_LABELS_LEN];
+    double value;
+} shm_metric_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_metrics;
+    uint32_t metric_size;
+    int32_t pid;
+    int32_t interval;
+    uint64_t seq;
+    int64_t updated_sec;
+    shm_metric_t metrics[];
+} shm_segment_t;
+
+#define SHM_NUM_METRICS (NUM_METRICS + 2 * NUM_HISTS)
+
+static shm_segment_t *shm_segment = NULL;
+static size_t shm_size = 0;
+
+typedef struct {
+    int fd;
+    char packets[STATSD_MAX_PACKETS][STATSD_MAX_PAYLOAD];
+    struct iovec iov[STATSD_MAX_PACKETS];
+    struct mmsghdr msgs[STATSD_MAX_PACKETS];
+    double last_counter[NUM_METRICS];
+    uint64_t datagrams_sent;
+    uint64_t send_errors;
+} statsd_sink_t;
+
+static statsd_sink_t statsd_sink = {.fd = -1};
+
+/*
+ * FORWARD_TARGET sink: every record is sent as a frame [u32 length][u64 seq][record], big endian,
+ * and the receiver answers with the u64 seq of the last frame it has kept. Frames stay in the
+ * window until acknowledged and are resent after a reconnect. When the window is full, new frames
+ * go to FORWARD_SPOOL_FILE and move back into the window in order as acknowledgements free room.
+ * FORWARD_SEQ_FILE holds a bound above every seq handed out, advanced FORWARD_SEQ_RESERVE at a time,
+ * so seq keeps increasing across restarts regardless of the clock.
+ */
+typedef struct {
+    int fd;
+    int connected;
+    int reported;
+    char *window;
+    size_t window_len;
+    size_t window_sent;
+    uint64_t next_seq;
+    uint64_t seq_reserved;
+    unsigned char ack[8];
+    size_t ack_len;
+    int spool_fd;
+    uint64_t spool_read;
+    uint64_t spool_size;
+    time_t retry_at;
+    int backoff;
+    uint64_t dropped;
+    uint64_t oversize;
+} forwarder_t;
+
+static forwarder_t forwarder = {.fd = -1, .spool_fd = -1, .backoff = 1};
+
+/*
+ * Output sinks. log_record() formats a record once and copies it once into sink_ring; each
+ * enabled sink then reads the ring through its own cursor. The file, syslog and journald sinks
+ * drain it from their own threads, the forward and metrics sinks from the event loop right after
+ * the enqueue. A sink's queue holds at most SINK_<NAME>_QUEUE records (and never more than the
+ * ring); when it is full the producer either waits for that sink (block) or drops the sink's
+ * oldest records (drop). WARNING and ERROR records go to a small separate priority lane that
+ * every sink drains first, even in the middle of a batch of ordinary records.
+ */
+enum {
+    SINK_FILE,
+    SINK_SYSLOG,
+    SINK_JOURNALD,
+    SINK_FORWARD,
+    SINK_METRICS,
+    NUM_SINKS
+};
+
+enum {
+    SINK_LANE_NORMAL,
+    SINK_LANE_PRIORITY,
+    SINK_LANES
+};
+
+/* Ring entry header, followed by the formatted line, user and message, each NUL-terminated */
+typedef struct {
+    uint64_t seq;
+    uint32_t size;
+    uint32_t line_len;
+    uint32_t user_len;
+    uint32_t msg_len;
+    int32_t priority;
+    int32_t reserved;
+    int64_t ts;
+    uint64_t enqueued_ns;
+} sink_entry_t;
+
+typedef int (*sink_deliver_t)(const sink_entry_t *entry, const char *line, const char *user, const char *msg);
+
+typedef struct {
+    const char *name;
+    int enabled;
+    int threaded;
+    int drop;
+    uint64_t capacity;
+    uint64_t cursor[SINK_LANES];
+    uint64_t seq[SINK_LANES];
+    uint64_t delivered;
+    uint64_t dropped;
+    uint64_t acked;
+    sink_deliver_t deliver;
+    uint64_t (*idle)(void);
+    void (*flush)(void);
+    pthread_t thread;
+    int started;
+} sink_t;
+
+typedef struct {
+    char *data;
+    uint64_t bytes;
+    uint64_t head;
+    uint64_t head_seq;
+} sink_lane_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    sink_lane_t lanes[SINK_LANES];
+    int stopping;
+    int deferred;
+    int wake_pending;
+} sink_ring_t;
+
+static sink_t sinks[NUM_SINKS] = {
+    [SINK_FILE] = {.name = "file", .threaded = 1, .capacity = 65536},
+    [SINK_SYSLOG] = {.name = "syslog", .threaded = 1, .drop = 1, .capacity = SINK_QUEUE_DEFAULT},
+    [SINK_JOURNALD] = {.name = "journald", .threaded = 1, .drop = 1, .capacity = SINK_QUEUE_DEFAULT},
+    [SINK_FORWARD] = {.name = "forward", .capacity = SINK_QUEUE_DEFAULT},
+    [SINK_METRICS] = {.name = "metrics", .drop = 1, .capacity = SINK_QUEUE_DEFAULT},
+};
+
+static sink_ring_t sink_ring = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+    .lanes = {[SINK_LANE_NORMAL] = {.bytes = SINK_RING_BYTES}, [SINK_LANE_PRIORITY] = {.bytes = SINK_PRIORITY_BYTES}},
+};
+static int log_priority_sync = 0;
+static int sinks_configured = 0;
+
+/*
+ * Redaction rules (REDACT=...) compiled into one Aho-Corasick automaton. A rule is a literal; a
+ * leading or trailing '*' also swallows the run of word characters ([A-Za-z0-9._%+@-]) before or
+ * after it, so "*@*" hides e-mail addresses and "token=*" hides token values. The automaton is a
+ * dense DFA over byte classes (bytes that occur in no rule share class 0), so matching costs one
+ * table lookup per input byte whatever the number of rules. Transitions hold the target row offset
+ * with REDACT_MATCH_BIT set when the target state ends a rule.
+ */
+typedef struct {
+    uint8_t byte_class[256];
+    uint32_t num_classes;
+    uint32_t num_states;
+    uint32_t *next;
+    uint16_t *match_len;
+    uint8_t *match_flags;
+} redactor_t;
+
+/* Output of redact_string; grown to fit the worst case of the text being redacted */
+typedef struct {
+    char *data;
+    size_t size;
+} redact_buffer_t;
+
+static redactor_t redactor;
+static char **redact_rules = NULL;
+static int num_redact_rules = 0;
+static int journald_fd = -1;
+
+/*
+ * File tail input (TAIL=<name>:<path>). Each file gets an inotify watch for appends and its
+ * directory one for creations and renames, both on the shared inotify_fd. Appended data is read
+ * with pread in TAIL_CHUNK_SIZE chunks and split into lines with memchr; a partial last line waits
+ * in the carry buffer for the rest. A new inode at the path (rotation) is picked up after the old
+ * file has been read to its end, and a truncated file (shorter than our offset, or no newline
+ * right before it) is read again from the start. Records carry the source "tail:<name>".
+ * After each read the offset of the last complete line is queued with the ring seq reached; once
+ * the file sink has written and flushed up to that seq, the offset becomes the checkpoint saved
+ * to TAIL_STATE_FILE (temporary file and rename) every interval and on shutdown. A crash thus
+ * replays lines that may already be in the log rather than losing lines that never got there.
+ */
+typedef struct {
+    char name[64];
+    char path[MAX_PATH_LEN];
+    char source[80];
+    int fd;
+    int wd;
+    int dir_wd;
+    int dirty;
+    dev_t dev;
+    ino_t ino;
+    uint64_t offset;
+    uint64_t acked_offset;
+    uint64_t saved_offset;
+    uint64_t checkpoint_seq[TAIL_CHECKPOINTS];
+    uint64_t checkpoint_offset[TAIL_CHECKPOINTS];
+    int num_checkpoints;
+    char *carry;
+    size_t carry_len;
+    uint64_t carry_start;
+} tail_t;
+
+static tail_t tails[MAX_TAILS];
+static int num_tails = 0;
+static uint64_t tail_bytes = 0;
+static uint64_t tail_lines = 0;
+static char *tail_buffer = NULL;
+
+/*
+ * Each series keeps one file per UTC day in TSDB_DIR/<series>/<day>.gor made of page-sized
+ * chunks. A chunk holds a Gorilla bit stream (delta-of-delta timestamps, XOR-encoded doubles);
+ * samples are appended past the committed length and published by one atomic store of
+ * commit = count << 32 | bits, so a reader or a restart never sees a half-written sample.
+ * Chunks are allocated with posix_fallocate before they are mapped: a sparse page that cannot be
+ * backed when the disk is full would turn the first store into SIGBUS.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    int64_t start_ts;
+    int64_t end_ts;
+    uint64_t commit;
+} tsdb_chunk_header_t;
+
+#define TSDB_CHUNK_BITS ((uint32_t)(TSDB_CHUNK_SIZE - sizeof(tsdb_chunk_header_t)) * 8)
+
+typedef struct {
+    int fd;
+    int64_t day;
+    tsdb_chunk_header_t *chunk;
+    off_t file_size;
+    uint32_t count;
+    uint32_t bits;
+    int64_t prev_ts;
+    int64_t prev_delta;
+    uint64_t prev_value;
+    int prev_leading;
+    int prev_trailing;
+} tsdb_series_t;
+
+typedef struct {
+    const uint8_t *data;
+    uint32_t pos;
+    uint32_t limit;
+    uint32_t remaining;
+    int started;
+    int64_t ts;
+    int64_t delta;
+    uint64_t value;
+    int leading;
+    int trailing;
+} tsdb_decoder_t;
+
+typedef void (*tsdb_sample_cb)(int64_t ts, double value, void *arg);
+
+static tsdb_series_t tsdb_series[NUM_METRICS];
+
+/*
+ * Rollups live in TSDB_DIR/<series>/rollup_<resolution>.dat: a header followed by a ring of
+ * retention / resolution slots indexed by (bucket start / resolution) % capacity, so old
+ * buckets are overwritten in place and retention needs no cleanup pass. The open bucket is
+ * updated in its slot on every sample.
+ */
+typedef struct {
+    int64_t start;
+    uint64_t count;
+    double min;
+    double max;
+    double sum;
+} rollup_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t resolution;
+    uint64_t capacity;
+} rollup_header_t;
+
+typedef struct {
+    const char *suffix;
+    int64_t resolution;
+    int64_t retention;
+} rollup_level_t;
+
+static rollup_level_t rollup_levels[NUM_ROLLUPS] = {
+    {"1M", 60, 7 * SECONDS_PER_DAY},
+    {"10M", 600, 90 * SECONDS_PER_DAY},
+    {"1H", 3600, 730 * SECONDS_PER_DAY},
+};
+
+typedef struct {
+    rollup_header_t *header;
+    size_t size;
+} rollup_file_t;
+
+static rollup_file_t rollup_files[NUM_METRICS][NUM_ROLLUPS];
+
+typedef void (*rollup_cb)(const rollup_slot_t *slot, void *arg);
+
+typedef struct {
+    char path[MAX_PATH_LEN];
+    int wd;
+    time_t last_check;
+    int metric;
+} watch_dir_t;
+
+static watch_dir_t watch_dirs[] = {
+    {"/etc", -1, 0, METRIC_DIR_EVENTS_ETC},
+    {"/var/log", -1, 0, METRIC_DIR_EVENTS_VAR_LOG},
+    {"/tmp", -1, 0, METRIC_DIR_EVENTS_TMP}
+};
+#define NUM_WATCH_DIRS (sizeof(watch_dirs) / sizeof(watch_dirs[0]))
+
+static const char* get_username(void) {
+    const char *user = getenv("USER");
+    return user ? user : (getenv("USERNAME") ? getenv("USERNAME") : "unknown");
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int hist_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+static uint64_t hist_upper_bound(int index) {
+    if (index < HIST_SUB_COUNT) return (uint64_t)index;
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    uint64_t lower = (uint64_t)(HIST_SUB_COUNT + (index & (HIST_SUB_COUNT - 1))) << shift;
+    return lower + ((1ULL << shift) - 1);
+}
+
+/* The file and syslog sinks record from their own threads, so every field is updated atomically */
+static void hist_record(latency_hist_t *hist, uint64_t value_ns) {
+    __atomic_add_fetch(&hist->buckets[hist_index(value_ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum_ns, value_ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    while (value_ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, value_ns, 1, __ATOMIC_RELAXED,
+                                                          __ATOMIC_RELAXED)) {
+    }
+}
+
+/* Readers work on a copy whose count is the sum of its buckets, so a percentile never ranks past them */
+static void hist_snapshot(const latency_hist_t *hist, latency_hist_t *copy) {
+    copy->name = hist->name;
+    copy->count = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        copy->buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        copy->count += copy->buckets[i];
+    }
+    copy->sum_ns = __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED);
+    copy->max_ns = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+}
+
+static uint64_t hist_percentile(const latency_hist_t *hist, double percentile) {
+    if (hist->count == 0) return 0;
+    uint64_t rank = (uint64_t)(hist->count * percentile / 100.0);
+    if (rank >= hist->count) rank = hist->count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) {
+            uint64_t bound = hist_upper_bound(i);
+            return bound < hist->max_ns ? bound : hist->max_ns;
+        }
+    }
+    return hist->max_ns;
+}
+
+static void metric_set(int id, double value) {
+    metrics[id].value = value;
+}
+
+static void metric_add(int id, double delta) {
+    metrics[id].value += delta;
+}
+
+/* "90", "90s", "15m", "12h", "30d" -> seconds, -1 if malformed */
+static int64_t parse_duration(const char *arg) {
+    char *end;
+    long long amount = strtoll(arg, &end, 10);
+    if (end == arg || amount < 0) return -1;
+    if (*end == '\0' || strcmp(end, "s") == 0) return amount;
+    if (strcmp(end, "m") == 0) return amount * 60;
+    if (strcmp(end, "h") == 0) return amount * 3600;
+    if (strcmp(end, "d") == 0) return amount * SECONDS_PER_DAY;
+    return -1;
+}
+
+static int is_token_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '.' || c == '_' || c == '-';
+}
+
+static uint64_t token_hash(const char *token, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)token[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void bloom_add(uint8_t *bits, uint64_t nbits, int hashes, uint64_t hash) {
+    uint64_t step = (hash >> 33) | 1;
+    for (int i = 0; i < hashes; i++) {
+        uint64_t bit = (hash + (uint64_t)i * step) % nbits;
+        bits[bit >> 3] |= (uint8_t)(1 << (bit & 7));
+    }
+}
+
+static int bloom_test(const uint8_t *bits, uint64_t nbits, int hashes, uint64_t hash) {
+    uint64_t step = (hash >> 33) | 1;
+    for (int i = 0; i < hashes; i++) {
+        uint64_t bit = (hash + (uint64_t)i * step) % nbits;
+        if (!(bits[bit >> 3] & (1 << (bit & 7)))) return 0;
+    }
+    return 1;
+}
+
+static void add_record_tokens(const char *text, size_t len) {
+    const char *p = text, *end = text + len;
+    while (p < end) {
+        while (p < end && !is_token_char(*p)) p++;
+        const char *start = p;
+        while (p < end && is_token_char(*p)) p++;
+        if (p == start) continue;
+        uint64_t hash = token_hash(start, (size_t)(p - start));
+        if (segment_bloom) bloom_add(segment_bloom, BLOOM_SEGMENT_BITS, BLOOM_SEGMENT_HASHES, hash);
+        bloom_add(current_block.bits, BLOOM_BLOCK_BITS, BLOOM_BLOCK_HASHES, hash);
+        current_block_used = 1;
+    }
+}
+
+/* Parses the "[YYYY-MM-DD HH:MM:SS]" or {"ts":"YYYY-MM-DDTHH:MM:SS prefix of a record, -1 if none */
+int64_t record_timestamp(const char *line, size_t len) {
+    static _Thread_local char cached[19];
+    static _Thread_local int64_t cached_ts = -1;
+    const char *p;
+    if (len >= 21 && line[0] == '[' && line[20] == ']') p = line + 1;
+    else if (len >= 26 && memcmp(line, "{\"ts\":\"", 7) == 0) p = line + 7;
+    else return -1;
+    if (cached_ts >= 0 && memcmp(cached, p, sizeof(cached)) == 0) return cached_ts;
+    
+    int fields[6];
+    static const int offsets[6] = {0, 5, 8, 11, 14, 17};
+    static const int widths[6] = {4, 2, 2, 2, 2, 2};
+    for (int f = 0; f < 6; f++) {
+        int value = 0;
+        for (int k = 0; k < widths[f]; k++) {
+            char c = p[offsets[f] + k];
+            if (c < '0' || c > '9') return -1;
+            value = value * 10 + (c - '0');
+        }
+        fields[f] = value;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = fields[0] - 1900;
+    tm.tm_mon = fields[1] - 1;
+    tm.tm_mday = fields[2];
+    tm.tm_hour = fields[3];
+    tm.tm_min = fields[4];
+    tm.tm_sec = fields[5];
+    tm.tm_isdst = -1;
+    memcpy(cached, p, sizeof(cached));
+    cached_ts = (int64_t)mktime(&tm);
+    return cached_ts;
+}
+
+#define TIMED(hist_id, call) do { \
+        uint64_t timed_start_ = monotonic_ns(); \
+        call; \
+        hist_record(&hists[hist_id], monotonic_ns() - timed_start_); \
+    } while (0)
+
+int poll_register(int fd, short events, poll_handler_t handler, void *arg) {
+    if (num_poll_fds >= MAX_POLL_FDS) return -1;
+    poll_fds[num_poll_fds].fd = fd;
+    poll_fds[num_poll_fds].events = events;
+    poll_fds[num_poll_fds].revents = 0;
+    poll_handlers[num_poll_fds] = handler;
+    poll_args[num_poll_fds] = arg;
+    num_poll_fds++;
+    return 0;
+}
+
+void poll_set_events(int fd, short events) {
+    for (int i = 0; i < num_poll_fds; i++) {
+        if (poll_fds[i].fd == fd) poll_fds[i].events = events;
+    }
+}
+
+void poll_unregister(int fd) {
+    for (int i = 0; i < num_poll_fds; i++) {
+        if (poll_fds[i].fd == fd) poll_fds[i].fd = -1;
+    }
+}
+
+static void poll_compact(void) {
+    int j = 0;
+    for (int i = 0; i < num_poll_fds; i++) {
+        if (poll_fds[i].fd < 0) continue;
+        poll_fds[j] = poll_fds[i];
+        poll_handlers[j] = poll_handlers[i];
+        poll_args[j] = poll_args[i];
+        j++;
+    }
+    num_poll_fds = j;
+}
+
+/* Services registered descriptors until the monotonic deadline instead of sleeping */
+void run_event_loop_until(uint64_t deadline_ns) {
+    while (1) {
+        uint64_t now = monotonic_ns();
+        if (now >= deadline_ns) return;
+        int timeout_ms = (int)((deadline_ns - now + 999999) / 1000000);
+        
+        int ready = poll(poll_fds, (nfds_t)num_poll_fds, timeout_ms);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                if (stop_requested) return;
+                continue;
+            }
+            usleep(timeout_ms * 1000);
+            return;
+        }
+        
+        int count = num_poll_fds;
+        for (int i = 0; i < count && ready > 0; i++) {
+            if (poll_fds[i].fd < 0 || poll_fds[i].revents == 0) continue;
+            ready--;
+            poll_handlers[i](poll_fds[i].fd, poll_fds[i].revents, poll_args[i]);
+        }
+        poll_compact();
+    }
+}
+
+/* Returns the syslog priority for a level name, or 0 if it is not one */
+static int parse_log_level(const char *name) {
+    if (strcasecmp(name, "DEBUG") == 0) return LOG_DEBUG;
+    if (strcasecmp(name, "INFO") == 0) return LOG_INFO;
+    if (strcasecmp(name, "NOTICE") == 0) return LOG_NOTICE;
+    if (strcasecmp(name, "WARNING") == 0) return LOG_WARNING;
+    if (strcasecmp(name, "ERROR") == 0) return LOG_ERR;
+    return 0;
+}
+
+int read_config(void) {
+    FILE *config = fopen(CONFIG_FILE, "r");
+    if (!config) return 0;
+    
+    char line[MAX_CONFIG_LINE];
+    while (fgets(line, sizeof(line), config)) {
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+        
+        if (strncmp(line, "LOG_INTERVAL=", 13) == 0) {
+            int interval = atoi(line + 13);
+            if (interval > 0 && interval <= 3600) log_interval = interval;
+        } else if (strncmp(line, "USE_SYSLOG=", 11) == 0) {
+            use_syslog = (atoi(line + 11) != 0);
+        } else if (strncmp(line, "SELF_STATS_INTERVAL=", 20) == 0) {
+            int interval = atoi(line + 20);
+            if (interval >= 0 && interval <= 86400) self_stats_interval = interval;
+        } else if (strncmp(line, "LOG_FORMAT=", 11) == 0) {
+            log_format_jsonl = (strcmp(line + 11, "jsonl") == 0);
+        } else if (strncmp(line, "LOG_DURABILITY=", 15) == 0) {
+            if (strcmp(line + 15, "interval") == 0) log_durability = LOG_DURABILITY_INTERVAL;
+            else if (strcmp(line + 15, "every-record") == 0) log_durability = LOG_DURABILITY_EVERY_RECORD;
+            else log_durability = LOG_DURABILITY_NONE;
+        } else if (strncmp(line, "LOG_SYNC_INTERVAL_MS=", 21) == 0) {
+            long interval = atol(line + 21);
+            if (interval >= 1 && interval <= 60000) log_sync_interval_ms = interval;
+        } else if (strncmp(line, "LOG_SYNC_BYTES=", 15) == 0) {
+            long long bytes = atoll(line + 15);
+            if (bytes >= 0) log_sync_bytes = bytes;
+        } else if (strncmp(line, "LOG_INDEX_INTERVAL=", 19) == 0) {
+            long interval = atol(line + 19);
+            if (interval >= 1024) log_index_interval = interval;
+        } else if (strncmp(line, "LOG_ROTATE_SIZE=", 16) == 0) {
+            long long size = atoll(line + 16);
+            if (size == 0 || size >= 65536) log_rotate_size = size;
+        } else if (strncmp(line, "LOG_ROTATE_KEEP=", 16) == 0) {
+            int keep = atoi(line + 16);
+            if (keep >= 1) log_rotate_keep = keep;
+        } else if (strncmp(line, "LOG_ROTATE_COMPRESS=", 20) == 0) {
+            if (strcmp(line + 20, "frames") == 0) log_rotate_compress = LOG_COMPRESS_FRAMES;
+            else log_rotate_compress = (atoi(line + 20) != 0) ? LOG_COMPRESS_GZIP : 0;
+        } else if (strncmp(line, "LOG_FRAME_SIZE=", 15) == 0) {
+            long size = atol(line + 15);
+            if (size >= 4096 && size <= (64L << 20)) log_frame_size = size;
+        } else if (strncmp(line, "LOG_COMPRESS_LEVELS=", 20) == 0) {
+            /* "1,6@1d,9@7d": level while writing, then level from the given segment age on */
+            char *save = NULL;
+            int tiers = 0;
+            for (char *item = strtok_r(line + 20, ",", &save); item && tiers < MAX_COMPRESS_TIERS;
+                 item = strtok_r(NULL, ",", &save)) {
+                char *at = strchr(item, '@');
+                int64_t age = 0;
+                if (at) {
+                    *at = '\0';
+                    age = parse_duration(at + 1);
+                }
+                int level = atoi(item);
+                if (age < 0 || level < 1 || level > 9 || (tiers == 0) != (age == 0)) break;
+                compress_tiers[tiers].age = age;
+                compress_tiers[tiers].level = level;
+                tiers++;
+            }
+            if (tiers > 0) num_compress_tiers = tiers;
+        } else if (strncmp(line, "METRICS_LISTEN=", 15) == 0) {
+            snprintf(metrics_listen, sizeof(metrics_listen), "%s", line + 15);
+        } else if (strncmp(line, "STATSD_TARGET=", 14) == 0) {
+            snprintf(statsd_target, sizeof(statsd_target), "%s", line + 14);
+        } else if (strncmp(line, "STATSD_FORMAT=", 14) == 0) {
+            statsd_graphite = (strcmp(line + 14, "graphite") == 0);
+        } else if (strncmp(line, "STATSD_PREFIX=", 14) == 0) {
+            snprintf(statsd_prefix, sizeof(statsd_prefix), "%s", line + 14);
+        } else if (strncmp(line, "SINKS=", 6) == 0) {
+            sinks_configured = 1;
+            for (int i = 0; i < NUM_SINKS; i++) sinks[i].enabled = 0;
+            char *save = NULL;
+            for (char *name = strtok_r(line + 6, ", ", &save); name; name = strtok_r(NULL, ", ", &save)) {
+                for (int i = 0; i < NUM_SINKS; i++) {
+                    if (strcmp(name, sinks[i].name) == 0) sinks[i].enabled = 1;
+                }
+            }
+        } else if (strncmp(line, "LOG_LEVEL=", 10) == 0) {
+            int level = parse_log_level(line + 10);
+            if (level) log_level = level;
+        } else if (strncmp(line, "LOG_LEVEL_", 10) == 0) {
+            for (int i = 0; i < NUM_COLLECTORS; i++) {
+                size_t name_len = strlen(collector_names[i]);
+                if (strncmp(line + 10, collector_names[i], name_len) == 0 && line[10 + name_len] == '=') {
+                    collector_levels[i] = parse_log_level(line + 11 + name_len);
+                }
+            }
+        } else if (strncmp(line, "ANOMALY_ZSCORE=", 15) == 0) {
+            anomaly_zscore = atof(line + 15);
+        } else if (strncmp(line, "ANOMALY_ALPHA=", 14) == 0) {
+            double alpha = atof(line + 14);
+            if (alpha > 0 && alpha < 1) anomaly_alpha = alpha;
+        } else if (strncmp(line, "ANOMALY_SEASONAL=", 17) == 0) {
+            anomaly_seasonal = atoi(line + 17);
+        } else if (strncmp(line, "ANOMALY_WARMUP=", 15) == 0) {
+            anomaly_warmup = atoi(line + 15);
+        } else if (strncmp(line, "ANOMALY_MIN_STDDEV=", 19) == 0) {
+            anomaly_min_stddev = atof(line + 19);
+        } else if (strncmp(line, "ANOMALY_METRICS=", 16) == 0) {
+            snprintf(anomaly_metrics, sizeof(anomaly_metrics), "%s", line + 16);
+        } else if (strncmp(line, "TAIL=", 5) == 0) {
+            /* TAIL=<name>:<path>; the daemon's own log cannot be followed */
+            char *colon = strchr(line + 5, ':');
+            if (colon && colon > line + 5 && colon[1] == '/' && num_tails < MAX_TAILS && strcmp(colon + 1, LOG_FILE) != 0) {
+                tail_t *tail = &tails[num_tails++];
+                snprintf(tail->name, sizeof(tail->name), "%.*s", (int)(colon - line - 5), line + 5);
+                snprintf(tail->path, sizeof(tail->path), "%s", colon + 1);
+                snprintf(tail->source, sizeof(tail->source), "tail:%.*s", (int)(colon - line - 5), line + 5);
+            }
+        } else if (strncmp(line, "KMSG=", 5) == 0) {
+            kmsg_enabled = atoi(line + 5);
+        } else if (strncmp(line, "LOGINS=", 7) == 0) {
+            logins_enabled = atoi(line + 7);
+        } else if (strncmp(line, "NETLINK=", 8) == 0) {
+            netlink_enabled = atoi(line + 8);
+        } else if (strncmp(line, "SYSLOG_LISTEN=", 14) == 0) {
+            if (line[14] && num_syslog_listen < SYSLOG_MAX_LISTENERS) {
+                snprintf(syslog_listen[num_syslog_listen++], MAX_PATH_LEN, "%s", line + 14);
+            }
+        } else if (strncmp(line, "RULE=", 5) == 0) {
+            if (line[5] && num_rule_texts < RULE_MAX_RULES) {
+                char **texts = realloc(rule_texts, (size_t)(num_rule_texts + 1) * sizeof(char *));
+                if (texts) {
+                    rule_texts = texts;
+                    rule_texts[num_rule_texts] = strdup(line + 5);
+                    if (rule_texts[num_rule_texts]) num_rule_texts++;
+                }
+            }
+        } else if (strncmp(line, "REDACT=", 7) == 0) {
+            if (line[7] && num_redact_rules < REDACT_MAX_RULES) {
+                char **rules = realloc(redact_rules, (size_t)(num_redact_rules + 1) * sizeof(char *));
+                if (rules) {
+                    redact_rules = rules;
+                    redact_rules[num_redact_rules] = strdup(line + 7);
+                    if (redact_rules[num_redact_rules]) num_redact_rules++;
+                }
+            }
+        } else if (strncmp(line, "LOG_PRIORITY_SYNC=", 18) == 0) {
+            log_priority_sync = atoi(line + 18);
+        } else if (strncmp(line, "SINK_", 5) == 0) {
+            /* SINK_<NAME>_QUEUE=<records>, SINK_<NAME>_POLICY=block|drop */
+            for (int i = 0; i < NUM_SINKS; i++) {
+                size_t name_len = strlen(sinks[i].name);
+                if (strncasecmp(line + 5, sinks[i].name, name_len) != 0 || line[5 + name_len] != '_') continue;
+                const char *key = line + 6 + name_len;
+                if (strncmp(key, "QUEUE=", 6) == 0 && atoll(key + 6) >= 1) sinks[i].capacity = (uint64_t)atoll(key + 6);
+                else if (strncmp(key, "POLICY=", 7) == 0) sinks[i].drop = (strcmp(key + 7, "drop") == 0);
+            }
+        } else if (strncmp(line, "FORWARD_TARGET=", 15) == 0) {
+            snprintf(forward_target, sizeof(forward_target), "%s", line + 15);
+        } else if (strncmp(line, "FORWARD_WINDOW=", 15) == 0) {
+            long long size = atoll(line + 15);
+            if (size >= 65536 && size <= (256LL << 20)) forward_window_size = (size_t)size;
+        } else if (strncmp(line, "FORWARD_SPOOL_MAX=", 18) == 0) {
+            long long size = atoll(line + 18);
+            if (size >= 0) forward_spool_max = size;
+        } else if (strncmp(line, "STATSD_TAGS=", 12) == 0) {
+            snprintf(statsd_tags, sizeof(statsd_tags), "%s", line + 12);
+        } else if (strncmp(line, "TSDB_ENABLED=", 13) == 0) {
+            tsdb_enabled = (atoi(line + 13) != 0);
+        } else if (strncmp(line, "TSDB_RETENTION_RAW=", 19) == 0) {
+            int64_t retention = parse_duration(line + 19);
+            if (retention >= SECONDS_PER_DAY) tsdb_raw_retention = retention;
+        } else if (strncmp(line, "ROLLUP_RETENTION_", 17) == 0) {
+            for (int i = 0; i < NUM_ROLLUPS; i++) {
+                size_t suffix_len = strlen(rollup_levels[i].suffix);
+                if (strncmp(line + 17, rollup_levels[i].suffix, suffix_len) != 0 || line[17 + suffix_len] != '=') continue;
+                int64_t retention = parse_duration(line + 18 + suffix_len);
+                if (retention >= rollup_levels[i].resolution) rollup_levels[i].retention = retention;
+            }
+        } else if (strncmp(line, "STATSD_MTU=", 11) == 0) {
+            int mtu = atoi(line + 11);
+            if (mtu >= 576 && mtu <= STATSD_MAX_PAYLOAD + 68) statsd_payload = mtu - 68;
+        }
+    }
+    fclose(config);
+    return 0;
+}
+
+/* One self-contained gzip member per frame, so gzip -dc and zcat still read the segment whole */
+static long deflate_frame(z_stream *stream, int *stream_level, int level, const char *raw, size_t len,
+                          unsigned char *out, size_t capacity) {
+    if (*stream_level != level) {
+        if (*stream_level >= 0) deflateEnd(stream);
+        memset(stream, 0, sizeof(*stream));
+        *stream_level = -1;
+        if (deflateInit2(stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+        *stream_level = level;
+    } else {
+        deflateReset(stream);
+    }
+    stream->next_in = (Bytef *)raw;
+    stream->avail_in = (uInt)len;
+    stream->next_out = out;
+    stream->avail_out = (uInt)capacity;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) return -1;
+    return (long)stream->total_out;
+}
+
+static int inflate_frame(const unsigned char *gz, size_t gz_len, char *out, size_t raw_len) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 15 + 16) != Z_OK) return -1;
+    stream.next_in = (Bytef *)gz;
+    stream.avail_in = (uInt)gz_len;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = (uInt)raw_len;
+    int ok = inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == raw_len;
+    inflateEnd(&stream);
+    return ok ? 0 : -1;
+}
+
+/* Cuts [frames_raw_end, log_offset) into frames of at most log_frame_size ending on a record */
+static void write_log_frames(int final) {
+    if (frames_fd < 0) return;
+    while (log_offset > frames_raw_end && (final || log_offset - frames_raw_end >= (uint64_t)log_frame_size)) {
+        size_t len = log_offset - frames_raw_end;
+        if (len > (size_t)log_frame_size) len = (size_t)log_frame_size;
+        if (pread(frames_source_fd, frame_raw, len, (off_t)frames_raw_end) != (ssize_t)len) return;
+        if (frames_raw_end + len < log_offset) {
+            const char *newline = memrchr(frame_raw, '\n', len);
+            if (newline) len = (size_t)(newline - frame_raw) + 1;
+        }
+        long gz_len = deflate_frame(&frame_stream, &frame_stream_level, compress_tiers[0].level,
+                                    frame_raw, len, frame_out, frame_out_capacity);
+        if (gz_len < 0 || pwrite(frames_data_fd, frame_out, (size_t)gz_len, (off_t)frames_gz_end) != gz_len) return;
+        
+        int64_t ts = record_timestamp(frame_raw, len);
+        log_frame_entry_t entry = {ts >= 0 ? ts : frames_last_ts, frames_raw_end, frames_gz_end,
+                                   (uint32_t)len, (uint32_t)gz_len};
+        if (write(frames_fd, &entry, sizeof(entry)) != (ssize_t)sizeof(entry)) return;
+        frames_last_ts = entry.first_ts;
+        frames_raw_end += len;
+        frames_gz_end += (uint64_t)gz_len;
+    }
+}
+
+static void close_log_frames(void) {
+    int *fds[] = {&frames_fd, &frames_data_fd, &frames_source_fd};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) close(*fds[i]);
+        *fds[i] = -1;
+    }
+}
+
+/* Resumes after the last complete frame; whatever the daemon missed is cut from the text file */
+static void open_log_frames(void) {
+    if (log_rotate_compress != LOG_COMPRESS_FRAMES) return;
+    if (!frame_raw) {
+        frame_raw = malloc((size_t)log_frame_size);
+        frame_out_capacity = compressBound((uLong)log_frame_size) + 32;
+        frame_out = malloc(frame_out_capacity);
+    }
+    if (!frame_raw || !frame_out) return;
+    frames_source_fd = open(LOG_FILE, O_RDONLY | O_CLOEXEC);
+    frames_fd = open(LOG_FILE LOG_FRAMES_SUFFIX, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    frames_data_fd = open(LOG_FILE LOG_FRAMES_DATA_SUFFIX, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (frames_source_fd < 0 || frames_fd < 0 || frames_data_fd < 0) {
+        close_log_frames();
+        return;
+    }
+    
+    log_frames_header_t header;
+    log_frame_entry_t last;
+    struct stat st;
+    size_t count = 0;
+    frames_raw_end = frames_gz_end = 0;
+    frames_last_ts = 0;
+    if (fstat(frames_fd, &st) == 0 && (size_t)st.st_size >= sizeof(header) &&
+        pread(frames_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && header.magic == LOG_FRAMES_MAGIC) {
+        count = ((size_t)st.st_size - sizeof(header)) / sizeof(last);
+    }
+    if (count > 0 && pread(frames_fd, &last, sizeof(last), (off_t)(sizeof(header) + (count - 1) * sizeof(last))) ==
+                     (ssize_t)sizeof(last) && last.raw_offset + last.raw_len <= log_offset) {
+        frames_raw_end = last.raw_offset + last.raw_len;
+        frames_gz_end = last.gz_offset + last.gz_len;
+        frames_last_ts = last.first_ts;
+    } else {
+        count = 0;
+        header = (log_frames_header_t){LOG_FRAMES_MAGIC, (uint32_t)compress_tiers[0].level, (uint32_t)log_frame_size, 0};
+        if (pwrite(frames_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+            close_log_frames();
+            return;
+        }
+    }
+    if (ftruncate(frames_fd, (off_t)(sizeof(header) + count * sizeof(last))) != 0 ||
+        ftruncate(frames_data_fd, (off_t)frames_gz_end) != 0 || lseek(frames_fd, 0, SEEK_END) < 0) {
+        close_log_frames();
+        return;
+    }
+    write_log_frames(0);
+}
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *data, size_t len) {
+    if (crc32c_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) value = (value >> 1) ^ (0x82f63b78u & (0u - (value & 1)));
+            crc32c_table[i] = value;
+        }
+    }
+    while (len--) crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t wide = crc;
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        wide = __builtin_ia32_crc32di(wide, word);
+    }
+    crc = (uint32_t)wide;
+    while (len--) crc = __builtin_ia32_crc32qi(crc, *data++);
+    return crc;
+}
+#endif
+
+static uint32_t crc32c(const void *data, size_t len) {
+#if defined(__x86_64__)
+    static int hardware = -1;
+    if (hardware < 0) hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) return ~crc32c_hw(~0u, data, len);
+#endif
+    return ~crc32c_sw(~0u, data, len);
+}
+
+/* Keeps the records whose checksum entries match and cuts everything after the first that does not */
+static uint64_t verify_log_tail(int fd, uint64_t size, int checksum_fd) {
+    struct stat st;
+    size_t count = (checksum_fd >= 0 && fstat(checksum_fd, &st) == 0) ? (size_t)st.st_size / sizeof(log_checksum_t) : 0;
+    const log_checksum_t *entries = NULL;
+    if (count > 0) {
+        entries = mmap(NULL, count * sizeof(log_checksum_t), PROT_READ, MAP_SHARED, checksum_fd, 0);
+        if (entries == MAP_FAILED) return size;
+    }
+    
+    uint64_t valid_end = 0;
+    size_t kept = 0;
+    if (entries) {
+        uint64_t window_start = size > LOG_RECOVERY_WINDOW ? size - LOG_RECOVERY_WINDOW : 0;
+        size_t lo = 0, hi = count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (entries[mid].offset < window_start) lo = mid + 1;
+            else hi = mid;
+        }
+        kept = lo;
+        valid_end = lo > 0 ? entries[lo - 1].offset + entries[lo - 1].len : entries[0].offset;
+        char record[JSON_ARENA_SIZE];
+        for (; kept < count; kept++) {
+            const log_checksum_t *entry = &entries[kept];
+            if (entry->offset != valid_end || entry->offset + entry->len > size || entry->len > sizeof(record) ||
+                pread(fd, record, entry->len, (off_t)entry->offset) != (ssize_t)entry->len ||
+                crc32c(record, entry->len) != entry->crc) {
+                break;
+            }
+            valid_end += entry->len;
+        }
+        munmap((void *)entries, count * sizeof(log_checksum_t));
+    } else {
+        char tail[65536];
+        size_t chunk = size < sizeof(tail) ? (size_t)size : sizeof(tail);
+        valid_end = size;
+        if (pread(fd, tail, chunk, (off_t)(size - chunk)) == (ssize_t)chunk) {
+            const char *newline = memrchr(tail, '\n', chunk);
+            if (newline) valid_end = size - chunk + (uint64_t)(newline - tail) + 1;
+        }
+    }
+    if (checksum_fd >= 0 && kept < count && ftruncate(checksum_fd, (off_t)(kept * sizeof(log_checksum_t))) != 0) {
+        return size;
+    }
+    return valid_end;
+}
+
+/* Offset just past the last newline of the first size bytes of fd, 0 if there is none */
+static uint64_t last_line_start(int fd, uint64_t size) {
+    char buf[4096];
+    while (size > 0) {
+        size_t chunk = size < sizeof(buf) ? (size_t)size : sizeof(buf);
+        if (pread(fd, buf, chunk, (off_t)(size - chunk)) != (ssize_t)chunk) return 0;
+        const char *newline = memrchr(buf, '\n', chunk);
+        if (newline) return size - chunk + (uint64_t)(newline - buf) + 1;
+        size -= chunk;
+    }
+    return 0;
+}
+
+/* Drops the trailing entries of a sidecar whose u64 log offset, at field_offset, is at or past end */
+static void truncate_sidecar(const char *path, size_t entry_size, size_t field_offset, uint64_t end) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return;
+    if (fstat(fd, &st) == 0) {
+        size_t count = (size_t)st.st_size / entry_size;
+        uint64_t offset;
+        while (count > 0 && pread(fd, &offset, sizeof(offset), (off_t)((count - 1) * entry_size + field_offset)) ==
+                            (ssize_t)sizeof(offset) && offset >= end) {
+            count--;
+        }
+        if (ftruncate(fd, (off_t)(count * entry_size)) != 0) {
+            __atomic_add_fetch(&self_counters.records_dropped, 1, __ATOMIC_RELAXED);
+        }
+    }
+    close(fd);
+}
+
+/*
+ * Durable modes: truncates torn records left at the end of LOG_FILE by a crash or power loss, and
+ * the index and block filter entries for what was cut, which new records would otherwise inherit.
+ * LOG_FILE.bloom needs nothing: it is only written when the segment is closed.
+ */
+static void recover_log_tail(void) {
+    int fd = open(LOG_FILE, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    int checksum_fd = open(LOG_FILE LOG_CHECKSUM_SUFFIX, O_RDWR | O_CLOEXEC);
+    uint64_t valid_end = verify_log_tail(fd, size, checksum_fd);
+    if (checksum_fd >= 0) close(checksum_fd);
+    
+    if (valid_end < size && ftruncate(fd, (off_t)valid_end) == 0 && fdatasync(fd) == 0) {
+        log_recovered_bytes += size - valid_end;
+        truncate_sidecar(LOG_FILE LOG_INDEX_SUFFIX, sizeof(log_index_entry_t), offsetof(log_index_entry_t, offset), valid_end);
+        truncate_sidecar(LOG_FILE LOG_BLOCKS_SUFFIX, sizeof(block_filter_t), offsetof(block_filter_t, offset), valid_end);
+    }
+    close(fd);
+}
+
+int open_log_file(void) {
+    if (log_durability != LOG_DURABILITY_NONE) recover_log_tail();
+    else unlink(LOG_FILE LOG_CHECKSUM_SUFFIX);
+    log_file = fopen(LOG_FILE, "a");
+    if (!log_file) {
+        fprintf(stderr, "Error opening file %s: %s\n", LOG_FILE, strerror(errno));
+        return -1;
+    }
+    setvbuf(log_file, NULL, _IOFBF, LOG_BUFFER_SIZE);
+    
+    struct stat st;
+    log_offset = (fstat(fileno(log_file), &st) == 0) ? (uint64_t)st.st_size : 0;
+    log_index_fd = open(LOG_FILE LOG_INDEX_SUFFIX, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    log_index_next = log_offset;
+    log_index_entry_t last_entry;
+    log_index_ts = INT64_MIN;
+    if (log_index_fd >= 0 && fstat(log_index_fd, &st) == 0 && st.st_size >= (off_t)sizeof(last_entry) &&
+        pread(log_index_fd, &last_entry, sizeof(last_entry), st.st_size - st.st_size % (off_t)sizeof(last_entry) -
+              (off_t)sizeof(last_entry)) == (ssize_t)sizeof(last_entry)) {
+        log_index_ts = last_entry.ts;
+    }
+    
+    log_blocks_fd = open(LOG_FILE LOG_BLOCKS_SUFFIX, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log_durability != LOG_DURABILITY_NONE) {
+        log_checksum_fd = open(LOG_FILE LOG_CHECKSUM_SUFFIX, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    }
+    memset(&current_block, 0, sizeof(current_block));
+    current_block_used = 0;
+    unlink(LOG_FILE LOG_BLOOM_SUFFIX);
+    if (!segment_bloom) segment_bloom = malloc(BLOOM_SEGMENT_BITS / 8);
+    if (segment_bloom) memset(segment_bloom, 0, BLOOM_SEGMENT_BITS / 8);
+    segment_bloom_complete = (log_offset == 0);
+    open_log_frames();
+    return 0;
+}
+
+static void flush_block_filter(void) {
+    if (current_block_used && log_blocks_fd >= 0) {
+        if (write(log_blocks_fd, &current_block, sizeof(current_block)) != (ssize_t)sizeof(current_block)) {
+            __atomic_add_fetch(&self_counters.records_dropped, 1, __ATOMIC_RELAXED);
+        }
+    }
+    memset(current_block.bits, 0, sizeof(current_block.bits));
+    current_block_used = 0;
+}
+
+/* Writes LOG_FILE.bloom; skipped when the daemon started mid-segment and missed earlier tokens */
+static void write_segment_bloom(void) {
+    if (!segment_bloom || !segment_bloom_complete) return;
+    int fd = open(LOG_FILE LOG_BLOOM_SUFFIX ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    bloom_header_t header = {BLOOM_MAGIC, BLOOM_SEGMENT_HASHES, BLOOM_SEGMENT_BITS};
+    int ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+             write(fd, segment_bloom, BLOOM_SEGMENT_BITS / 8) == (ssize_t)(BLOOM_SEGMENT_BITS / 8);
+    if (close(fd) != 0 || !ok || rename(LOG_FILE LOG_BLOOM_SUFFIX ".tmp", LOG_FILE LOG_BLOOM_SUFFIX) != 0) {
+        unlink(LOG_FILE LOG_BLOOM_SUFFIX ".tmp");
+    }
+}
+
+/* Group commit: the log before its checksums, so a durable entry always describes durable bytes */
+static void log_sync(void) {
+    if (!log_file || log_unsynced_bytes == 0) return;
+    uint64_t start = monotonic_ns();
+    if (fflush(log_file) != 0 || fdatasync(fileno(log_file)) != 0 || (log_checksum_fd >= 0 && fdatasync(log_checksum_fd) != 0)) {
+        __atomic_add_fetch(&self_counters.records_dropped, 1, __ATOMIC_RELAXED);
+    }
+    hist_record(&hists[HIST_LOG_SYNC], monotonic_ns() - start);
+    log_unsynced_bytes = 0;
+    log_sync_deadline_ns = 0;
+}
+
+/*
+ * Recovery stops at the first gap in LOG_FILE.crc and would cut every record after it, so a failed
+ * checksum write (or a failed log write, which leaves entries for bytes that never got there) starts
+ * the file over once the log is synced: recovery then trusts everything before the first new entry.
+ * If the log cannot be synced, LOG_FILE.crc is removed and recovery falls back to cutting at the
+ * last newline.
+ */
+static void log_restart_checksums(void) {
+    if (log_checksum_fd >= 0) close(log_checksum_fd);
+    log_checksum_fd = -1;
+    if (fflush(log_file) != 0 || fdatasync(fileno(log_file)) != 0) {
+        unlink(LOG_FILE LOG_CHECKSUM_SUFFIX);
+        return;
+    }
+    log_checksum_fd = open(LOG_FILE LOG_CHECKSUM_SUFFIX, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (log_checksum_fd < 0) unlink(LOG_FILE LOG_CHECKSUM_SUFFIX);
+}
+
+static void log_commit_record(uint64_t offset, const char *record, size_t len) {
+    log_checksum_t entry = {offset, (uint32_t)len, crc32c(record, len)};
+    if (log_checksum_fd < 0 || write(log_checksum_fd, &entry, sizeof(entry)) != (ssize_t)sizeof(entry)) {
+        fprintf(stderr, "Error writing %s at offset %llu: %s; restarting checksums\n", LOG_FILE LOG_CHECKSUM_SUFFIX,
+                (unsigned long long)offset, strerror(errno));
+        __atomic_add_fetch(&self_counters.records_dropped, 1, __ATOMIC_RELAXED);
+        log_restart_checksums();
+    }
+    log_unsynced_bytes += len;
+    if (log_durability == LOG_DURABILITY_EVERY_RECORD ||
+        (log_sync_bytes > 0 && log_unsynced_bytes >= (uint64_t)log_sync_bytes)) {
+        log_sync();
+        return;
+    }
+    
+    if (log_sync_deadline_ns == 0) log_sync_deadline_ns = monotonic_ns() + (uint64_t)log_sync_interval_ms * 1000000ULL;
+}
+
+void close_log_file(void) {
+    log_sync();
+    if (log_checksum_fd >= 0) {
+        close(log_checksum_fd);
+        log_checksum_fd = -1;
+    }
+    if (log_file) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+    flush_block_filter();
+    close_log_frames();
+    if (log_blocks_fd >= 0) {
+        close(log_blocks_fd);
+        log_blocks_fd = -1;
+    }
+    if (log_index_fd >= 0) {
+        close(log_index_fd);
+        log_index_fd = -1;
+    }
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Rotated segments are LOG_FILE.YYYYMMDD-HHMMSS[.gz] plus their .idx; the active file sorts last */
+int list_log_segments(log_segment_t **segments) {
+    DIR *dir = opendir(LOG_DIR);
+    if (!dir) return -1;
+    char **names = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        size_t len = strlen(name);
+        if (strncmp(name, LOG_BASENAME ".", sizeof(LOG_BASENAME)) != 0) continue;
+        int sidecar = (len >= 4 && strcmp(name + len - 4, ".tmp") == 0);
+        for (size_t s = 0; s < NUM_LOG_SIDECARS && !sidecar; s++) {
+            size_t suffix_len = strlen(log_sidecar_suffixes[s]);
+            sidecar = (len >= suffix_len && strcmp(name + len - suffix_len, log_sidecar_suffixes[s]) == 0);
+        }
+        if (sidecar) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            char **grown = realloc(names, capacity * sizeof(char *));
+            if (!grown) break;
+            names = grown;
+        }
+        names[count++] = strdup(name);
+    }
+    closedir(dir);
+    if (count > 1) qsort(names, count, sizeof(char *), compare_names);
+    
+    *segments = calloc(count + 1, sizeof(log_segment_t));
+    if (!*segments) {
+        for (size_t i = 0; i < count; i++) free(names[i]);
+        free(names);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        log_segment_t *segment = &(*segments)[i];
+        size_t len = strlen(names[i]);
+        segment->compressed = (len > 3 && strcmp(names[i] + len - 3, ".gz") == 0);
+        snprintf(segment->path, sizeof(segment->path), "%s/%s", LOG_DIR, names[i]);
+        snprintf(segment->base, sizeof(segment->base), "%s/%.*s", LOG_DIR,
+                 (int)(segment->compressed ? len - 3 : len), names[i]);
+        snprintf(segment->index_path, sizeof(segment->index_path), "%s%s", segment->base, LOG_INDEX_SUFFIX);
+        free(names[i]);
+    }
+    free(names);
+    snprintf((*segments)[count].path, sizeof((*segments)[count].path), "%s", LOG_FILE);
+    snprintf((*segments)[count].base, sizeof((*segments)[count].base), "%s", LOG_FILE);
+    snprintf((*segments)[count].index_path, sizeof((*segments)[count].index_path), "%s", LOG_FILE LOG_INDEX_SUFFIX);
+    return (int)count + 1;
+}
+
+static void compress_segment(const char *path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("gzip", "gzip", "-q", "-f", path, (char *)NULL);
+        _exit(127);
+    }
+}
+
+void rotate_log_file(void) {
+    char suffix[32], rotated[MAX_PATH_LEN];
+    time_t now = time(NULL);
+    strftime(suffix, sizeof(suffix), "%Y%m%d-%H%M%S", localtime(&now));
+    snprintf(rotated, sizeof(rotated), "%s.%s", LOG_FILE, suffix);
+    for (int n = 1; access(rotated, F_OK) == 0; n++) {
+        snprintf(rotated, sizeof(rotated), "%s.%s-%d", LOG_FILE, suffix, n);
+    }
+    
+    write_segment_bloom();
+    fflush(log_file);
+    write_log_frames(1);
+    int framed = (frames_fd >= 0 && frames_raw_end == log_offset);
+    close_log_file();
+    for (size_t i = 0; i < NUM_LOG_SIDECARS; i++) {
+        char from[MAX_PATH_LEN], to[MAX_PATH_LEN + 8];
+        snprintf(from, sizeof(from), "%s%s", LOG_FILE, log_sidecar_suffixes[i]);
+        snprintf(to, sizeof(to), "%s%s", rotated, log_sidecar_suffixes[i]);
+        rename(from, to);
+    }
+    if (rename(LOG_FILE, rotated) == 0) {
+        char part[MAX_PATH_LEN + 8], compressed[MAX_PATH_LEN + 8];
+        snprintf(part, sizeof(part), "%s%s", rotated, LOG_FRAMES_DATA_SUFFIX);
+        snprintf(compressed, sizeof(compressed), "%s.gz", rotated);
+        if (framed && rename(part, compressed) == 0) {
+            unlink(rotated);
+        } else {
+            unlink(part);
+            snprintf(part, sizeof(part), "%s%s", rotated, LOG_FRAMES_SUFFIX);
+            unlink(part);
+            if (log_rotate_compress) compress_segment(rotated);
+        }
+    }
+    if (open_log_file() != 0) return;
+    
+    log_segment_t *segments;
+    int count = list_log_segments(&segments);
+    for (int i = 0; i < count - 1 - log_rotate_keep; i++) {
+        unlink(segments[i].path);
+        for (size_t j = 0; j < NUM_LOG_SIDECARS; j++) {
+            char path[MAX_PATH_LEN + 8];
+            snprintf(path, sizeof(path), "%s%s", segments[i].base, log_sidecar_suffixes[j]);
+            unlink(path);
+        }
+    }
+    if (count > 0) free(segments);
+}
+
+static int compress_level_for_age(int64_t age) {
+    int level = compress_tiers[0].level;
+    int64_t matched = 0;
+    for (int i = 1; i < num_compress_tiers; i++) {
+        if (age >= compress_tiers[i].age && compress_tiers[i].age >= matched) {
+            matched = compress_tiers[i].age;
+            level = compress_tiers[i].level;
+        }
+    }
+    return level;
+}
+
+static void unmap_log_frames(log_frames_t *frames) {
+    if (frames->header) munmap((void *)frames->header, frames->frames_size);
+    if (frames->data) munmap((void *)frames->data, frames->data_size);
+    memset(frames, 0, sizeof(*frames));
+}
+
+/* Maps a framed segment and its .frm; fails when the two disagree, e.g. mid-recompression */
+static int map_log_frames(const log_segment_t *segment, log_frames_t *frames) {
+    char path[MAX_PATH_LEN + 8];
+    memset(frames, 0, sizeof(*frames));
+    snprintf(path, sizeof(path), "%s%s", segment->base, LOG_FRAMES_SUFFIX);
+    const void *maps[2] = {NULL, NULL};
+    size_t sizes[2] = {0, 0};
+    const char *paths[2] = {path, segment->path};
+    for (int i = 0; i < 2; i++) {
+        int fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            maps[i] = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (maps[i] == MAP_FAILED) maps[i] = NULL;
+            else sizes[i] = (size_t)st.st_size;
+        }
+        close(fd);
+    }
+    frames->header = maps[0];
+    frames->frames_size = sizes[0];
+    frames->data = maps[1];
+    frames->data_size = sizes[1];
+    if (frames->header && frames->data && frames->frames_size > sizeof(log_frames_header_t) &&
+        frames->header->magic == LOG_FRAMES_MAGIC) {
+        frames->entries = (const log_frame_entry_t *)(frames->header + 1);
+        frames->count = (frames->frames_size - sizeof(log_frames_header_t)) / sizeof(log_frame_entry_t);
+        if (frames->count > 0) {
+            const log_frame_entry_t *last = &frames->entries[frames->count - 1];
+            if (last->gz_offset + last->gz_len == frames->data_size) return 0;
+        }
+    }
+    unmap_log_frames(frames);
+    return -1;
+}
+
+/*
+ * The recompression pass runs in its own thread rather than a forked child, which would inherit
+ * whatever locks the sink threads held at fork time. stop_recompress cuts it short at the next frame.
+ */
+static pthread_t recompress_thread;
+static int recompress_started = 0, recompress_finished = 0, recompress_stopping = 0;
+
+/* Re-deflates every frame of a rotated segment at the level for its age, keeping the frame cuts */
+static void recompress_segment(const log_segment_t *segment, time_t now) {
+    log_frames_t frames;
+    if (map_log_frames(segment, &frames) != 0) return;
+    int64_t age = now - frames.entries[frames.count - 1].first_ts;
+    int level = compress_level_for_age(age);
+    if ((uint32_t)level <= frames.header->level) {
+        unmap_log_frames(&frames);
+        return;
+    }
+    
+    char frames_path[MAX_PATH_LEN + 8], frames_tmp[MAX_PATH_LEN + 16], data_tmp[MAX_PATH_LEN + 8];
+    snprintf(frames_path, sizeof(frames_path), "%s%s", segment->base, LOG_FRAMES_SUFFIX);
+    snprintf(frames_tmp, sizeof(frames_tmp), "%s.tmp", frames_path);
+    snprintf(data_tmp, sizeof(data_tmp), "%s.tmp", segment->path);
+    int lock_fd = open(frames_path, O_RDONLY | O_CLOEXEC);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        if (lock_fd >= 0) close(lock_fd);
+        unmap_log_frames(&frames);
+        return;
+    }
+    
+    uint32_t max_raw = 0;
+    for (size_t i = 0; i < frames.count; i++) {
+        if (frames.entries[i].raw_len > max_raw) max_raw = frames.entries[i].raw_len;
+    }
+    size_t capacity = compressBound(max_raw) + 32;
+    char *raw = malloc(max_raw);
+    unsigned char *out = malloc(capacity);
+    FILE *index = fopen(frames_tmp, "w");
+    FILE *data = fopen(data_tmp, "w");
+    z_stream stream;
+    int stream_level = -1;
+    uint64_t gz_offset = 0;
+    log_frames_header_t header = *frames.header;
+    header.level = (uint32_t)level;
+    int ok = raw && out && index && data && fwrite(&header, sizeof(header), 1, index) == 1;
+    for (size_t i = 0; ok && i < frames.count; i++) {
+        log_frame_entry_t entry = frames.entries[i];
+        if (__atomic_load_n(&recompress_stopping, __ATOMIC_RELAXED)) {
+            ok = 0;
+            break;
+        }
+        ok = inflate_frame(frames.data + entry.gz_offset, entry.gz_len, raw, entry.raw_len) == 0;
+        long gz_len = ok ? deflate_frame(&stream, &stream_level, level, raw, entry.raw_len, out, capacity) : -1;
+        ok = gz_len >= 0 && fwrite(out, 1, (size_t)gz_len, data) == (size_t)gz_len;
+        entry.gz_offset = gz_offset;
+        entry.gz_len = (uint32_t)gz_len;
+        ok = ok && fwrite(&entry, sizeof(entry), 1, index) == 1;
+        gz_offset += (uint64_t)gz_len;
+    }
+    if (stream_level >= 0) deflateEnd(&stream);
+    if (index && fclose(index) != 0) ok = 0;
+    if (data && fclose(data) != 0) ok = 0;
+    if (ok && rename(data_tmp, segment->path) == 0) {
+        rename(frames_tmp, frames_path);
+    } else {
+        unlink(data_tmp);
+        unlink(frames_tmp);
+    }
+    free(raw);
+    free(out);
+    close(lock_fd);
+    unmap_log_frames(&frames);
+}
+
+static void *recompress_worker(void *arg __attribute__((unused))) {
+    time_t now = time(NULL);
+    log_segment_t *segments;
+    int count = list_log_segments(&segments);
+    for (int i = 0; i < count - 1 && !__atomic_load_n(&recompress_stopping, __ATOMIC_RELAXED); i++) {
+        if (segments[i].compressed) recompress_segment(&segments[i], now);
+    }
+    if (count >= 0) free(segments);
+    __atomic_store_n(&recompress_finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* At most hourly, and never while the previous pass runs, moves rotated framed segments to their age's level */
+void recompress_aged_segments(void) {
+    static time_t last_run = 0;
+    time_t now = time(NULL);
+    if (log_rotate_compress != LOG_COMPRESS_FRAMES || num_compress_tiers < 2 || now - last_run < RECOMPRESS_INTERVAL) {
+        return;
+    }
+    if (recompress_started) {
+        if (!__atomic_load_n(&recompress_finished, __ATOMIC_ACQUIRE)) return;
+        pthread_join(recompress_thread, NULL);
+        recompress_started = 0;
+    }
+    last_run = now;
+    recompress_finished = 0;
+    recompress_started = (pthread_create(&recompress_thread, NULL, recompress_worker, NULL) == 0);
+}
+
+void stop_recompress(void) {
+    if (!recompress_started) return;
+    __atomic_store_n(&recompress_stopping, 1, __ATOMIC_RELAXED);
+    pthread_join(recompress_thread, NULL);
+    recompress_started = 0;
+}
+
+static size_t json_room(const json_arena_t *arena) {
+    return sizeof(arena->data) - JSON_ARENA_RESERVE - arena->len;
+}
+
+/* Pieces that do not fit whole are dropped, so escapes and numbers are never split */
+static void json_put_raw(json_arena_t *arena, const char *text, size_t len) {
+    if (arena->truncated) return;
+    if (len > json_room(arena)) {
+        arena->truncated = 1;
+        return;
+    }
+    memcpy(arena->data + arena->len, text, len);
+    arena->len += len;
+}
+
+#define JSON_PUT_LITERAL(arena, literal) json_put_raw(arena, literal, sizeof(literal) - 1)
+
+/* Length of the leading run that needs no JSON escaping: no control bytes, quotes or backslashes */
+static size_t json_plain_prefix(const char *text, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(text + i));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                       _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+        int mask = _mm_movemask_epi8(special);
+        if (mask) return i + (size_t)__builtin_ctz((unsigned int)mask);
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c < 0x20 || c == '"' || c == '\\') break;
+    }
+    return i;
+}
+
+static void json_put_escaped(json_arena_t *arena, const char *text, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    while (len > 0) {
+        if (arena->truncated) return;
+        size_t plain = json_plain_prefix(text, len);
+        if (plain > json_room(arena)) {
+            plain = json_room(arena);
+            while (plain > 0 && ((unsigned char)text[plain] & 0xc0) == 0x80) plain--;
+            memcpy(arena->data + arena->len, text, plain);
+            arena->len += plain;
+            arena->truncated = 1;
+            return;
+        }
+        json_put_raw(arena, text, plain);
+        text += plain;
+        len -= plain;
+        if (len == 0) break;
+        
+        unsigned char c = (unsigned char)*text++;
+        len--;
+        char escape[6] = {'\\', (char)c, 0, 0, 0, 0};
+        size_t escape_len = 2;
+        if (c == '\n') escape[1] = 'n';
+        else if (c == '\t') escape[1] = 't';
+        else if (c == '\r') escape[1] = 'r';
+        else if (c < 0x20) {
+            escape[1] = 'u';
+            escape[2] = '0';
+            escape[3] = '0';
+            escape[4] = hex[c >> 4];
+            escape[5] = hex[c & 15];
+            escape_len = 6;
+        }
+        json_put_raw(arena, escape, escape_len);
+    }
+}
+
+/* Once opened the string is always closed, out of the reserve if need be */
+static void json_put_string(json_arena_t *arena, const char *text) {
+    JSON_PUT_LITERAL(arena, "\"");
+    if (arena->truncated) return;
+    json_put_escaped(arena, text, strlen(text));
+    arena->data[arena->len++] = '"';
+}
+
+static void json_put_number(json_arena_t *arena, double value) {
+    char digits[32];
+    size_t len;
+    if (value == value && value >= -9007199254740992.0 && value <= 9007199254740992.0 && value == (double)(int64_t)value) {
+        int64_t integer = (int64_t)value;
+        uint64_t magnitude = integer < 0 ? (uint64_t)-integer : (uint64_t)integer;
+        char *p = digits + sizeof(digits);
+        do {
+            *--p = (char)('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude);
+        if (integer < 0) *--p = '-';
+        len = (size_t)(digits + sizeof(digits) - p);
+        json_put_raw(arena, p, len);
+        return;
+    }
+    if (value != value || value > 1.7976931348623157e308 || value < -1.7976931348623157e308) {
+        JSON_PUT_LITERAL(arena, "null");
+        return;
+    }
+    len = (size_t)snprintf(digits, sizeof(digits), "%.15g", value);
+    json_put_raw(arena, digits, len);
+}
+
+/* {"ts":"...","level":"...","user":"...","collector":"...","msg":"...","metrics":{...},"event":{...}} */
+static size_t format_json_record(json_arena_t *arena, time_t now, const char *level, const char *username,
+                                 const char *message, const record_fields_t *fields) {
+    static char ts[32];
+    static size_t ts_len;
+    static time_t ts_at = -1;
+    if (now != ts_at) {
+        ts_len = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+        ts_at = now;
+    }
+    arena->len = 0;
+    arena->truncated = 0;
+    JSON_PUT_LITERAL(arena, "{\"ts\":\"");
+    json_put_raw(arena, ts, ts_len);
+    JSON_PUT_LITERAL(arena, "\",\"level\":\"");
+    json_put_raw(arena, level, strlen(level));
+    JSON_PUT_LITERAL(arena, "\",\"user\":");
+    json_put_string(arena, username);
+    if (fields && fields->collector) {
+        JSON_PUT_LITERAL(arena, ",\"collector\":");
+        json_put_string(arena, fields->collector);
+    }
+    JSON_PUT_LITERAL(arena, ",\"msg\":");
+    json_put_string(arena, message);
+    
+    /* metrics and event are all or nothing: a cut inside them goes back to before the field */
+    size_t field_start = arena->len;
+    if (fields && fields->num_metrics > 0) {
+        JSON_PUT_LITERAL(arena, ",\"metrics\":{");
+        for (int i = 0; i < fields->num_metrics; i++) {
+            if (i > 0) JSON_PUT_LITERAL(arena, ",");
+            json_put_string(arena, fields->metrics[i].name);
+            JSON_PUT_LITERAL(arena, ":");
+            json_put_number(arena, fields->metrics[i].value);
+        }
+        JSON_PUT_LITERAL(arena, "}");
+        if (arena->truncated) arena->len = field_start;
+    }
+    field_start = arena->len;
+    if (fields && fields->event_dir) {
+        JSON_PUT_LITERAL(arena, ",\"event\":{\"path\":\"");
+        json_put_escaped(arena, fields->event_dir, strlen(fields->event_dir));
+        if (fields->event_file) {
+            JSON_PUT_LITERAL(arena, "/");
+            json_put_escaped(arena, fields->event_file, strlen(fields->event_file));
+        }
+        JSON_PUT_LITERAL(arena, "\",\"dir\":");
+        json_put_string(arena, fields->event_dir);
+        JSON_PUT_LITERAL(arena, ",\"type\":");
+        json_put_string(arena, fields->event_type ? fields->event_type : "modification");
+        JSON_PUT_LITERAL(arena, "}");
+        if (arena->truncated) arena->len = field_start;
+    }
+    memcpy(arena->data + arena->len, "}\n", 2);
+    arena->len += 2;
+    return arena->len;
+}
+
+static void forward_disconnect(void) {
+    forwarder_t *f = &forwarder;
+    if (f->fd >= 0) {
+        poll_unregister(f->fd);
+        close(f->fd);
+    }
+    f->fd = -1;
+    f->connected = 0;
+    f->window_sent = 0;
+    f->ack_len = 0;
+    f->retry_at = time(NULL) + f->backoff;
+    if (f->backoff < FORWARD_MAX_BACKOFF) f->backoff *= 2;
+}
+
+static void forward_flush(void) {
+    forwarder_t *f = &forwarder;
+    while (f->connected && f->window_sent < f->window_len) {
+        ssize_t n = send(f->fd, f->window + f->window_sent, f->window_len - f->window_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) forward_disconnect();
+            break;
+        }
+        f->window_sent += (size_t)n;
+    }
+    if (f->connected) poll_set_events(f->fd, f->window_sent < f->window_len ? POLLIN | POLLOUT : POLLIN);
+}
+
+/* Replaces the spool file with head followed by the frames not yet read back from the spool */
+static int forward_rewrite_spool(const char *head, size_t head_len) {
+    forwarder_t *f = &forwarder;
+    int fd = open(FORWARD_SPOOL_FILE ".tmp", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    int ok = write(fd, head, head_len) == (ssize_t)head_len;
+    char buf[65536];
+    for (uint64_t offset = f->spool_read; ok && offset < f->spool_size;) {
+        size_t chunk = f->spool_size - offset < sizeof(buf) ? (size_t)(f->spool_size - offset) : sizeof(buf);
+        ssize_t n = pread(f->spool_fd, buf, chunk, (off_t)offset);
+        ok = n > 0 && write(fd, buf, (size_t)n) == n;
+        offset += (uint64_t)(n > 0 ? n : 0);
+    }
+    if (!ok || rename(FORWARD_SPOOL_FILE ".tmp", FORWARD_SPOOL_FILE) != 0) {
+        close(fd);
+        unlink(FORWARD_SPOOL_FILE ".tmp");
+        return -1;
+    }
+    close(f->spool_fd);
+    f->spool_fd = fd;
+    f->spool_size = head_len + (f->spool_size - f->spool_read);
+    f->spool_read = 0;
+    return 0;
+}
+
+/*
+ * The file only empties when it is fully drained, so under constant backpressure the prefix that
+ * was already read back is cut off instead; that happens once it is a quarter of the file, which
+ * bounds the copying and keeps the file within FORWARD_SPOOL_MAX.
+ */
+static int forward_spool_append(const unsigned char *header, const char *record, size_t len) {
+    forwarder_t *f = &forwarder;
+    size_t frame = FORWARD_FRAME_HEADER + len;
+    if (f->spool_fd < 0 || f->spool_size - f->spool_read + frame > (uint64_t)forward_spool_max) return -1;
+    if (f->spool_size + frame > (uint64_t)forward_spool_max &&
+        (f->spool_read < (uint64_t)forward_spool_max / 4 || forward_rewrite_spool(NULL, 0) != 0)) {
+        return -1;
+    }
+    struct iovec iov[2] = {{(void *)header, FORWARD_FRAME_HEADER}, {(void *)record, len}};
+    if (pwritev(f->spool_fd, iov, 2, (off_t)f->spool_size) != (ssize_t)frame) {
+        if (ftruncate(f->spool_fd, (off_t)f->spool_size) != 0) {
+            __atomic_add_fetch(&self_counters.records_dropped, 1, __ATOMIC_RELAXED);
+        }
+        return -1;
+    }
+    f->spool_size += frame;
+    return 0;
+}
+
+/*
+ * Moves spooled frames back into the window, oldest first, while they fit. A frame that can never
+ * fit (spooled under a larger FORWARD_WINDOW) is skipped; a failed read is retried on the next call.
+ * The file is emptied only once every frame in it has been taken.
+ */
+static void forward_refill(void) {
+    forwarder_t *f = &forwarder;
+    while (f->spool_read < f->spool_size) {
+        unsigned char header[FORWARD_FRAME_HEADER];
+        if (pread(f->spool_fd, header, sizeof(header), (off_t)f->spool_read) != (ssize_t)sizeof(header)) return;
+        uint32_t len;
+        memcpy(&len, header, sizeof(len));
+        size_t frame = FORWARD_FRAME_HEADER + be32toh(len);
+        if (frame > forward_window_size) {
+            f->spool_read += frame;
+            f->oversize++;
+            continue;
+        }
+        if (f->window_len + frame > forward_window_size) return;
+        if (pread(f->spool_fd, f->window + f->window_len, frame, (off_t)f->spool_read) != (ssize_t)frame) return;
+        f->window_len += frame;
+        f->spool_read += frame;
+    }
+    if (f->spool_size > 0 && ftruncate(f->spool_fd, 0) == 0) f->spool_read = f->spool_size = 0;
+}
+
+static void forward_ack(uint64_t seq) {
+    forwarder_t *f = &forwarder;
+    size_t offset = 0;
+    while (offset + FORWARD_FRAME_HEADER <= f->window_sent) {
+        uint32_t len;
+        uint64_t frame_seq;
+        memcpy(&len, f->window + offset, sizeof(len));
+        memcpy(&frame_seq, f->window + offset + 4, sizeof(frame_seq));
+        size_t frame = FORWARD_FRAME_HEADER + be32toh(len);
+        if (be64toh(frame_seq) > seq || offset + frame > f->window_sent) break;
+        offset += frame;
+    }
+    memmove(f->window, f->window + offset, f->window_len - offset);
+    f->window_len -= offset;
+    f->window_sent -= offset;
+    forward_refill();
+}
+
+static void forward_reserve_seq(void) {
+    forwarder_t *f = &forwarder;
+    uint64_t reserved = f->next_seq + FORWARD_SEQ_RESERVE;
+    FILE *file = fopen(FORWARD_SEQ_FILE ".tmp", "w");
+    if (!file) return;
+    int ok = fprintf(file, "%llu\n", (unsigned long long)reserved) > 0;
+    if (fclose(file) == 0 && ok && rename(FORWARD_SEQ_FILE ".tmp", FORWARD_SEQ_FILE) == 0) f->seq_reserved = reserved;
+    else unlink(FORWARD_SEQ_FILE ".tmp");
+}
+
+static void forward_record(const char *record, size_t len) {
+    forwarder_t *f = &forwarder;
+    if (!f->window) return;
+    if (f->next_seq >= f->seq_reserved) forward_reserve_seq();
+    unsigned char header[FORWARD_FRAME_HEADER];
+    uint32_t be_len = htobe32((uint32_t)len);
+    uint64_t be_seq = htobe64(f->next_seq++);
+    memcpy(header, &be_len, sizeof(be_len));
+    memcpy(header + 4, &be_seq, sizeof(be_seq));
+    
+    if (sizeof(header) + len > forward_window_size) {
+        f->oversize++;
+    } else if (f->spool_read == f->spool_size && f->window_len + sizeof(header) + len <= forward_window_size) {
+        memcpy(f->window + f->window_len, header, sizeof(header));
+        memcpy(f->window + f->window_len + sizeof(header), record, len);
+        f->window_len += sizeof(header) + len;
+        forward_flush();
+    } else if (forward_spool_append(header, record, len) != 0) {
+        f->dropped++;
+    }
+}
+
+static void forward_handler(int fd, short revents, void *arg __attribute__((unused))) {
+    forwarder_t *f = &forwarder;
+    if (!f->connected) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if ((revents & (POLLERR | POLLHUP | POLLNVAL)) ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0 || error != 0) {
+            forward_disconnect();
+            return;
+        }
+        f->connected = 1;
+        f->backoff = 1;
+        f->window_sent = 0;
+        forward_flush();
+        return;
+    }
+    
+    if (revents & POLLIN) {
+        while (1) {
+            ssize_t n = recv(fd, f->ack + f->ack_len, sizeof(f->ack) - f->ack_len, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) break;
+            if (n <= 0) {
+                forward_disconnect();
+                return;
+            }
+            f->ack_len += (size_t)n;
+            if (f->ack_len == sizeof(f->ack)) {
+                uint64_t seq;
+                memcpy(&seq, f->ack, sizeof(seq));
+                forward_ack(be64toh(seq));
+                f->ack_len = 0;
+            }
+        }
+    } else if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        forward_disconnect();
+        return;
+    }
+    forward_flush();
+}
+
+static void format_text_record(json_arena_t *arena, const char *time_str, const char *level,
+                               const char *username, const char *message) {
+    int len = snprintf(arena->data, sizeof(arena->data), "[%s] [%s] [%s] %s\n", time_str, level, username, message);
+    arena->len = (len < 0) ? 0 : (size_t)len;
+    if (arena->len >= sizeof(arena->data)) {
+        arena->len = sizeof(arena->data) - 1;
+        arena->data[arena->len - 1] = '\n';
+    }
+}
+
+/*
+ * After a failed write the stdio buffer, log_offset and the sidecars no longer match the file: the
+ * unwritten bytes are dropped, a torn record at the end is cut (that needs no free space) and
+ * everything carries on from there
+ */
+static void file_sink_resync(void) {
+    struct stat st;
+    __fpurge(log_file);
+    clearerr(log_file);
+    if (fstat(fileno(log_file), &st) != 0) return;
+    log_offset = last_line_start(fileno(log_file), (uint64_t)st.st_size);
+    if (log_offset < (uint64_t)st.st_size && ftruncate(fileno(log_file), (off_t)log_offset) != 0) {
+        log_offset = (uint64_t)st.st_size;
+    }
+    log_index_next = log_offset;
+    truncate_sidecar(LOG_FILE LOG_INDEX_SUFFIX, sizeof(log_index_entry_t), offsetof(log_index_entry_t, offset), log_offset);
+    truncate_sidecar(LOG_FILE LOG_BLOCKS_SUFFIX, sizeof(block_filter_t), offsetof(block_filter_t, offset), log_offset);
+    memset(current_block.bits, 0, sizeof(current_block.bits));
+    current_block_used = 0;
+    if (log_durability != LOG_DURABILITY_NONE) log_restart_checksums();
+}
+
+static int file_sink_deliver(const sink_entry_t *entry, const char *line, const char *user __attribute__((unused)),
+                             const char *msg __attribute__((unused))) {
+    if (!log_file) return -1;
+    int priority_class = (entry->priority <= SINK_PRIORITY_LEVEL);
+    uint64_t start = monotonic_ns();
+    if (entry->ts > log_index_ts) log_index_ts = entry->ts;
+    if (log_index_fd >= 0 && log_offset >= log_index_next) {
+        log_index_entry_t index_entry = {log_index_ts, log_offset};
+        if (write(log_index_fd, &index_entry, sizeof(index_entry)) == (ssize_t)sizeof(index_entry)) {
+            log_index_next = log_offset + (uint64_t)log_index_interval;
+            flush_block_filter();
+            current_block.offset = log_offset;
+        }
+    }
+    add_record_tokens(line, entry->line_len);
+    int ok = fwrite(line, 1, entry->line_len, log_file) == entry->line_len;
+    if (ok && (priority_class || log_durability != LOG_DURABILITY_NONE)) ok = fflush(log_file) == 0;
+    if (!ok) {
+        __atomic_add_fetch(&self_counters.records_dropped, 1, __ATOMIC_RELAXED);
+        file_sink_resync();
+    } else {
+        if (log_durability != LOG_DURABILITY_NONE) log_commit_record(log_offset, line, entry->line_len);
+        __atomic_add_fetch(&self_counters.bytes_written, entry->line_len, __ATOMIC_RELAXED);
+        log_offset += entry->line_len;
+        if (priority_class && log_priority_sync) {
+            if (log_durability != LOG_DURABILITY_NONE) log_sync();
+            else fdatasync(fileno(log_file));
+        }
+    }
+    uint64_t end = monotonic_ns();
+    hist_record(&hists[HIST_FILE_WRITE], end - start);
+    hist_record(&hists[priority_class ? HIST_ENQUEUE_TO_DISK_PRIORITY : HIST_ENQUEUE_TO_DISK], end - entry->enqueued_ns);
+    if (log_rotate_size > 0 && log_offset >= (uint64_t)log_rotate_size) rotate_log_file();
+    return ok ? 0 : -1;
+}
+
+/* Ordinary records reach the file once per batch; frames are cut from what has been flushed */
+static void file_sink_flush(void) {
+    if (!log_file) return;
+    if (fflush(log_file) != 0) {
+        __atomic_add_fetch(&self_counters.records_dropped, 1, __ATOMIC_RELAXED);
+        file_sink_resync();
+    }
+    write_log_frames(0);
+}
+
+/* Runs the interval group commit when it is due and tells the sink thread when to wake up next */
+static uint64_t file_sink_idle(void) {
+    if (log_sync_deadline_ns && monotonic_ns() >= log_sync_deadline_ns) log_sync();
+    return log_sync_deadline_ns;
+}
+
+static int syslog_sink_deliver(const sink_entry_t *entry, const char *line __attribute__((unused)),
+                               const char *user, const char *msg) {
+    uint64_t start = monotonic_ns();
+    syslog(entry->priority, "[%s] %s", user, msg);
+    hist_record(&hists[HIST_SYSLOG_WRITE], monotonic_ns() - start);
+    return 0;
+}
+
+/* Native journal protocol: KEY=value lines, or KEY\n<le64 size><value>\n when the value has newlines */
+static int journald_sink_deliver(const sink_entry_t *entry, const char *line __attribute__((unused)),
+                                 const char *user, const char *msg) {
+    if (journald_fd < 0) return -1;
+    char fields[128 + SINK_FIELD_MAX];
+    int len = snprintf(fields, sizeof(fields), "PRIORITY=%d\nSYSLOG_IDENTIFIER=system_logger\nSYSTEM_LOGGER_USER=%s\n",
+                       entry->priority, user);
+    if (len < 0 || (size_t)len >= sizeof(fields)) return -1;
+    struct iovec iov[5];
+    uint64_t size = htole64(entry->msg_len);
+    int binary = (memchr(msg, '\n', entry->msg_len) != NULL);
+    iov[0].iov_base = fields;
+    iov[0].iov_len = (size_t)len;
+    iov[1].iov_base = (void *)(binary ? "MESSAGE\n" : "MESSAGE=");
+    iov[1].iov_len = 8;
+    iov[2].iov_base = &size;
+    iov[2].iov_len = binary ? sizeof(size) : 0;
+    iov[3].iov_base = (void *)msg;
+    iov[3].iov_len = entry->msg_len;
+    iov[4].iov_base = (void *)"\n";
+    iov[4].iov_len = 1;
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = iov;
+    header.msg_iovlen = 5;
+    return sendmsg(journald_fd, &header, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static int forward_sink_deliver(const sink_entry_t *entry, const char *line, const char *user __attribute__((unused)),
+                                const char *msg __attribute__((unused))) {
+    forward_record(line, entry->line_len);
+    return 0;
+}
+
+static int metrics_sink_deliver(const sink_entry_t *entry, const char *line __attribute__((unused)),
+                                const char *user __attribute__((unused)), const char *msg __attribute__((unused))) {
+    if (entry->priority == LOG_ERR) metric_add(METRIC_LOG_RECORDS_ERROR, 1);
+    else if (entry->priority == LOG_WARNING) metric_add(METRIC_LOG_RECORDS_WARNING, 1);
+    else if (entry->priority == LOG_DEBUG) metric_add(METRIC_LOG_RECORDS_DEBUG, 1);
+    else metric_add(METRIC_LOG_RECORDS_INFO, 1);
+    return 0;
+}
+
+/* Entries are SINK_ENTRY_ALIGN-aligned, so a wrap always leaves room for a padding header */
+static sink_entry_t *sink_entry_at(int lane, uint64_t position) {
+    return (sink_entry_t *)(sink_ring.lanes[lane].data + position % sink_ring.lanes[lane].bytes);
+}
+
+static int sink_full(const sink_t *sink, int lane, uint64_t needed) {
+    const sink_lane_t *ring = &sink_ring.lanes[lane];
+    uint64_t capacity = (lane == SINK_LANE_PRIORITY) ? SINK_PRIORITY_QUEUE : sink->capacity;
+    return ring->head + needed - sink->cursor[lane] > ring->bytes || ring->head_seq - sink->seq[lane] >= capacity;
+}
+
+/* Copies the sink's pending entries of one lane into batch, up to limit bytes; called under the lock */
+static size_t sink_take(sink_t *sink, int lane, char *batch, size_t limit, uint64_t *taken) {
+    size_t len = 0;
+    while (sink->cursor[lane] < sink_ring.lanes[lane].head && len < limit) {
+        const sink_entry_t *entry = sink_entry_at(lane, sink->cursor[lane]);
+        if (entry->priority >= 0) {
+            memcpy(batch + len, entry, entry->size);
+            len += entry->size;
+            sink->seq[lane]++;
+            (*taken)++;
+        }
+        sink->cursor[lane] += entry->size;
+    }
+    return len;
+}
+
+static uint64_t sink_deliver_batch(sink_t *sink, const char *batch, size_t len) {
+    uint64_t failed = 0;
+    for (size_t offset = 0; offset < len;) {
+        const sink_entry_t *entry = (const sink_entry_t *)(batch + offset);
+        const char *line = (const char *)(entry + 1);
+        const char *user = line + entry->line_len + 1;
+        const char *msg = user + entry->user_len + 1;
+        if (sink->deliver(entry, line, user, msg) != 0) failed++;
+        offset += entry->size;
+    }
+    return failed;
+}
+
+/* The priority lane head only grows, so an unlocked look at it is enough to notice new records */
+static int sink_priority_pending(uint64_t seen) {
+    return __atomic_load_n(&sink_ring.lanes[SINK_LANE_PRIORITY].head, __ATOMIC_ACQUIRE) != seen;
+}
+
+/*
+ * Copies the sink's pending entries out of the ring under the lock, priority lane first, and
+ * delivers them unlocked. New priority records arriving while an ordinary batch is delivered are
+ * taken and delivered before the rest of that batch. Once the batch is flushed, acked is the
+ * normal lane seq up to which the sink is done. Returns the number of entries taken.
+ */
+static uint64_t sink_drain(sink_t *sink, char *batch) {
+    char *priority = batch;
+    char *normal = batch + SINK_PRIORITY_BYTES + SINK_ENTRY_MAX;
+    uint64_t taken = 0, failed = 0;
+    pthread_mutex_lock(&sink_ring.lock);
+    size_t priority_len = sink_take(sink, SINK_LANE_PRIORITY, priority, SINK_PRIORITY_BYTES, &taken);
+    uint64_t priority_seen = sink_ring.lanes[SINK_LANE_PRIORITY].head;
+    size_t normal_len = sink_take(sink, SINK_LANE_NORMAL, normal, SINK_BATCH_BYTES, &taken);
+    uint64_t normal_seq = sink->seq[SINK_LANE_NORMAL];
+    if (taken > 0) pthread_cond_broadcast(&sink_ring.space);
+    pthread_mutex_unlock(&sink_ring.lock);
+    
+    failed += sink_deliver_batch(sink, priority, priority_len);
+    for (size_t offset = 0; offset < normal_len;) {
+        if (sink_priority_pending(priority_seen)) {
+            uint64_t urgent = 0;
+            pthread_mutex_lock(&sink_ring.lock);
+            priority_len = sink_take(sink, SINK_LANE_PRIORITY, priority, SINK_PRIORITY_BYTES, &urgent);
+            priority_seen = sink_ring.lanes[SINK_LANE_PRIORITY].head;
+            if (urgent > 0) pthread_cond_broadcast(&sink_ring.space);
+            pthread_mutex_unlock(&sink_ring.lock);
+            failed += sink_deliver_batch(sink, priority, priority_len);
+            taken += urgent;
+        }
+        const sink_entry_t *entry = (const sink_entry_t *)(normal + offset);
+        failed += sink_deliver_batch(sink, normal + offset, entry->size);
+        offset += entry->size;
+    }
+    if (taken > 0 && sink->flush) sink->flush();
+    __atomic_store_n(&sink->acked, normal_seq, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&sink->delivered, taken - failed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sink->dropped, failed, __ATOMIC_RELAXED);
+    return taken;
+}
+
+static int sink_idle(const sink_t *sink) {
+    for (int lane = 0; lane < SINK_LANES; lane++) {
+        if (sink->cursor[lane] != sink_ring.lanes[lane].head) return 0;
+    }
+    return 1;
+}
+
+static void *sink_thread(void *arg) {
+    sink_t *sink = arg;
+    char *batch = malloc(SINK_DRAIN_BUFFER);
+    while (batch) {
+        if (sink_drain(sink, batch) > 0) continue;
+        uint64_t deadline = sink->idle ? sink->idle() : 0;
+        pthread_mutex_lock(&sink_ring.lock);
+        if (sink_idle(sink)) {
+            if (sink_ring.stopping) {
+                pthread_mutex_unlock(&sink_ring.lock);
+                break;
+            }
+            if (deadline) {
+                struct timespec until = {(time_t)(deadline / 1000000000ULL), (long)(deadline % 1000000000ULL)};
+                pthread_cond_timedwait(&sink_ring.ready, &sink_ring.lock, &until);
+            } else {
+                pthread_cond_wait(&sink_ring.ready, &sink_ring.lock);
+            }
+        }
+        pthread_mutex_unlock(&sink_ring.lock);
+    }
+    free(batch);
+    return NULL;
+}
+
+/*
+ * One copy into the ring whatever the number of sinks; waits only for full sinks with the block policy.
+ * The message is kept whole up to the size of the formatted line, so syslog and journald get what the file gets.
+ */
+static void sink_enqueue(time_t ts, int priority, const char *line, size_t line_len, const char *user, const char *msg) {
+    int lane = (priority <= SINK_PRIORITY_LEVEL) ? SINK_LANE_PRIORITY : SINK_LANE_NORMAL;
+    sink_lane_t *ring = &sink_ring.lanes[lane];
+    size_t user_len = strnlen(user, SINK_FIELD_MAX - 1), msg_len = strnlen(msg, SINK_MESSAGE_MAX - 1);
+    size_t size = (sizeof(sink_entry_t) + line_len + user_len + msg_len + 3 + SINK_ENTRY_ALIGN - 1) &
+                  ~(size_t)(SINK_ENTRY_ALIGN - 1);
+    uint64_t enqueued_ns = monotonic_ns();
+    pthread_mutex_lock(&sink_ring.lock);
+    uint64_t offset = ring->head % ring->bytes;
+    size_t pad = (offset + size > ring->bytes) ? (size_t)(ring->bytes - offset) : 0;
+    while (1) {
+        int blocked = 0;
+        for (int i = 0; i < NUM_SINKS && !blocked; i++) {
+            sink_t *sink = &sinks[i];
+            if (!sink->enabled) continue;
+            while (sink_full(sink, lane, pad + size)) {
+                if (!sink->drop || sink->cursor[lane] == ring->head) {
+                    blocked = 1;
+                    break;
+                }
+                const sink_entry_t *oldest = sink_entry_at(lane, sink->cursor[lane]);
+                if (oldest->priority >= 0) {
+                    sink->seq[lane]++;
+                    __atomic_add_fetch(&sink->dropped, 1, __ATOMIC_RELAXED);
+                }
+                sink->cursor[lane] += oldest->size;
+            }
+        }
+        if (!blocked) break;
+        pthread_cond_broadcast(&sink_ring.ready);
+        pthread_cond_wait(&sink_ring.space, &sink_ring.lock);
+    }
+    
+    if (pad > 0) {
+        sink_entry_t *filler = sink_entry_at(lane, ring->head);
+        filler->size = (uint32_t)pad;
+        filler->priority = -1;
+        ring->head += pad;
+    }
+    sink_entry_t *entry = sink_entry_at(lane, ring->head);
+    *entry = (sink_entry_t){ring->head_seq, (uint32_t)size, (uint32_t)line_len, (uint32_t)user_len,
+                            (uint32_t)msg_len, priority, 0, ts, enqueued_ns};
+    char *p = (char *)(entry + 1);
+    memcpy(p, line, line_len);
+    p[line_len] = '\0';
+    p += line_len + 1;
+    memcpy(p, user, user_len);
+    p[user_len] = '\0';
+    p += user_len + 1;
+    memcpy(p, msg, msg_len);
+    p[msg_len] = '\0';
+    ring->head_seq++;
+    __atomic_store_n(&ring->head, ring->head + size, __ATOMIC_RELEASE);
+    if (sink_ring.deferred && lane == SINK_LANE_NORMAL) sink_ring.wake_pending = 1;
+    else pthread_cond_broadcast(&sink_ring.ready);
+    pthread_mutex_unlock(&sink_ring.lock);
+}
+
+/* Bursts of records (a tailed chunk) wake the sink threads once instead of once per record */
+static void sink_defer_wakeups(int defer) {
+    pthread_mutex_lock(&sink_ring.lock);
+    sink_ring.deferred += defer ? 1 : -1;
+    if (sink_ring.deferred == 0 && sink_ring.wake_pending) {
+        sink_ring.wake_pending = 0;
+        pthread_cond_broadcast(&sink_ring.ready);
+    }
+    pthread_mutex_unlock(&sink_ring.lock);
+}
+
+static int redact_word_char(unsigned char c) {
+    return isalnum(c) || c == '.' || c == '_' || c == '%' || c == '+' || c == '@' || c == '-';
+}
+
+/* Builds the trie over byte classes, then fills in the failure transitions breadth first */
+int init_redaction(void) {
+    redactor_t *r = &redactor;
+    if (num_redact_rules == 0) return 0;
+    size_t max_states = 1;
+    r->num_classes = 1;
+    for (int i = 0; i < num_redact_rules; i++) {
+        for (const unsigned char *c = (const unsigned char *)redact_rules[i]; *c; c++) {
+            if (*c != '*' && r->byte_class[*c] == 0) r->byte_class[*c] = (uint8_t)r->num_classes++;
+            max_states++;
+        }
+    }
+    if (max_states * r->num_classes >= REDACT_MATCH_BIT) return -1;
+    
+    r->next = calloc(max_states * r->num_classes, sizeof(uint32_t));
+    r->match_len = calloc(max_states, sizeof(uint16_t));
+    r->match_flags = calloc(max_states, sizeof(uint8_t));
+    uint32_t *fail = calloc(max_states, sizeof(uint32_t));
+    uint32_t *queue = calloc(max_states, sizeof(uint32_t));
+    if (!r->next || !r->match_len || !r->match_flags || !fail || !queue) {
+        free(r->next);
+        free(r->match_len);
+        free(r->match_flags);
+        free(fail);
+        free(queue);
+        memset(r, 0, sizeof(*r));
+        return -1;
+    }
+    
+    r->num_states = 1;
+    for (int i = 0; i < num_redact_rules; i++) {
+        const char *rule = redact_rules[i];
+        size_t len = strlen(rule);
+        int flags = 0;
+        if (len > 0 && rule[0] == '*') {
+            flags |= REDACT_EXTEND_LEFT;
+            rule++;
+            len--;
+        }
+        if (len > 0 && rule[len - 1] == '*') {
+            flags |= REDACT_EXTEND_RIGHT;
+            len--;
+        }
+        if (len == 0 || len > UINT16_MAX) continue;
+        uint32_t state = 0;
+        for (size_t j = 0; j < len; j++) {
+            uint32_t *edge = &r->next[state * r->num_classes + r->byte_class[(unsigned char)rule[j]]];
+            if (*edge == 0) *edge = r->num_states++;
+            state = *edge;
+        }
+        if (len > r->match_len[state]) r->match_len[state] = (uint16_t)len;
+        r->match_flags[state] |= (uint8_t)flags;
+    }
+    
+    /* Children of the root fail to the root; deeper states inherit the longest match of their fail state */
+    size_t head = 0, tail = 0;
+    for (uint32_t c = 1; c < r->num_classes; c++) {
+        if (r->next[c]) queue[tail++] = r->next[c];
+    }
+    while (head < tail) {
+        uint32_t state = queue[head++];
+        if (r->match_len[fail[state]] > r->match_len[state]) r->match_len[state] = r->match_len[fail[state]];
+        r->match_flags[state] |= r->match_flags[fail[state]];
+        for (uint32_t c = 1; c < r->num_classes; c++) {
+            uint32_t *edge = &r->next[state * r->num_classes + c];
+            uint32_t fallback = r->next[fail[state] * r->num_classes + c];
+            if (*edge) {
+                fail[*edge] = fallback;
+                queue[tail++] = *edge;
+            } else {
+                *edge = fallback;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    
+    for (size_t i = 0; i < (size_t)r->num_states * r->num_classes; i++) {
+        uint32_t target = r->next[i];
+        r->next[i] = target * r->num_classes | (r->match_len[target] ? REDACT_MATCH_BIT : 0);
+    }
+    return 0;
+}
+
+/* Appends text[copied, start) and REDACT_REPLACEMENT to out, as far as out_size allows */
+static size_t redact_emit(const char *text, size_t copied, size_t start, char *out, size_t out_len, size_t out_size) {
+    size_t keep = start - copied;
+    if (keep > out_size - 1 - out_len) keep = out_size - 1 - out_len;
+    memcpy(out + out_len, text + copied, keep);
+    out_len += keep;
+    size_t mark = sizeof(REDACT_REPLACEMENT) - 1;
+    if (mark > out_size - 1 - out_len) mark = out_size - 1 - out_len;
+    memcpy(out + out_len, REDACT_REPLACEMENT, mark);
+    return out_len + mark;
+}
+
+/*
+ * Single pass over text. Returns text itself when nothing matched, otherwise out with every match
+ * (and its '*' extensions) replaced by REDACT_REPLACEMENT. The automaton runs over every byte,
+ * matched or not, so overlapping matches ("abc" and "cde" in "abcde") extend one pending range,
+ * which is written out once the next match starts past it (a range that begins right where the
+ * previous one was written adds no second mark). The last word run found on each side is
+ * remembered, so the '*' extensions never rescan the same bytes. Written ranges are disjoint and
+ * never touch, so a text of len bytes has at most (len + 1) / 2 of them and out is grown to
+ * len * 6 + 11 bytes on the first match. When that fails the whole text is replaced.
+ */
+static const char *redact_string(const char *text, redact_buffer_t *buffer) {
+    const redactor_t *r = &redactor;
+    if (!r->next || !text) return text;
+    const unsigned char *in = (const unsigned char *)text;
+    size_t copied = 0, out_len = 0, pending_start = 0, pending_end = 0;
+    size_t left_from = 0, left_end = 0, run_from = 0, run_end = 0, out_size = buffer->size;
+    char *out = buffer->data;
+    int pending = 0, matched = 0;
+    uint32_t row = 0;
+    for (size_t i = 0; in[i]; i++) {
+        row = r->next[(row & ~REDACT_MATCH_BIT) + r->byte_class[in[i]]];
+        if (!(row & REDACT_MATCH_BIT)) continue;
+        uint32_t state = (row & ~REDACT_MATCH_BIT) / r->num_classes;
+        size_t start = i + 1 - r->match_len[state], end = i + 1;
+        if (r->match_flags[state] & REDACT_EXTEND_LEFT) {
+            size_t from = start;
+            while (from > copied && redact_word_char(in[from - 1])) {
+                if (from > left_from && from <= left_end) {
+                    from = left_from;
+                    break;
+                }
+                from--;
+            }
+            left_from = from;
+            left_end = start;
+            start = from < copied ? copied : from;
+        }
+        if (r->match_flags[state] & REDACT_EXTEND_RIGHT) {
+            if (end < run_from || end > run_end) {
+                for (run_from = run_end = end; in[run_end] && redact_word_char(in[run_end]);) run_end++;
+            }
+            end = run_end;
+        }
+        if (!matched) {
+            size_t need = strlen(text) * 6 + 11;
+            if (need > buffer->size) {
+                char *grown = realloc(buffer->data, need);
+                if (!grown) return REDACT_REPLACEMENT;
+                buffer->data = grown;
+                buffer->size = need;
+            }
+            out = buffer->data;
+            out_size = buffer->size;
+            matched = 1;
+        }
+        if (pending && start <= pending_end) {
+            if (start < pending_start) pending_start = start;
+            if (end > pending_end) pending_end = end;
+            continue;
+        }
+        if (pending) {
+            if (!out_len || pending_start > copied) out_len = redact_emit(text, copied, pending_start, out, out_len, out_size);
+            copied = pending_end;
+        }
+        pending = 1;
+        pending_start = start;
+        pending_end = end;
+    }
+    if (!matched) return text;
+    if (!out_len || pending_start > copied) out_len = redact_emit(text, copied, pending_start, out, out_len, out_size);
+    copied = pending_end;
+    size_t rest = strlen(text + copied);
+    if (rest > out_size - 1 - out_len) rest = out_size - 1 - out_len;
+    memcpy(out + out_len, text + copied, rest);
+    out[out_len + rest] = '\0';
+    return out;
+}
+
+void log_record(const char *username, const char *message, int priority, const record_fields_t *fields) {
+    static char time_str[64];
+    static time_t time_str_at = -1;
+    time_t now = time(NULL);
+    if (now != time_str_at) {
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        time_str_at = now;
+    }
+    
+    self_counters.records_logged++;
+    static redact_buffer_t redacted_message, redacted_file, redacted_dir;
+    record_fields_t redacted_fields;
+    if (redactor.next) {
+        uint64_t start = monotonic_ns();
+        message = redact_string(message, &redacted_message);
+        if (fields) {
+            redacted_fields = *fields;
+            redacted_fields.event_file = redact_string(fields->event_file, &redacted_file);
+            redacted_fields.event_dir = redact_string(fields->event_dir, &redacted_dir);
+            fields = &redacted_fields;
+        }
+        hist_record(&hists[HIST_REDACT], monotonic_ns() - start);
+    }
+    const char *level_str = "INFO";
+    if (priority == LOG_WARNING) level_str = "WARNING";
+    else if (priority == LOG_ERR) level_str = "ERROR";
+    else if (priority == LOG_DEBUG) level_str = "DEBUG";
+    if (log_format_jsonl) format_json_record(&record_arena, now, level_str, username, message, fields);
+    else format_text_record(&record_arena, time_str, level_str, username, message);
+    
+    if (!sink_ring.lanes[SINK_LANE_NORMAL].data) return;
+    sink_enqueue(now, priority, record_arena.data, record_arena.len, username, message);
+    static char inline_batch[SINK_DRAIN_BUFFER];
+    for (int i = 0; i < NUM_SINKS; i++) {
+        if (sinks[i].enabled && !sinks[i].threaded) sink_drain(&sinks[i], inline_batch);
+    }
+}
+
+/* Without SINKS= the file, metrics, syslog (USE_SYSLOG) and forward (FORWARD_TARGET) sinks are on */
+int init_sinks(void) {
+    if (!sinks_configured) {
+        sinks[SINK_FILE].enabled = 1;
+        sinks[SINK_SYSLOG].enabled = use_syslog;
+        sinks[SINK_FORWARD].enabled = (forward_target[0] != '\0');
+        sinks[SINK_METRICS].enabled = 1;
+    }
+    sinks[SINK_FILE].deliver = file_sink_deliver;
+    sinks[SINK_FILE].idle = file_sink_idle;
+    sinks[SINK_FILE].flush = file_sink_flush;
+    sinks[SINK_SYSLOG].deliver = syslog_sink_deliver;
+    sinks[SINK_JOURNALD].deliver = journald_sink_deliver;
+    sinks[SINK_FORWARD].deliver = forward_sink_deliver;
+    sinks[SINK_METRICS].deliver = metrics_sink_deliver;
+    
+    if (sinks[SINK_SYSLOG].enabled) openlog("system_logger", LOG_PID | LOG_CONS, LOG_DAEMON);
+    if (sinks[SINK_JOURNALD].enabled) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, JOURNALD_SOCKET);
+        journald_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (journald_fd >= 0 && connect(journald_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(journald_fd);
+            journald_fd = -1;
+        }
+    }
+    
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sink_ring.ready, &attr);
+    pthread_condattr_destroy(&attr);
+    for (int lane = 0; lane < SINK_LANES; lane++) {
+        sink_ring.lanes[lane].data = malloc(sink_ring.lanes[lane].bytes);
+        if (!sink_ring.lanes[lane].data) return -1;
+    }
+    for (int i = 0; i < NUM_SINKS; i++) {
+        sink_t *sink = &sinks[i];
+        if (!sink->enabled || !sink->threaded) continue;
+        sink->started = (pthread_create(&sink->thread, NULL, sink_thread, sink) == 0);
+        if (!sink->started) sink->enabled = 0;
+    }
+    return (journald_fd < 0 && sinks[SINK_JOURNALD].enabled) ? -1 : 0;
+}
+
+/* Lets every threaded sink drain what is queued, then joins it */
+void stop_sinks(void) {
+    if (!sink_ring.lanes[SINK_LANE_NORMAL].data) return;
+    pthread_mutex_lock(&sink_ring.lock);
+    sink_ring.stopping = 1;
+    pthread_cond_broadcast(&sink_ring.ready);
+    pthread_mutex_unlock(&sink_ring.lock);
+    for (int i = 0; i < NUM_SINKS; i++) {
+        if (sinks[i].started) pthread_join(sinks[i].thread, NULL);
+        sinks[i].started = 0;
+    }
+}
+
+void log_message(const char *username, const char *message, int priority) {
+    if (log_enabled(COLLECTOR_CORE, priority)) log_record(username, message, priority, NULL);
+}
+
+void log_uptime(const char *username) {
+    FILE *file = fopen("/proc/uptime", "r");
+    if (!file) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Error reading /proc/uptime: %s", strerror(errno));
+        if (log_enabled(COLLECTOR_UPTIME, LOG_WARNING)) log_record(username, msg, LOG_WARNING, NULL);
+        return;
+    }
+    
+    double uptime_seconds;
+    if (fscanf(file, "%lf", &uptime_seconds) == 1) {
+        int days = (int)(uptime_seconds / 86400);
+        int hours = (int)((uptime_seconds - days * 86400) / 3600);
+        int minutes = (int)((uptime_seconds - days * 86400 - hours * 3600) / 60);
+        metric_set(METRIC_UPTIME_SECONDS, uptime_seconds);
+        if (log_enabled(COLLECTOR_UPTIME, LOG_INFO)) {
+            char msg[256];
+            snprintf(msg, sizeof(msg), "Uptime: %d days, %d hours, %d minutes (%.0f seconds)", 
+                    days, hours, minutes, uptime_seconds);
+            record_metric_t values[] = {{"uptime_seconds", uptime_seconds}};
+            record_fields_t fields = {"log_uptime", values, 1, NULL, NULL, NULL};
+            log_record(username, msg, LOG_INFO, &fields);
+        }
+    }
+    fclose(file);
+}
+
+void log_free_inodes(const char *username) {
+    struct statfs fs_info;
+    if (statfs("/", &fs_info) == 0) {
+        unsigned long long free_inodes = fs_info.f_ffree;
+        unsigned long long total_inodes = fs_info.f_files;
+        metric_set(METRIC_FREE_INODES, (double)free_inodes);
+        metric_set(METRIC_TOTAL_INODES, (double)total_inodes);
+        if (!log_enabled(COLLECTOR_INODES, LOG_INFO)) return;
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Free inodes: %llu out of %llu", 
+                free_inodes, total_inodes);
+        record_metric_t values[] = {{"free_inodes", (double)free_inodes}, {"total_inodes", (double)total_inodes}};
+        record_fields_t fields = {"log_free_inodes", values, 2, NULL, NULL, NULL};
+        log_record(username, msg, LOG_INFO, &fields);
+    } else if (log_enabled(COLLECTOR_INODES, LOG_WARNING)) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Error getting inode information: %s", strerror(errno));
+        log_record(username, msg, LOG_WARNING, NULL);
+    }
+}
+
+void log_network_connections(const char *username) {
+    FILE *file = fopen("/proc/net/tcp", "r");
+    if (!file) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Error opening /proc/net/tcp: %s", strerror(errno));
+        if (log_enabled(COLLECTOR_NETWORK, LOG_WARNING)) log_record(username, msg, LOG_WARNING, NULL);
+        return;
+    }
+    
+    char line[MAX_LINE_LEN];
+    int connection_count = 0, established_count = 0;
+    
+    if (fgets(line, sizeof(line), file)) {
+        while (fgets(line, sizeof(line), file)) {
+            connection_count++;
+            if (strstr(line, ": 01 ") != NULL) established_count++;
+        }
+    }
+    fclose(file);
+    metric_set(METRIC_TCP_CONNECTIONS, connection_count);
+    metric_set(METRIC_TCP_ESTABLISHED, established_count);
+    if (!log_enabled(COLLECTOR_NETWORK, LOG_INFO)) return;
+    
+    char msg[256];
+    snprintf(msg, sizeof(msg), "TCP network connections: total %d, established %d", 
+            connection_count, established_count);
+    record_metric_t values[] = {{"tcp_connections", connection_count}, {"tcp_established", established_count}};
+    record_fields_t fields = {"log_network_connections", values, 2, NULL, NULL, NULL};
+    log_record(username, msg, LOG_INFO, &fields);
+}
+
+
+/*
+ * Control characters other than tab are written the way rsyslog does (#012 for a newline), so a
+ * syslog sender or a tailed file cannot start a fake line in the log file or a new field in the
+ * journal entry. out needs 4 * len + 1 bytes to hold all of text.
+ */
+static void escape_controls(char *out, size_t size, const char *text, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len && n + 5 <= size; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if ((c < 0x20 && c != '\t') || c == 0x7f) {
+            snprintf(out + n, 5, "#%03o", c);
+            n += 4;
+        } else {
+            out[n++] = (char)c;
+        }
+    }
+    out[n] = '\0';
+}
+
+static void tail_emit(tail_t *tail, const char *line, size_t len) {
+    if (len > 0 && line[len - 1] == '\r') len--;
+    tail_lines++;
+    if (!log_enabled(COLLECTOR_TAIL, LOG_INFO)) return;
+    static char msg[4 * TAIL_LINE_MAX + 1];
+    if (len > TAIL_LINE_MAX) len = TAIL_LINE_MAX;
+    escape_controls(msg, sizeof(msg), line, len);
+    record_fields_t fields = {"tail", NULL, 0, NULL, tail->path, NULL};
+    log_record(tail->source, msg, LOG_INFO, &fields);
+}
+
+static void tail_restart(tail_t *tail, uint64_t offset) {
+    tail->offset = tail->acked_offset = offset;
+    tail->carry_len = 0;
+    tail->num_checkpoints = 0;
+}
+
+/*
+ * The checkpoint is the start of the carried partial line, not offset - carry_len: the carry stops
+ * growing at TAIL_LINE_MAX while offset does not. When the queue is full its newest entry is moved
+ * forward, which only delays the checkpoint.
+ */
+static void tail_checkpoint(tail_t *tail) {
+    uint64_t offset = tail->carry_len > 0 ? tail->carry_start : tail->offset;
+    int n = tail->num_checkpoints;
+    if (n > 0 && tail->checkpoint_offset[n - 1] == offset) return;
+    if (n == TAIL_CHECKPOINTS) n--;
+    tail->checkpoint_seq[n] = sink_ring.lanes[SINK_LANE_NORMAL].head_seq;
+    tail->checkpoint_offset[n] = offset;
+    tail->num_checkpoints = n + 1;
+}
+
+/* Reads everything appended since tail->offset, at most TAIL_READ_BUDGET bytes per call */
+static void tail_read(tail_t *tail) {
+    if (tail->fd < 0) return;
+    /* Truncated, or truncated and refilled past our offset so that we no longer sit after a newline */
+    struct stat st;
+    char last = '\n';
+    if ((fstat(tail->fd, &st) == 0 && (uint64_t)st.st_size < tail->offset) ||
+        (tail->carry_len == 0 && tail->offset > 0 && pread(tail->fd, &last, 1, (off_t)tail->offset - 1) == 1 && last != '\n')) {
+        tail_restart(tail, 0);
+    }
+    
+    uint64_t budget = TAIL_READ_BUDGET;
+    while (budget > 0) {
+        ssize_t n = pread(tail->fd, tail_buffer, TAIL_CHUNK_SIZE, (off_t)tail->offset);
+        if (n <= 0) break;
+        tail->offset += (uint64_t)n;
+        tail_bytes += (uint64_t)n;
+        budget = (uint64_t)n < budget ? budget - (uint64_t)n : 0;
+        
+        const char *p = tail_buffer, *end = tail_buffer + n;
+        sink_defer_wakeups(1);
+        if (tail->carry_len > 0) {
+            const char *newline = memchr(p, '\n', (size_t)(end - p));
+            size_t take = (size_t)((newline ? newline : end) - p);
+            if (take > TAIL_LINE_MAX - tail->carry_len) take = TAIL_LINE_MAX - tail->carry_len;
+            memcpy(tail->carry + tail->carry_len, p, take);
+            tail->carry_len += take;
+            if (newline) {
+                tail_emit(tail, tail->carry, tail->carry_len);
+                tail->carry_len = 0;
+                p = newline + 1;
+            } else {
+                p = end;
+            }
+        }
+        for (const char *newline; p < end && (newline = memchr(p, '\n', (size_t)(end - p))); p = newline + 1) {
+            tail_emit(tail, p, (size_t)(newline - p));
+        }
+        if (p < end) {
+            size_t rest = (size_t)(end - p);
+            if (rest > TAIL_LINE_MAX) rest = TAIL_LINE_MAX;
+            tail->carry_start = tail->offset - (uint64_t)(end - p);
+            memcpy(tail->carry, p, rest);
+            tail->carry_len = rest;
+        }
+        sink_defer_wakeups(0);
+        if (n < TAIL_CHUNK_SIZE) break;
+    }
+    tail->dirty = (budget == 0);
+    tail_checkpoint(tail);
+    metric_set(METRIC_TAIL_BYTES, (double)tail_bytes);
+    metric_set(METRIC_TAIL_LINES, (double)tail_lines);
+}
+
+static void tail_close(tail_t *tail) {
+    if (tail->wd >= 0) inotify_rm_watch(inotify_fd, tail->wd);
+    if (tail->fd >= 0) close(tail->fd);
+    tail->fd = tail->wd = -1;
+}
+
+/* Opens the file now at tail->path; offset is where to start if it is the inode we were reading */
+static int tail_open(tail_t *tail, uint64_t offset) {
+    int fd = open(tail->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int same = (st.st_dev == tail->dev && st.st_ino == tail->ino);
+    tail->fd = fd;
+    tail->dev = st.st_dev;
+    tail->ino = st.st_ino;
+    tail_restart(tail, same ? offset : 0);
+    if (inotify_fd >= 0) tail->wd = inotify_add_watch(inotify_fd, tail->path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    tail->dirty = 1;
+    return 0;
+}
+
+/* Drains the old file, then switches to whatever now lives at the path */
+static void tail_reopen(tail_t *tail) {
+    struct stat st;
+    if (stat(tail->path, &st) != 0 || (tail->fd >= 0 && st.st_dev == tail->dev && st.st_ino == tail->ino)) return;
+    if (tail->fd >= 0) {
+        tail_read(tail);
+        if (tail->carry_len > 0) tail_emit(tail, tail->carry, tail->carry_len);
+        tail->carry_len = 0;
+    }
+    tail_close(tail);
+    tail_open(tail, 0);
+}
+
+/* Called for every event read from inotify_fd; returns 1 if it concerned a tailed file */
+static int tail_inotify_event(const struct inotify_event *event) {
+    int matched = 0;
+    for (int i = 0; i < num_tails; i++) {
+        tail_t *tail = &tails[i];
+        if (event->wd == tail->wd) {
+            tail->dirty = 1;
+            if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) tail_reopen(tail);
+            matched = 1;
+        } else if (event->wd == tail->dir_wd && event->len > 0) {
+            const char *base = strrchr(tail->path, '/');
+            if (strcmp(event->name, base ? base + 1 : tail->path) != 0) continue;
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) tail_reopen(tail);
+            tail->dirty = 1;
+            matched = 1;
+        }
+    }
+    return matched;
+}
+
+static void tail_read_dirty(void) {
+    for (int i = 0; i < num_tails; i++) {
+        if (tails[i].dirty) tail_read(&tails[i]);
+    }
+}
+
+void save_tail_state(void) {
+    uint64_t acked = sinks[SINK_FILE].enabled ? __atomic_load_n(&sinks[SINK_FILE].acked, __ATOMIC_ACQUIRE)
+                                              : sink_ring.lanes[SINK_LANE_NORMAL].head_seq;
+    int changed = 0;
+    for (int i = 0; i < num_tails; i++) {
+        tail_t *tail = &tails[i];
+        int done = 0;
+        while (done < tail->num_checkpoints && tail->checkpoint_seq[done] <= acked) {
+            tail->acked_offset = tail->checkpoint_offset[done++];
+        }
+        tail->num_checkpoints -= done;
+        memmove(tail->checkpoint_seq, tail->checkpoint_seq + done, (size_t)tail->num_checkpoints * sizeof(uint64_t));
+        memmove(tail->checkpoint_offset, tail->checkpoint_offset + done, (size_t)tail->num_checkpoints * sizeof(uint64_t));
+        if (tail->acked_offset != tail->saved_offset) changed = 1;
+    }
+    if (!changed) return;
+    FILE *file = fopen(TAIL_STATE_FILE ".tmp", "w");
+    if (!file) return;
+    int ok = 1;
+    for (int i = 0; i < num_tails && ok; i++) {
+        ok = fprintf(file, "%s %llu %llu %llu\n", tails[i].name, (unsigned long long)tails[i].dev,
+                     (unsigned long long)tails[i].ino, (unsigned long long)tails[i].acked_offset) > 0;
+    }
+    if (fclose(file) != 0 || !ok || rename(TAIL_STATE_FILE ".tmp", TAIL_STATE_FILE) != 0) {
+        unlink(TAIL_STATE_FILE ".tmp");
+        return;
+    }
+    for (int i = 0; i < num_tails; i++) tails[i].saved_offset = tails[i].acked_offset;
+}
+
+/* Catches rotations and appends whose events were lost (e.g. an inotify overflow) */
+void tail_tick(void) {
+    for (int i = 0; i < num_tails; i++) {
+        tail_reopen(&tails[i]);
+        tail_read(&tails[i]);
+    }
+    save_tail_state();
+}
+
+/*
+ * A file without a checkpoint for its current inode is followed from the start of its last line:
+ * following from the middle of a line would look like a truncation to tail_read and replay the file
+ */
+int init_tails(void) {
+    if (num_tails == 0) return 0;
+    tail_buffer = malloc(TAIL_CHUNK_SIZE);
+    if (!tail_buffer) return -1;
+    FILE *file = fopen(TAIL_STATE_FILE, "r");
+    char line[MAX_CONFIG_LINE];
+    int failed = 0;
+    for (int i = 0; i < num_tails; i++) {
+        tail_t *tail = &tails[i];
+        unsigned long long dev = 0, ino = 0, offset = 0;
+        int found = 0;
+        if (file) {
+            rewind(file);
+            char name[64];
+            while (!found && fgets(line, sizeof(line), file)) {
+                found = sscanf(line, "%63s %llu %llu %llu", name, &dev, &ino, &offset) == 4 && strcmp(name, tail->name) == 0;
+            }
+        }
+        tail->carry = malloc(TAIL_LINE_MAX);
+        tail->fd = tail->wd = tail->dir_wd = -1;
+        if (!tail->carry) return -1;
+        
+        char dir[MAX_PATH_LEN];
+        snprintf(dir, sizeof(dir), "%s", tail->path);
+        char *slash = strrchr(dir, '/');
+        if (slash) *(slash == dir ? slash + 1 : slash) = '\0';
+        if (inotify_fd >= 0) {
+            tail->dir_wd = inotify_add_watch(inotify_fd, slash ? dir : ".", IN_CREATE | IN_MOVED_TO | IN_MASK_ADD);
+        }
+        
+        if (found) {
+            tail->dev = (dev_t)dev;
+            tail->ino = (ino_t)ino;
+        }
+        if (tail_open(tail, offset) != 0) {
+            failed = 1;
+            continue;
+        }
+        if (!found) {
+            struct stat st;
+            if (fstat(tail->fd, &st) == 0) tail->offset = tail->acked_offset = last_line_start(tail->fd, (uint64_t)st.st_size);
+        }
+        /* A starting point without a checkpoint is saved at once, or a crash would start from the end again */
+        tail->saved_offset = found ? tail->offset : UINT64_MAX;
+    }
+    if (file) fclose(file);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Login collector (LOGINS=1). wtmp is append-only, so it is read in whole struct utmp records
+ * from a saved offset when inotify reports a write. USER_PROCESS opens a session keyed by tty,
+ * DEAD_PROCESS on that tty closes it with its duration, BOOT_TIME closes whatever was left open.
+ * utmp is small and rewritten in place: it is read whole to count the live sessions, and at
+ * startup to seed the table so sessions opened before we started still get a duration.
+ */
+typedef struct {
+    char line[UT_LINESIZE + 1];
+    char user[UT_NAMESIZE + 1];
+    char host[UT_HOSTSIZE + 1];
+    int64_t login_usec;
+    int used;
+} login_session_t;
+
+static login_session_t login_sessions[MAX_LOGIN_SESSIONS];
+static int num_login_sessions = 0;
+static struct utmp wtmp_batch[WTMP_BATCH];
+static int wtmp_fd = -1, wtmp_wd = -1, utmp_wd = -1;
+static int wtmp_dirty = 0, utmp_dirty = 0;
+static dev_t wtmp_dev;
+static ino_t wtmp_ino;
+static uint64_t wtmp_offset = 0, wtmp_saved_offset = 0;
+static uint64_t logins_total = 0;
+
+static size_t login_session_home(const char *line) {
+    return (size_t)token_hash(line, strlen(line)) & (MAX_LOGIN_SESSIONS - 1);
+}
+
+/* Linear probing on the tty name; returns the session, a free slot if insert, or NULL */
+static login_session_t *login_session_find(const char *line, int insert) {
+    size_t i = login_session_home(line);
+    for (int probes = 0; probes < MAX_LOGIN_SESSIONS; probes++, i = (i + 1) & (MAX_LOGIN_SESSIONS - 1)) {
+        login_session_t *session = &login_sessions[i];
+        if (!session->used) return insert ? session : NULL;
+        if (strcmp(session->line, line) == 0) return session;
+    }
+    return NULL;
+}
+
+/* Backward-shift deletion keeps probe chains short without tombstones */
+static void login_session_remove(login_session_t *session) {
+    size_t hole = (size_t)(session - login_sessions), mask = MAX_LOGIN_SESSIONS - 1;
+    session->used = 0;
+    num_login_sessions--;
+    for (size_t i = (hole + 1) & mask; login_sessions[i].used; i = (i + 1) & mask) {
+        size_t home = login_session_home(login_sessions[i].line);
+        if (((i - home) & mask) < ((i - hole) & mask)) continue;
+        login_sessions[hole] = login_sessions[i];
+        login_sessions[i].used = 0;
+        hole = i;
+    }
+}
+
+static void login_session_open(const struct utmp *ut, const char *line) {
+    login_session_t *session = login_session_find(line, 1);
+    if (!session || (!session->used && num_login_sessions >= MAX_LOGIN_SESSIONS * 3 / 4)) return;
+    if (!session->used) num_login_sessions++;
+    session->used = 1;
+    snprintf(session->line, sizeof(session->line), "%s", line);
+    snprintf(session->user, sizeof(session->user), "%.*s", UT_NAMESIZE, ut->ut_user);
+    snprintf(session->host, sizeof(session->host), "%.*s", UT_HOSTSIZE, ut->ut_host);
+    session->login_usec = (int64_t)ut->ut_tv.tv_sec * 1000000 + ut->ut_tv.tv_usec;
+}
+
+static void login_session_report(const login_session_t *session, int64_t logout_usec, const char *reason) {
+    if (log_enabled(COLLECTOR_LOGINS, LOG_INFO)) {
+        int64_t seconds = (logout_usec > session->login_usec) ? (logout_usec - session->login_usec) / 1000000 : 0;
+        char msg[512];
+        snprintf(msg, sizeof(msg), "Logout on %s from %s after %lld:%02d:%02d%s", session->line,
+                 session->host[0] ? session->host : "local", (long long)(seconds / 3600), (int)(seconds / 60 % 60),
+                 (int)(seconds % 60), reason);
+        record_metric_t values[] = {{"duration", (double)seconds}};
+        record_fields_t fields = {"logins", values, 1, NULL, NULL, NULL};
+        log_record(session->user[0] ? session->user : "unknown", msg, LOG_INFO, &fields);
+    }
+}
+
+static void logins_handle_record(const struct utmp *ut) {
+    char line[UT_LINESIZE + 1];
+    snprintf(line, sizeof(line), "%.*s", UT_LINESIZE, ut->ut_line);
+    int64_t usec = (int64_t)ut->ut_tv.tv_sec * 1000000 + ut->ut_tv.tv_usec;
+    if (ut->ut_type == USER_PROCESS && line[0]) {
+        /* The same login seen in utmp at startup is not a stale session */
+        login_session_t *stale = login_session_find(line, 0);
+        if (stale && stale->login_usec != usec) {
+            login_session_report(stale, usec, " (no logout recorded)");
+            login_session_remove(stale);
+        }
+        login_session_open(ut, line);
+        logins_total++;
+        if (!log_enabled(COLLECTOR_LOGINS, LOG_INFO)) return;
+        char user[UT_NAMESIZE + 1], msg[512];
+        snprintf(user, sizeof(user), "%.*s", UT_NAMESIZE, ut->ut_user);
+        snprintf(msg, sizeof(msg), "Login on %s from %.*s", line, UT_HOSTSIZE, ut->ut_host[0] ? ut->ut_host : "local");
+        record_metric_t values[] = {{"pid", (double)ut->ut_pid}};
+        record_fields_t fields = {"logins", values, 1, NULL, NULL, NULL};
+        log_record(user[0] ? user : "unknown", msg, LOG_INFO, &fields);
+    } else if (ut->ut_type == DEAD_PROCESS && line[0]) {
+        login_session_t *session = login_session_find(line, 0);
+        if (session) {
+            login_session_report(session, usec, "");
+            login_session_remove(session);
+        }
+    } else if (ut->ut_type == BOOT_TIME && num_login_sessions > 0) {
+        for (int i = 0; i < MAX_LOGIN_SESSIONS; i++) {
+            if (login_sessions[i].used) login_session_report(&login_sessions[i], usec, " (system rebooted)");
+        }
+        memset(login_sessions, 0, sizeof(login_sessions));
+        num_login_sessions = 0;
+    }
+}
+
+static void logins_read_wtmp(void) {
+    if (wtmp_fd < 0) return;
+    struct stat st;
+    if (fstat(wtmp_fd, &st) == 0 && (uint64_t)st.st_size < wtmp_offset) wtmp_offset = 0;
+    while (1) {
+        ssize_t n = pread(wtmp_fd, wtmp_batch, sizeof(wtmp_batch), (off_t)wtmp_offset);
+        size_t count = (n > 0) ? (size_t)n / sizeof(struct utmp) : 0;
+        if (count == 0) break;
+        sink_defer_wakeups(1);
+        for (size_t i = 0; i < count; i++) logins_handle_record(&wtmp_batch[i]);
+        sink_defer_wakeups(0);
+        wtmp_offset += count * sizeof(struct utmp);
+        if (count < WTMP_BATCH) break;
+    }
+    wtmp_dirty = 0;
+    metric_set(METRIC_LOGINS, (double)logins_total);
+}
+
+/* Counts the live sessions; with seed, also enters them into the session table */
+static void logins_read_utmp(int seed) {
+    int fd = open(_PATH_UTMP, O_RDONLY | O_CLOEXEC);
+    utmp_dirty = 0;
+    if (fd < 0) return;
+    int live = 0;
+    ssize_t n;
+    for (off_t offset = 0; (n = pread(fd, wtmp_batch, sizeof(wtmp_batch), offset)) > 0; offset += n) {
+        for (size_t i = 0; i < (size_t)n / sizeof(struct utmp); i++) {
+            const struct utmp *ut = &wtmp_batch[i];
+            if (ut->ut_type != USER_PROCESS || !ut->ut_line[0]) continue;
+            live++;
+            if (!seed) continue;
+            char line[UT_LINESIZE + 1];
+            snprintf(line, sizeof(line), "%.*s", UT_LINESIZE, ut->ut_line);
+            login_session_open(ut, line);
+        }
+    }
+    close(fd);
+    metric_set(METRIC_SESSIONS, live);
+}
+
+static int logins_open_wtmp(uint64_t offset) {
+    int fd = open(_PATH_WTMP, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int same = (st.st_dev == wtmp_dev && st.st_ino == wtmp_ino);
+    wtmp_fd = fd;
+    wtmp_dev = st.st_dev;
+    wtmp_ino = st.st_ino;
+    wtmp_offset = same ? offset - offset % sizeof(struct utmp) : 0;
+    if (inotify_fd >= 0) wtmp_wd = inotify_add_watch(inotify_fd, _PATH_WTMP, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    return 0;
+}
+
+/* After a rotation the rest of the old file is read before switching to the new one */
+static void logins_reopen_wtmp(void) {
+    struct stat st;
+    if (stat(_PATH_WTMP, &st) != 0 || (wtmp_fd >= 0 && st.st_dev == wtmp_dev && st.st_ino == wtmp_ino)) return;
+    if (wtmp_fd >= 0) {
+        logins_read_wtmp();
+        if (wtmp_wd >= 0) inotify_rm_watch(inotify_fd, wtmp_wd);
+        close(wtmp_fd);
+        wtmp_fd = wtmp_wd = -1;
+    }
+    logins_open_wtmp(0);
+}
+
+static int logins_inotify_event(const struct inotify_event *event) {
+    if (event->wd == wtmp_wd) {
+        wtmp_dirty = 1;
+        if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) logins_reopen_wtmp();
+        return 1;
+    }
+    if (event->wd == utmp_wd) {
+        utmp_dirty = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static void logins_read_dirty(void) {
+    if (wtmp_dirty) logins_read_wtmp();
+    if (utmp_dirty) logins_read_utmp(0);
+}
+
+void save_logins_state(void) {
+    if (wtmp_fd < 0 || wtmp_offset == wtmp_saved_offset) return;
+    FILE *file = fopen(WTMP_STATE_FILE ".tmp", "w");
+    if (!file) return;
+    int ok = fprintf(file, "%llu %llu %llu\n", (unsigned long long)wtmp_dev, (unsigned long long)wtmp_ino,
+                     (unsigned long long)wtmp_offset) > 0;
+    if (fclose(file) == 0 && ok && rename(WTMP_STATE_FILE ".tmp", WTMP_STATE_FILE) == 0) wtmp_saved_offset = wtmp_offset;
+    else unlink(WTMP_STATE_FILE ".tmp");
+}
+
+/* Catches rotations, and writes whose events were lost or that came without inotify */
+void logins_tick(void) {
+    if (!logins_enabled) return;
+    logins_reopen_wtmp();
+    logins_read_wtmp();
+    if (utmp_dirty || utmp_wd < 0) logins_read_utmp(0);
+    save_logins_state();
+}
+
+/* Without a checkpoint for the current wtmp, reading starts at its end */
+int init_logins(void) {
+    if (!logins_enabled) return 0;
+    unsigned long long dev = 0, ino = 0, offset = 0;
+    FILE *file = fopen(WTMP_STATE_FILE, "r");
+    int found = file && fscanf(file, "%llu %llu %llu", &dev, &ino, &offset) == 3;
+    if (file) fclose(file);
+    if (found) {
+        wtmp_dev = (dev_t)dev;
+        wtmp_ino = (ino_t)ino;
+    }
+    
+    logins_read_utmp(1);
+    if (inotify_fd >= 0) utmp_wd = inotify_add_watch(inotify_fd, _PATH_UTMP, IN_MODIFY);
+    if (logins_open_wtmp(offset) != 0) return -1;
+    struct stat st;
+    if (!found && fstat(wtmp_fd, &st) == 0) wtmp_offset = (uint64_t)st.st_size - (uint64_t)st.st_size % sizeof(struct utmp);
+    wtmp_saved_offset = wtmp_offset;
+    wtmp_dirty = 1;
+    return 0;
+}
+
+int init_directory_monitoring(void) {
+    inotify_fd = inotify_init();
+    if (inotify_fd < 0) return -1;
+    
+    for (size_t i = 0; i < NUM_WATCH_DIRS; i++) {
+        int wd = inotify_add_watch(inotify_fd, watch_dirs[i].path, 
+                                   IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+        if (wd >= 0) {
+            watch_dirs[i].wd = wd;
+            watch_dirs[i].last_check = time(NULL);
+        }
+    }
+    return 0;
+}
+
+void check_directory_changes(const char *username) {
+    if (inotify_fd < 0) return;
+    
+    fd_set read_fds;
+    struct timeval timeout = {0, 0};
+    FD_ZERO(&read_fds);
+    FD_SET(inotify_fd, &read_fds);
+    
+    if (select(inotify_fd + 1, &read_fds, NULL, NULL, &timeout) > 0) {
+        int pending = 0;
+        if (ioctl(inotify_fd, FIONREAD, &pending) == 0) {
+            self_counters.inotify_queue_bytes = pending;
+            if (pending > self_counters.inotify_queue_peak) self_counters.inotify_queue_peak = pending;
+        }
+        char buffer[4096];
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        
+        if (length > 0) {
+            int i = 0;
+            while (i < length) {
+                struct inotify_event *event = (struct inotify_event *)&buffer[i];
+                self_counters.inotify_events++;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    self_counters.inotify_overflows++;
+                    metric_set(METRIC_INOTIFY_OVERFLOWS, (double)self_counters.inotify_overflows);
+                }
+                if ((num_tails > 0 && tail_inotify_event(event)) || (logins_enabled && logins_inotify_event(event))) {
+                    i += sizeof(struct inotify_event) + event->len;
+                    continue;
+                }
+                
+                for (size_t j = 0; j < NUM_WATCH_DIRS; j++) {
+                    if (watch_dirs[j].wd == event->wd) {
+                        if (event->len > 0 && strncmp(event->name, LOG_BASENAME, sizeof(LOG_BASENAME) - 1) == 0) break;
+                        metric_add(watch_dirs[j].metric, 1);
+                        if (!log_enabled(COLLECTOR_INOTIFY, LOG_INFO)) break;
+                        
+                        const char *event_type = "modification";
+                        if (event->mask & IN_CREATE) event_type = "creation";
+                        else if (event->mask & IN_DELETE) event_type = "deletion";
+                        else if (event->mask & IN_MODIFY) event_type = "modification";
+                        else if (event->mask & IN_MOVED_FROM) event_type = "moved from";
+                        else if (event->mask & IN_MOVED_TO) event_type = "moved to";
+                        
+                        char msg[1024];
+                        if (event->len > 0) {
+                            snprintf(msg, sizeof(msg), "%s: %s of file %s", 
+                                    watch_dirs[j].path, event_type, event->name);
+                        } else {
+                            snprintf(msg, sizeof(msg), "%s: %s", 
+                                    watch_dirs[j].path, event_type);
+                        }
+                        record_fields_t fields = {"check_directory_changes", NULL, 0, watch_dirs[j].path,
+                                                  event->len > 0 ? event->name : NULL, event_type};
+                        log_record(username, msg, LOG_INFO, &fields);
+                        break;
+                    }
+                }
+                i += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        tail_read_dirty();
+        logins_read_dirty();
+    }
+}
+
+static void inotify_handler(int fd __attribute__((unused)), short revents __attribute__((unused)),
+                            void *arg __attribute__((unused))) {
+    TIMED(HIST_INOTIFY, check_directory_changes(get_username()));
+}
+
+void check_directory_changes_periodic(const char *username) {
+    static time_t last_check = 0;
+    time_t now = time(NULL);
+    if (now - last_check < 30) return;
+    last_check = now;
+    
+    for (size_t i = 0; i < NUM_WATCH_DIRS; i++) {
+        struct stat st;
+        if (stat(watch_dirs[i].path, &st) == 0) {
+            if (strcmp(watch_dirs[i].path, LOG_DIR) == 0) {
+                struct stat log_st;
+                if (stat(LOG_FILE, &log_st) == 0 && st.st_mtime == log_st.st_mtime && watch_dirs[i].last_check > 0) {
+                    watch_dirs[i].last_check = st.st_mtime;
+                    continue;
+                }
+            }
+            
+            if (watch_dirs[i].last_check > 0 && st.st_mtime > watch_dirs[i].last_check &&
+                log_enabled(COLLECTOR_DIRECTORY, LOG_INFO)) {
+                char msg[MAX_PATH_LEN + 64];
+                snprintf(msg, sizeof(msg), "Changes detected in directory: %.*s", MAX_PATH_LEN - 1, watch_dirs[i].path);
+                record_fields_t fields = {"check_directory_changes_periodic", NULL, 0, watch_dirs[i].path, NULL, "changes"};
+                log_record(username, msg, LOG_INFO, &fields);
+            }
+            watch_dirs[i].last_check = st.st_mtime;
+        }
+    }
+}
+
+static void write_stats_file(const struct rusage *usage, double cpu_percent) {
+    char tmp_path[MAX_PATH_LEN];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", STATS_FILE);
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) return;
+    
+    fprintf(file, "cpu_user_seconds %ld.%06ld\n", (long)usage->ru_utime.tv_sec, (long)usage->ru_utime.tv_usec);
+    fprintf(file, "cpu_system_seconds %ld.%06ld\n", (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec);
+    fprintf(file, "cpu_percent_last_interval %.3f\n", cpu_percent);
+    fprintf(file, "max_rss_kb %ld\n", usage->ru_maxrss);
+    fprintf(file, "records_logged %llu\n", (unsigned long long)self_counters.records_logged);
+    fprintf(file, "bytes_written %llu\n", (unsigned long long)__atomic_load_n(&self_counters.bytes_written, __ATOMIC_RELAXED));
+    fprintf(file, "records_dropped %llu\n", (unsigned long long)__atomic_load_n(&self_counters.records_dropped, __ATOMIC_RELAXED));
+    fprintf(file, "inotify_events %llu\n", (unsigned long long)self_counters.inotify_events);
+    fprintf(file, "inotify_overflows %llu\n", (unsigned long long)self_counters.inotify_overflows);
+    fprintf(file, "inotify_queue_bytes %d\n", self_counters.inotify_queue_bytes);
+    fprintf(file, "inotify_queue_peak_bytes %d\n", self_counters.inotify_queue_peak);
+    fprintf(file, "\n%-34s %10s %10s %10s %10s %10s\n", "latency_us", "count", "p50", "p90", "p99", "max");
+    for (int i = 0; i < NUM_HISTS; i++) {
+        latency_hist_t hist;
+        hist_snapshot(&hists[i], &hist);
+        fprintf(file, "%-34s %10llu %10.1f %10.1f %10.1f %10.1f\n", hist.name, (unsigned long long)hist.count,
+                hist_percentile(&hist, 50) / 1000.0, hist_percentile(&hist, 90) / 1000.0,
+                hist_percentile(&hist, 99) / 1000.0, hist.max_ns / 1000.0);
+    }
+    
+    if (fclose(file) != 0 || rename(tmp_path, STATS_FILE) != 0) unlink(tmp_path);
+}
+
+void log_self_stats(const char *username) {
+    static struct rusage last_usage;
+    static uint64_t last_ns = 0;
+    static time_t last_emit = 0;
+    time_t now = time(NULL);
+    if (self_stats_interval == 0) return;
+    if (last_emit == 0) {
+        last_emit = now;
+        last_ns = monotonic_ns();
+        getrusage(RUSAGE_SELF, &last_usage);
+        return;
+    }
+    if (now - last_emit < self_stats_interval) return;
+    last_emit = now;
+    
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return;
+    uint64_t now_ns = monotonic_ns();
+    
+    double user_ms = (usage.ru_utime.tv_sec - last_usage.ru_utime.tv_sec) * 1000.0 +
+                     (usage.ru_utime.tv_usec - last_usage.ru_utime.tv_usec) / 1000.0;
+    double sys_ms = (usage.ru_stime.tv_sec - last_usage.ru_stime.tv_sec) * 1000.0 +
+                    (usage.ru_stime.tv_usec - last_usage.ru_stime.tv_usec) / 1000.0;
+    double cpu_percent = (user_ms + sys_ms) * 1e6 / (double)(now_ns - last_ns) * 100.0;
+    
+    if (log_enabled(COLLECTOR_SELF, LOG_INFO)) {
+        char msg[1024];
+        snprintf(msg, sizeof(msg),
+                "Self stats: cpu user %.1f ms, system %.1f ms (%.3f%%), max RSS %ld KB, "
+                "minor faults %ld, major faults %ld, context switches %ld/%ld, "
+                "records %llu, bytes written %llu, dropped %llu, inotify queue %d bytes (peak %d), overflows %llu",
+                user_ms, sys_ms, cpu_percent, usage.ru_maxrss,
+                usage.ru_minflt - last_usage.ru_minflt, usage.ru_majflt - last_usage.ru_majflt,
+                usage.ru_nvcsw - last_usage.ru_nvcsw, usage.ru_nivcsw - last_usage.ru_nivcsw,
+                (unsigned long long)self_counters.records_logged,
+                (unsigned long long)__atomic_load_n(&self_counters.bytes_written, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&self_counters.records_dropped, __ATOMIC_RELAXED),
+                self_counters.inotify_queue_bytes, self_counters.inotify_queue_peak,
+                (unsigned long long)self_counters.inotify_overflows);
+        record_metric_t values[] = {
+            {"cpu_user_ms", user_ms}, {"cpu_system_ms", sys_ms}, {"max_rss_kb", (double)usage.ru_maxrss},
+            {"records_logged", (double)self_counters.records_logged},
+            {"bytes_written", (double)__atomic_load_n(&self_counters.bytes_written, __ATOMIC_RELAXED)},
+            {"records_dropped", (double)__atomic_load_n(&self_counters.records_dropped, __ATOMIC_RELAXED)},
+            {"inotify_overflows", (double)self_counters.inotify_overflows}
+        };
+        record_fields_t fields = {"log_self_stats", values, (int)(sizeof(values) / sizeof(values[0])), NULL, NULL, NULL};
+        log_record(username, msg, LOG_INFO, &fields);
+        
+        size_t len = (size_t)snprintf(msg, sizeof(msg), "Self stats latency p50/p99/max us:");
+        for (int i = 0; i < NUM_HISTS && len < sizeof(msg); i++) {
+            latency_hist_t hist;
+            hist_snapshot(&hists[i], &hist);
+            len += (size_t)snprintf(msg + len, sizeof(msg) - len, "%s %s %.0f/%.0f/%.0f",
+                                   i ? "," : "", hist.name,
+                                   hist_percentile(&hist, 50) / 1000.0,
+                                   hist_percentile(&hist, 99) / 1000.0,
+                                   hist.max_ns / 1000.0);
+        }
+        log_record(username, msg, LOG_INFO, NULL);
+    }
+    
+    write_stats_file(&usage, cpu_percent);
+    last_usage = usage;
+    last_ns = now_ns;
+}
+
+void update_self_metrics(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        metric_set(METRIC_CPU_USER_SECONDS, usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6);
+        metric_set(METRIC_CPU_SYSTEM_SECONDS, usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+        metric_set(METRIC_MAX_RSS_BYTES, usage.ru_maxrss * 1024.0);
+    }
+    metric_set(METRIC_RECORDS_LOGGED, (double)self_counters.records_logged);
+    metric_set(METRIC_BYTES_WRITTEN, (double)__atomic_load_n(&self_counters.bytes_written, __ATOMIC_RELAXED));
+    metric_set(METRIC_RECORDS_DROPPED, (double)__atomic_load_n(&self_counters.records_dropped, __ATOMIC_RELAXED));
+    for (int i = 0; i < NUM_SINKS; i++) {
+        metric_set(METRIC_SINK_DELIVERED + i, (double)__atomic_load_n(&sinks[i].delivered, __ATOMIC_RELAXED));
+        metric_set(METRIC_SINK_DROPPED + i, (double)__atomic_load_n(&sinks[i].dropped, __ATOMIC_RELAXED));
+    }
+}
+
+/* Accepts "host:port" or a bare port (meaning 127.0.0.1) */
+int parse_inet_address(const char *spec, struct sockaddr_in *addr) {
+    char host[256] = "127.0.0.1";
+    const char *colon = strrchr(spec, ':');
+    const char *port_str = spec;
+    if (colon) {
+        size_t host_len = (size_t)(colon - spec);
+        if (host_len >= sizeof(host)) return -1;
+        memcpy(host, spec, host_len);
+        host[host_len] = '\0';
+        port_str = colon + 1;
+    }
+    
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (getaddrinfo(host, port_str, &hints, &result) != 0) return -1;
+    memcpy(addr, result->ai_addr, sizeof(*addr));
+    freeaddrinfo(result);
+    return 0;
+}
+
+static size_t render_prometheus(char *buf, size_t size) {
+    size_t len = 0;
+    const char *last_name = "";
+    
+    for (int i = 0; i < NUM_METRICS && len < size; i++) {
+        if (strcmp(metrics[i].name, last_name) != 0) {
+            if (metrics[i].help) {
+                len += (size_t)snprintf(buf + len, size - len, "# HELP %s %s\n", metrics[i].name, metrics[i].help);
+                if (len >= size) break;
+            }
+            len += (size_t)snprintf(buf + len, size - len, "# TYPE %s %s\n", metrics[i].name, metrics[i].type);
+            if (len >= size) break;
+            last_name = metrics[i].name;
+        }
+        len += (size_t)snprintf(buf + len, size - len, "%s%s%s%s %.15g\n", metrics[i].name,
+                               metrics[i].labels ? "{" : "", metrics[i].labels ? metrics[i].labels : "",
+                               metrics[i].labels ? "}" : "", metrics[i].value);
+    }
+    
+    static const double quantiles[] = {0.5, 0.9, 0.99};
+    if (len < size) {
+        len += (size_t)snprintf(buf + len, size - len,
+                               "# HELP system_logger_latency_seconds Collector and log write latency\n"
+                               "# TYPE system_logger_latency_seconds summary\n");
+    }
+    for (int i = 0; i < NUM_HISTS && len < size; i++) {
+        latency_hist_t hist;
+        hist_snapshot(&hists[i], &hist);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && len < size; q++) {
+            len += (size_t)snprintf(buf + len, size - len,
+                                   "system_logger_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                                   hist.name, quantiles[q],
+                                   hist_percentile(&hist, quantiles[q] * 100.0) / 1e9);
+        }
+        if (len < size) {
+            len += (size_t)snprintf(buf + len, size - len,
+                                   "system_logger_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                                   "system_logger_latency_seconds_count{stage=\"%s\"} %llu\n",
+                                   hist.name, hist.sum_ns / 1e9,
+                                   hist.name, (unsigned long long)hist.count);
+        }
+    }
+    return len < size ? len : size;
+}
+
+static void http_client_close(http_client_t *client) {
+    poll_unregister(client->fd);
+    close(client->fd);
+    if (client->snapshot) client->snapshot->readers--;
+    client->fd = -1;
+    client->snapshot = NULL;
+}
+
+/*
+ * A client that sends or reads nothing for HTTP_IDLE_TIMEOUT seconds is dropped, so it can neither
+ * hold a slot nor keep a snapshot pinned. Runs every tick and when accept finds no free slot.
+ */
+static void http_close_idle_clients(void) {
+    uint64_t now = monotonic_ns();
+    for (int i = 0; i < MAX_HTTP_CLIENTS; i++) {
+        if (http_clients[i].fd >= 0 && now >= http_clients[i].idle_deadline_ns) http_client_close(&http_clients[i]);
+    }
+}
+
+void publish_metrics_snapshot(void) {
+    if (metrics_listen_fd < 0) return;
+    http_close_idle_clients();
+    metrics_snapshot_t *back = &metrics_snapshots[metrics_front ^ 1];
+    if (back->readers > 0) return;
+    back->len = render_prometheus(back->data, sizeof(back->data));
+    metrics_front ^= 1;
+}
+
+static void http_client_respond(http_client_t *client) {
+    static const char not_found[] = "Not Found\n";
+    if (strncmp(client->request, "GET /metrics ", 13) == 0 || strncmp(client->request, "GET /metrics?", 13) == 0) {
+        client->snapshot = &metrics_snapshots[metrics_front];
+        client->snapshot->readers++;
+        client->body = client->snapshot->data;
+        client->body_len = client->snapshot->len;
+        client->header_len = (size_t)snprintf(client->header, sizeof(client->header),
+                                              "HTTP/1.0 200 OK\r\n"
+                                              "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", client->body_len);
+    } else {
+        client->body = not_found;
+        client->body_len = sizeof(not_found) - 1;
+        client->header_len = (size_t)snprintf(client->header, sizeof(client->header),
+                                              "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+                                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", client->body_len);
+    }
+    client->sent = 0;
+    poll_set_events(client->fd, POLLOUT);
+}
+
+static void http_client_handler(int fd __attribute__((unused)), short revents, void *arg) {
+    http_client_t *client = arg;
+    if (revents & (POLLERR | POLLNVAL)) {
+        http_client_close(client);
+        return;
+    }
+    
+    if (client->body == NULL) {
+        ssize_t n = read(client->fd, client->request + client->request_len,
+                         sizeof(client->request) - 1 - client->request_len);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+            http_client_close(client);
+            return;
+        }
+        client->request_len += (size_t)n;
+        client->request[client->request_len] = '\0';
+        client->idle_deadline_ns = monotonic_ns() + HTTP_IDLE_TIMEOUT * 1000000000ULL;
+        if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n") ||
+            client->request_len == sizeof(client->request) - 1) {
+            http_client_respond(client);
+        }
+        return;
+    }
+    
+    size_t total = client->header_len + client->body_len;
+    while (client->sent < total) {
+        ssize_t n;
+        if (client->sent < client->header_len) {
+            n = write(client->fd, client->header + client->sent, client->header_len - client->sent);
+        } else {
+            size_t offset = client->sent - client->header_len;
+            n = write(client->fd, client->body + offset, client->body_len - offset);
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) return;
+            break;
+        }
+        client->sent += (size_t)n;
+        client->idle_deadline_ns = monotonic_ns() + HTTP_IDLE_TIMEOUT * 1000000000ULL;
+    }
+    http_client_close(client);
+}
+
+static void metrics_accept_handler(int fd, short revents __attribute__((unused)), void *arg __attribute__((unused))) {
+    while (1) {
+        int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) return;
+        
+        http_client_t *client = NULL;
+        for (int pass = 0; pass < 2 && !client; pass++) {
+            if (pass == 1) http_close_idle_clients();
+            for (int i = 0; i < MAX_HTTP_CLIENTS; i++) {
+                if (http_clients[i].fd < 0) {
+                    client = &http_clients[i];
+                    break;
+                }
+            }
+        }
+        if (!client || poll_register(client_fd, POLLIN, http_client_handler, client) != 0) {
+            close(client_fd);
+            continue;
+        }
+        client->fd = client_fd;
+        client->request_len = 0;
+        client->body = NULL;
+        client->snapshot = NULL;
+        client->idle_deadline_ns = monotonic_ns() + HTTP_IDLE_TIMEOUT * 1000000000ULL;
+    }
+}
+
+/* METRICS_LISTEN is either "unix:/path" or "host:port"; only loopback addresses are accepted */
+int init_metrics_server(void) {
+    for (int i = 0; i < MAX_HTTP_CLIENTS; i++) http_clients[i].fd = -1;
+    if (metrics_listen[0] == '\0') return 0;
+    
+    int fd;
+    if (strncmp(metrics_listen, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(metrics_listen + 5) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, metrics_listen + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        unlink(addr.sun_path);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr;
+        if (parse_inet_address(metrics_listen, &addr) != 0 || (ntohl(addr.sin_addr.s_addr) >> 24) != 127) {
+            errno = EINVAL;
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    
+    if (listen(fd, MAX_HTTP_CLIENTS) != 0 || poll_register(fd, POLLIN, metrics_accept_handler, NULL) != 0) {
+        close(fd);
+        return -1;
+    }
+    metrics_listen_fd = fd;
+    publish_metrics_snapshot();
+    return 0;
+}
+
+int init_shm_segment(void) {
+    shm_size = sizeof(shm_segment_t) + SHM_NUM_METRICS * sizeof(shm_metric_t);
+    int fd = open(SHM_PATH ".tmp", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, (off_t)shm_size) != 0) {
+        close(fd);
+        unlink(SHM_PATH ".tmp");
+        return -1;
+    }
+    void *map = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(SHM_PATH ".tmp");
+        return -1;
+    }
+    
+    shm_segment_t *segment = map;
+    segment->version = SHM_VERSION;
+    segment->num_metrics = SHM_NUM_METRICS;
+    segment->metric_size = sizeof(shm_metric_t);
+    segment->pid = getpid();
+    segment->interval = log_interval;
+    for (int i = 0; i < NUM_METRICS; i++) {
+        snprintf(segment->metrics[i].name, SHM_NAME_LEN, "%s", metrics[i].name);
+        snprintf(segment->metrics[i].labels, SHM_LABELS_LEN, "%s", metrics[i].labels ? metrics[i].labels : "");
+    }
+    for (int i = 0; i < NUM_HISTS; i++) {
+        shm_metric_t *p50 = &segment->metrics[NUM_METRICS + 2 * i];
+        snprintf(p50->name, SHM_NAME_LEN, "system_logger_latency_p50_seconds");
+        snprintf(p50->labels, SHM_LABELS_LEN, "stage=\"%s\"", hists[i].name);
+        shm_metric_t *p99 = p50 + 1;
+        snprintf(p99->name, SHM_NAME_LEN, "system_logger_latency_p99_seconds");
+        snprintf(p99->labels, SHM_LABELS_LEN, "stage=\"%s\"", hists[i].name);
+    }
+    __atomic_store_n(&segment->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    
+    if (rename(SHM_PATH ".tmp", SHM_PATH) != 0) {
+        munmap(map, shm_size);
+        unlink(SHM_PATH ".tmp");
+        return -1;
+    }
+    shm_segment = segment;
+    return 0;
+}
+
+void publish_shm_metrics(void) {
+    if (!shm_segment) return;
+    uint64_t seq = shm_segment->seq;
+    __atomic_store_n(&shm_segment->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    
+    for (int i = 0; i < NUM_METRICS; i++) shm_segment->metrics[i].value = metrics[i].value;
+    for (int i = 0; i < NUM_HISTS; i++) {
+        latency_hist_t hist;
+        hist_snapshot(&hists[i], &hist);
+        shm_segment->metrics[NUM_METRICS + 2 * i].value = hist_percentile(&hist, 50) / 1e9;
+        shm_segment->metrics[NUM_METRICS + 2 * i + 1].value = hist_percentile(&hist, 99) / 1e9;
+    }
+    shm_segment->updated_sec = time(NULL);
+    
+    __atomic_store_n(&shm_segment->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int init_statsd_sink(void) {
+    if (statsd_target[0] == '\0') return 0;
+    struct sockaddr_in addr;
+    if (parse_inet_address(statsd_target, &addr) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; i < STATSD_MAX_PACKETS; i++) {
+        statsd_sink.iov[i].iov_base = statsd_sink.packets[i];
+        memset(&statsd_sink.msgs[i], 0, sizeof(statsd_sink.msgs[i]));
+        statsd_sink.msgs[i].msg_hdr.msg_iov = &statsd_sink.iov[i];
+        statsd_sink.msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (int i = 0; i < NUM_METRICS; i++) statsd_sink.last_counter[i] = metrics[i].value;
+    statsd_sink.fd = fd;
+    return 0;
+}
+
+/* Appends the metric name with dots, e.g. system_logger_tcp_established -> prefix.tcp_established */
+static size_t statsd_format_name(char *buf, size_t size, const metric_t *metric) {
+    const char *name = metric->name;
+    if (strncmp(name, "system_logger_", 14) == 0) name += 14;
+    return (size_t)snprintf(buf, size, "%s%s%s", statsd_prefix, statsd_prefix[0] ? "." : "", name);
+}
+
+/* Converts dir="/etc" labels and STATSD_TAGS=k:v,k:v into "|#k:v" (StatsD) or ";k=v" (Graphite) */
+static size_t statsd_format_tags(char *buf, size_t size, const metric_t *metric) {
+    size_t len = 0;
+    char pairs[2][MAX_CONFIG_LINE];
+    int num_pairs = 0;
+    
+    if (metric->labels) {
+        const char *eq = strchr(metric->labels, '=');
+        if (eq) {
+            const char *value = eq + 1;
+            size_t value_len = strlen(value);
+            if (value_len >= 2 && value[0] == '"') {
+                value++;
+                value_len -= 2;
+            }
+            snprintf(pairs[num_pairs++], sizeof(pairs[0]), "%.*s:%.*s", (int)(eq - metric->labels),
+                     metric->labels, (int)value_len, value);
+        }
+    }
+    if (statsd_tags[0]) snprintf(pairs[num_pairs++], sizeof(pairs[0]), "%s", statsd_tags);
+    
+    for (int i = 0; i < num_pairs && len < size; i++) {
+        if (statsd_graphite) {
+            for (const char *p = pairs[i]; *p && len + 2 < size; p++) {
+                if (p == pairs[i] || *p == ',') {
+                    buf[len++] = ';';
+                    if (*p == ',') continue;
+                }
+                buf[len++] = (*p == ':') ? '=' : *p;
+            }
+        } else {
+            len += (size_t)snprintf(buf + len, size - len, "%s%s", i == 0 ? "|#" : ",", pairs[i]);
+        }
+    }
+    if (len >= size) len = size - 1;
+    buf[len] = '\0';
+    return len;
+}
+
+void emit_statsd_metrics(void) {
+    if (statsd_sink.fd < 0) return;
+    time_t now = time(NULL);
+    int packet = 0;
+    size_t used = 0;
+    
+    for (int i = 0; i < NUM_METRICS; i++) {
+        char name[MAX_CONFIG_LINE + 64], tags[2 * MAX_CONFIG_LINE + 8], line[sizeof(name) + sizeof(tags) + 64];
+        int is_counter = (strcmp(metrics[i].type, "counter") == 0);
+        double value = metrics[i].value;
+        if (is_counter && !statsd_graphite) {
+            value -= statsd_sink.last_counter[i];
+            statsd_sink.last_counter[i] = metrics[i].value;
+        }
+        
+        statsd_format_name(name, sizeof(name), &metrics[i]);
+        statsd_format_tags(tags, sizeof(tags), &metrics[i]);
+        int line_len;
+        if (statsd_graphite) {
+            line_len = snprintf(line, sizeof(line), "%s%s %.15g %lld\n", name, tags, value, (long long)now);
+        } else {
+            line_len = snprintf(line, sizeof(line), "%s:%.15g|%s%s\n", name, value, is_counter ? "c" : "g", tags);
+        }
+        if (line_len <= 0 || (size_t)line_len >= sizeof(line) || line_len > statsd_payload) continue;
+        
+        if (used + (size_t)line_len > (size_t)statsd_payload) {
+            statsd_sink.iov[packet].iov_len = used;
+            if (++packet == STATSD_MAX_PACKETS) break;
+            used = 0;
+        }
+        memcpy(statsd_sink.packets[packet] + used, line, (size_t)line_len);
+        used += (size_t)line_len;
+    }
+    if (packet < STATSD_MAX_PACKETS && used > 0) statsd_sink.iov[packet++].iov_len = used;
+    
+    int sent = 0;
+    while (sent < packet) {
+        int n = sendmmsg(statsd_sink.fd, statsd_sink.msgs + sent, (unsigned int)(packet - sent), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            statsd_sink.send_errors += (uint64_t)(packet - sent);
+            break;
+        }
+        sent += n;
+    }
+    statsd_sink.datagrams_sent += (uint64_t)sent;
+    metric_set(METRIC_STATSD_DATAGRAMS, (double)statsd_sink.datagrams_sent);
+    metric_set(METRIC_STATSD_SEND_ERRORS, (double)statsd_sink.send_errors);
+}
+
+/* "unix:/path" or "host:port" into a connect/bind address */
+static int parse_socket_address(const char *spec, struct sockaddr_storage *addr, socklen_t *addr_len) {
+    memset(addr, 0, sizeof(*addr));
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        if (strlen(spec + 5) >= sizeof(un->sun_path)) return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, spec + 5);
+        *addr_len = sizeof(*un);
+        return 0;
+    }
+    if (parse_inet_address(spec, (struct sockaddr_in *)addr) != 0) return -1;
+    *addr_len = sizeof(struct sockaddr_in);
+    return 0;
+}
+
+static void forward_connect(void) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (parse_socket_address(forward_target, &addr, &addr_len) != 0) return;
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        forward_disconnect();
+        return;
+    }
+    if ((connect(fd, (struct sockaddr *)&addr, addr_len) != 0 && errno != EINPROGRESS) ||
+        poll_register(fd, POLLOUT, forward_handler, NULL) != 0) {
+        close(fd);
+        forward_disconnect();
+        return;
+    }
+    forwarder.fd = fd;
+}
+
+/* Reopens the spool left by the previous run, dropping a torn last frame, and resumes seq after FORWARD_SEQ_FILE and the spooled frames */
+int init_forwarder(void) {
+    forwarder_t *f = &forwarder;
+    if (forward_target[0] == '\0') return 0;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (parse_socket_address(forward_target, &addr, &addr_len) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->window = malloc(forward_window_size);
+    if (!f->window) return -1;
+    
+    FILE *file = fopen(FORWARD_SEQ_FILE, "r");
+    unsigned long long saved;
+    if (file && fscanf(file, "%llu", &saved) == 1) {
+        f->next_seq = saved;
+    } else {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        f->next_seq = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+    }
+    if (file) fclose(file);
+    f->spool_fd = open(FORWARD_SPOOL_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (f->spool_fd >= 0 && fstat(f->spool_fd, &st) == 0) {
+        uint64_t offset = 0;
+        unsigned char header[FORWARD_FRAME_HEADER];
+        while (offset + sizeof(header) <= (uint64_t)st.st_size &&
+               pread(f->spool_fd, header, sizeof(header), (off_t)offset) == (ssize_t)sizeof(header)) {
+            uint32_t len;
+            uint64_t seq;
+            memcpy(&len, header, sizeof(len));
+            memcpy(&seq, header + 4, sizeof(seq));
+            if (offset + sizeof(header) + be32toh(len) > (uint64_t)st.st_size) break;
+            if (be64toh(seq) >= f->next_seq) f->next_seq = be64toh(seq) + 1;
+            offset += sizeof(header) + be32toh(len);
+        }
+        if (offset < (uint64_t)st.st_size && ftruncate(f->spool_fd, (off_t)offset) != 0) offset = 0;
+        f->spool_size = offset;
+    }
+    forward_reserve_seq();
+    forward_refill();
+    forward_connect();
+    return 0;
+}
+
+void forward_tick(const char *username) {
+    forwarder_t *f = &forwarder;
+    if (!f->window) return;
+    if (f->fd < 0 && time(NULL) >= f->retry_at) forward_connect();
+    forward_refill();
+    forward_flush();
+    
+    if (f->connected != f->reported) {
+        char msg[MAX_PATH_LEN + 64];
+        snprintf(msg, sizeof(msg), f->connected ? "Forwarding to %s" : "Forward target %s unreachable, spooling",
+                 forward_target);
+        f->reported = f->connected;
+        int priority = f->connected ? LOG_INFO : LOG_WARNING;
+        if (log_enabled(COLLECTOR_FORWARD, priority)) log_record(username, msg, priority, NULL);
+    }
+    metric_set(METRIC_FORWARD_WINDOW_BYTES, (double)f->window_len);
+    metric_set(METRIC_FORWARD_SPOOL_BYTES, (double)(f->spool_size - f->spool_read));
+    metric_set(METRIC_FORWARD_DROPPED, (double)f->dropped);
+    metric_set(METRIC_FORWARD_OVERSIZE, (double)f->oversize);
+}
+
+/* Saves unacknowledged window frames ahead of the remaining spool so a restart resends them */
+void forward_shutdown(void) {
+    forwarder_t *f = &forwarder;
+    if (!f->window || f->spool_fd < 0) return;
+    forward_rewrite_spool(f->window, f->window_len);
+}
+
+/*
+ * Kernel log collector (KMSG=1). /dev/kmsg is read non-blocking from the event loop, one record
+ * per read(), at most KMSG_BATCH records per wakeup so a burst cannot stall the collectors.
+ * Records look like "prio,seq,ts_usec,flags[,...];message\n[ KEY=value\n...]". A read failing
+ * with EPIPE, or a jump in seq, means the ring overwrote records we had not read; the gap is
+ * counted and reported. The last seq and the boot id are saved in KMSG_STATE_FILE so a restart
+ * in the same boot resumes after the last record instead of replaying the ring.
+ */
+static int kmsg_fd = -1;
+static uint64_t kmsg_next_seq = 0;
+static uint64_t kmsg_skip_until = 0;
+static uint64_t kmsg_saved_seq = 0;
+static uint64_t kmsg_records = 0;
+static uint64_t kmsg_dropped = 0;
+static char kmsg_boot_id[64] = "";
+
+static const char *kmsg_field(const char *p, const char *end, uint64_t *value) {
+    uint64_t result = 0;
+    const char *start = p;
+    while (p < end && *p >= '0' && *p <= '9') result = result * 10 + (uint64_t)(*p++ - '0');
+    if (p == start) return NULL;
+    *value = result;
+    return p;
+}
+
+/* Maps a syslog PRI (facility * 8 + severity) to the levels we log with */
+static int syslog_priority(uint64_t prio) {
+    int level = (int)(prio & 7);
+    if (level <= LOG_ERR) return LOG_ERR;
+    if (level == LOG_WARNING) return LOG_WARNING;
+    if (level == LOG_DEBUG) return LOG_DEBUG;
+    return LOG_INFO;
+}
+
+static void kmsg_report_gap(const char *username, uint64_t lost) {
+    kmsg_dropped += lost;
+    metric_set(METRIC_KMSG_DROPPED, (double)kmsg_dropped);
+    if (!log_enabled(COLLECTOR_KMSG, LOG_WARNING)) return;
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Kernel log overrun: %llu records lost", (unsigned long long)lost);
+    record_metric_t values[] = {{"dropped", (double)lost}};
+    record_fields_t fields = {"kmsg", values, 1, NULL, NULL, NULL};
+    log_record(username, msg, LOG_WARNING, &fields);
+}
+
+static void kmsg_handle_record(const char *username, const char *record, size_t len) {
+    const char *end = record + len;
+    const char *semicolon = memchr(record, ';', len);
+    uint64_t prio, seq, ts_usec;
+    const char *p = kmsg_field(record, end, &prio);
+    if (!semicolon || !p || *p != ',' || !(p = kmsg_field(p + 1, end, &seq)) || *p != ',' ||
+        !(p = kmsg_field(p + 1, end, &ts_usec))) {
+        return;
+    }
+    
+    if (seq < kmsg_skip_until) return;
+    if (kmsg_next_seq && seq > kmsg_next_seq) kmsg_report_gap(username, seq - kmsg_next_seq);
+    kmsg_next_seq = seq + 1;
+    kmsg_records++;
+    metric_set(METRIC_KMSG_RECORDS, (double)kmsg_records);
+    
+    int priority = syslog_priority(prio);
+    if (!log_enabled(COLLECTOR_KMSG, priority)) return;
+    const char *message = semicolon + 1;
+    const char *newline = memchr(message, '\n', (size_t)(end - message));
+    size_t msg_len = (size_t)((newline ? newline : end) - message);
+    char msg[KMSG_RECORD_MAX];
+    if (msg_len >= sizeof(msg)) msg_len = sizeof(msg) - 1;
+    memcpy(msg, message, msg_len);
+    msg[msg_len] = '\0';
+    record_metric_t values[] = {{"seq", (double)seq}, {"ts_usec", (double)ts_usec}};
+    record_fields_t fields = {"kmsg", values, 2, NULL, NULL, NULL};
+    log_record("kernel", msg, priority, &fields);
+}
+
+static void kmsg_handler(int fd, short revents __attribute__((unused)), void *arg __attribute__((unused))) {
+    const char *username = get_username();
+    char record[KMSG_RECORD_MAX];
+    for (int i = 0; i < KMSG_BATCH; i++) {
+        ssize_t n = read(fd, record, sizeof(record));
+        if (n > 0) {
+            kmsg_handle_record(username, record, (size_t)n);
+        } else if (n < 0 && errno == EPIPE) {
+            /* The next read returns the oldest record still in the ring; its seq shows the gap */
+            continue;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            break;
+        }
+    }
+}
+
+static void read_boot_id(char *buf, size_t size) {
+    buf[0] = '\0';
+    FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!file) return;
+    if (fgets(buf, (int)size, file)) buf[strcspn(buf, "\n")] = '\0';
+    fclose(file);
+}
+
+void save_kmsg_state(void) {
+    if (kmsg_fd < 0 || kmsg_next_seq == kmsg_saved_seq) return;
+    FILE *file = fopen(KMSG_STATE_FILE ".tmp", "w");
+    if (!file) return;
+    int ok = fprintf(file, "%s %llu\n", kmsg_boot_id, (unsigned long long)kmsg_next_seq) > 0;
+    if (fclose(file) == 0 && ok && rename(KMSG_STATE_FILE ".tmp", KMSG_STATE_FILE) == 0) kmsg_saved_seq = kmsg_next_seq;
+    else unlink(KMSG_STATE_FILE ".tmp");
+}
+
+int init_kmsg(void) {
+    if (!kmsg_enabled) return 0;
+    read_boot_id(kmsg_boot_id, sizeof(kmsg_boot_id));
+    FILE *file = fopen(KMSG_STATE_FILE, "r");
+    if (file) {
+        char boot_id[64];
+        unsigned long long seq;
+        if (fscanf(file, "%63s %llu", boot_id, &seq) == 2 && strcmp(boot_id, kmsg_boot_id) == 0) {
+            kmsg_skip_until = kmsg_next_seq = kmsg_saved_seq = seq;
+        }
+        fclose(file);
+    }
+    
+    kmsg_fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (kmsg_fd < 0) return -1;
+    if (poll_register(kmsg_fd, POLLIN, kmsg_handler, NULL) != 0) {
+        close(kmsg_fd);
+        kmsg_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Syslog receiver (SYSLOG_LISTEN=unix:/path or 127.0.0.1:port, repeatable). Datagrams are read
+ * SYSLOG_BATCH at a time with recvmmsg() and parsed in place: the parser only records spans into
+ * the receive buffer, RFC 5424 when the header starts with version "1", RFC 3164 otherwise.
+ * Messages without a <PRI> are logged as they are with user.notice, as RFC 3164 asks of relays.
+ * The source is "syslog:<app>"; our own messages are ignored so binding /dev/log with the syslog
+ * sink on cannot loop.
+ */
+typedef struct {
+    const char *p;
+    size_t len;
+} syslog_span_t;
+
+typedef struct {
+    int pri;
+    syslog_span_t host;
+    syslog_span_t app;
+    syslog_span_t procid;
+    char *msg;
+} syslog_message_t;
+
+typedef struct {
+    int fds[SYSLOG_MAX_LISTENERS];
+    int num_fds;
+    char packets[SYSLOG_BATCH][SYSLOG_MESSAGE_MAX];
+    struct iovec iov[SYSLOG_BATCH];
+    struct mmsghdr msgs[SYSLOG_BATCH];
+    uint64_t received;
+    uint64_t malformed;
+} syslog_receiver_t;
+
+static syslog_receiver_t syslog_receiver;
+
+/* "TAG[PID]: " as used by RFC 3164 senders; returns the start of the message or NULL */
+static char *syslog_parse_tag(char *p, char *end, syslog_message_t *message) {
+    char *q = p;
+    while (q < end && *q != ' ' && *q != ':' && *q != '[') q++;
+    if (q == p || q == end || *q == ' ') return NULL;
+    syslog_span_t app = {p, (size_t)(q - p)}, procid = {NULL, 0};
+    if (*q == '[') {
+        char *pid = ++q;
+        while (q < end && *q != ']' && *q != ' ') q++;
+        if (q == end || *q != ']') return NULL;
+        procid = (syslog_span_t){pid, (size_t)(q - pid)};
+        q++;
+    }
+    if (q == end || *q != ':') return NULL;
+    q++;
+    if (q < end && *q == ' ') q++;
+    message->app = app;
+    message->procid = procid;
+    return q;
+}
+
+static char *syslog_parse_5424(char *p, char *end, syslog_message_t *message) {
+    /* TIMESTAMP HOSTNAME APP-NAME PROCID MSGID, "-" for a missing value */
+    syslog_span_t header[5];
+    for (int i = 0; i < 5; i++) {
+        char *space = memchr(p, ' ', (size_t)(end - p));
+        if (!space) return NULL;
+        header[i] = (space - p == 1 && *p == '-') ? (syslog_span_t){NULL, 0} : (syslog_span_t){p, (size_t)(space - p)};
+        p = space + 1;
+    }
+    if (p < end && *p == '-') {
+        p++;
+    } else {
+        while (p < end && *p == '[') {
+            for (p++; p < end && *p != ']'; p++) {
+                if (*p != '"') continue;
+                for (p++; p < end && *p != '"'; p++) {
+                    if (*p == '\\' && p + 1 < end) p++;
+                }
+                if (p == end) return NULL;
+            }
+            if (p == end) return NULL;
+            p++;
+        }
+    }
+    if (p < end && *p == ' ') p++;
+    if (end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0) p += 3;
+    message->host = header[1];
+    message->app = header[2];
+    message->procid = header[3];
+    return p;
+}
+
+/* Splits buf in place; the message text is NUL-terminated inside buf, which has room for it */
+static int syslog_parse(char *buf, size_t len, syslog_message_t *message) {
+    char *p = buf, *end = buf + len;
+    while (end > p && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == '\0')) end--;
+    *end = '\0';
+    memset(message, 0, sizeof(*message));
+    message->pri = LOG_USER | LOG_NOTICE;
+    message->msg = buf;
+    
+    if (p == end || *p != '<') return -1;
+    int pri = 0;
+    const char *digits = ++p;
+    while (p < end && *p >= '0' && *p <= '9' && p - digits < 3) pri = pri * 10 + (*p++ - '0');
+    if (p == digits || p == end || *p != '>' || pri > 191) return -1;
+    p++;
+    
+    char *text;
+    if (end - p >= 2 && p[0] == '1' && p[1] == ' ') {
+        text = syslog_parse_5424(p + 2, end, message);
+    } else {
+        /* "Mmm dd hh:mm:ss " is optional, and so is the hostname, which the local socket never has */
+        if (end - p >= 16 && p[3] == ' ' && p[6] == ' ' && p[9] == ':' && p[12] == ':' && p[15] == ' ') p += 16;
+        text = syslog_parse_tag(p, end, message);
+        char *space = text ? NULL : memchr(p, ' ', (size_t)(end - p));
+        if (space && (text = syslog_parse_tag(space + 1, end, message))) message->host = (syslog_span_t){p, (size_t)(space - p)};
+        if (!text) text = p;
+    }
+    if (!text) return -1;
+    message->pri = pri;
+    message->msg = text;
+    return 0;
+}
+
+static void syslog_handle_message(char *buf, size_t len) {
+    syslog_message_t message;
+    syslog_receiver.received++;
+    if (syslog_parse(buf, len, &message) != 0) syslog_receiver.malformed++;
+    
+    int priority = syslog_priority((uint64_t)message.pri);
+    if (!log_enabled(COLLECTOR_SYSLOG, priority)) return;
+    uint64_t pid = 0;
+    int numeric_pid = message.procid.len > 0 && message.procid.len < 20;
+    for (size_t i = 0; numeric_pid && i < message.procid.len; i++) {
+        if (message.procid.p[i] < '0' || message.procid.p[i] > '9') numeric_pid = 0;
+        else pid = pid * 10 + (uint64_t)(message.procid.p[i] - '0');
+    }
+    if (numeric_pid && pid == (uint64_t)getpid()) return;
+    
+    char app[48], source[64];
+    static char escaped[4 * SYSLOG_MESSAGE_MAX];
+    const char *msg = message.msg;
+    const unsigned char *c = (const unsigned char *)msg;
+    while (*c >= 0x20 ? *c != 0x7f : *c == '\t') c++;
+    if (*c) {
+        escape_controls(escaped, sizeof(escaped), msg, strlen(msg));
+        msg = escaped;
+    }
+    escape_controls(app, sizeof(app), message.app.p, message.app.len);
+    if (app[0]) snprintf(source, sizeof(source), "syslog:%s", app);
+    else snprintf(source, sizeof(source), "syslog");
+    record_metric_t values[] = {{"facility", (double)(message.pri >> 3)}, {"pid", (double)pid}};
+    record_fields_t fields = {"syslog", values, numeric_pid ? 2 : 1, NULL, NULL, NULL};
+    log_record(source, msg, priority, &fields);
+}
+
+static void syslog_receive_handler(int fd, short revents __attribute__((unused)), void *arg __attribute__((unused))) {
+    for (int round = 0; round < SYSLOG_BATCHES_PER_WAKEUP; round++) {
+        int n = recvmmsg(fd, syslog_receiver.msgs, SYSLOG_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) break;
+        sink_defer_wakeups(1);
+        for (int i = 0; i < n; i++) syslog_handle_message(syslog_receiver.packets[i], syslog_receiver.msgs[i].msg_len);
+        sink_defer_wakeups(0);
+        if (n < SYSLOG_BATCH) break;
+    }
+    metric_set(METRIC_SYSLOG_RECEIVED, (double)syslog_receiver.received);
+    metric_set(METRIC_SYSLOG_MALFORMED, (double)syslog_receiver.malformed);
+}
+
+static int open_syslog_listener(const char *spec) {
+    int fd;
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(spec + 5) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, spec + 5);
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        unlink(addr.sun_path);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        /* Any local daemon may log, as with /dev/log */
+        chmod(addr.sun_path, 0666);
+    } else {
+        struct sockaddr_in addr;
+        if (parse_inet_address(spec, &addr) != 0 || (ntohl(addr.sin_addr.s_addr) >> 24) != 127) {
+            errno = EINVAL;
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    int rcvbuf = SYSLOG_RCVBUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (poll_register(fd, POLLIN, syslog_receive_handler, NULL) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void init_syslog_receiver(const char *username) {
+    for (int i = 0; i < SYSLOG_BATCH; i++) {
+        /* One byte is kept back for the terminating NUL the parser writes */
+        syslog_receiver.iov[i] = (struct iovec){syslog_receiver.packets[i], SYSLOG_MESSAGE_MAX - 1};
+        syslog_receiver.msgs[i].msg_hdr.msg_iov = &syslog_receiver.iov[i];
+        syslog_receiver.msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (int i = 0; i < num_syslog_listen; i++) {
+        int fd = open_syslog_listener(syslog_listen[i]);
+        if (fd >= 0) {
+            syslog_receiver.fds[syslog_receiver.num_fds++] = fd;
+            continue;
+        }
+        char msg[MAX_PATH_LEN + 128];
+        snprintf(msg, sizeof(msg), "Failed to listen for syslog messages on %.*s: %s", MAX_PATH_LEN - 1, syslog_listen[i],
+                 strerror(errno));
+        log_message(username, msg, LOG_WARNING);
+    }
+}
+
+void close_syslog_receiver(void) {
+    for (int i = 0; i < syslog_receiver.num_fds; i++) close(syslog_receiver.fds[i]);
+    syslog_receiver.num_fds = 0;
+    for (int i = 0; i < num_syslog_listen; i++) {
+        if (strncmp(syslog_listen[i], "unix:", 5) == 0) unlink(syslog_listen[i] + 5);
+    }
+}
+
+/*
+ * Network change collector (NETLINK=1). An rtnetlink socket subscribed to link, address and route
+ * notifications is read from the event loop. Links and their addresses are kept in a table, so only
+ * real changes are logged (the kernel repeats NEWLINK/NEWADDR for many attribute updates). On
+ * ENOBUFS the kernel has dropped notifications: the table is rebuilt from a link dump followed by
+ * an address dump, and whatever was missed shows up as the difference. Routes of the main table
+ * are logged as they come and are not tracked.
+ */
+typedef struct {
+    unsigned char family;
+    unsigned char prefix;
+    unsigned char bytes[16];
+    int seen;
+} netlink_addr_t;
+
+typedef struct {
+    int index;
+    char name[IFNAMSIZ];
+    unsigned int flags;
+    unsigned int mtu;
+    netlink_addr_t addrs[MAX_INTERFACE_ADDRS];
+    int num_addrs;
+    int seen;
+} netlink_iface_t;
+
+static netlink_iface_t netlink_ifaces[MAX_INTERFACES];
+static int num_netlink_ifaces = 0;
+static int netlink_fd = -1;
+static int netlink_dump = 0;
+static int netlink_quiet = 0;
+static int netlink_resync_pending = 0;
+static uint32_t netlink_seq = 0;
+static uint64_t netlink_events = 0;
+static uint64_t netlink_overruns = 0;
+static char netlink_buffer[NETLINK_BUFFER_SIZE] __attribute__((aligned(8)));
+
+static netlink_iface_t *netlink_iface_find(int index) {
+    for (int i = 0; i < num_netlink_ifaces; i++) {
+        if (netlink_ifaces[i].index == index) return &netlink_ifaces[i];
+    }
+    return NULL;
+}
+
+static const char *netlink_link_state(unsigned int flags) {
+    if (!(flags & IFF_UP)) return "down";
+    return (flags & IFF_RUNNING) ? "up" : "up, no carrier";
+}
+
+static void netlink_log(int priority, const char *msg, int index) {
+    if (netlink_quiet || !log_enabled(COLLECTOR_NETLINK, priority)) return;
+    record_metric_t values[] = {{"ifindex", (double)index}};
+    record_fields_t fields = {"netlink", values, 1, NULL, NULL, NULL};
+    log_record("netlink", msg, priority, &fields);
+}
+
+static void netlink_update_metrics(void) {
+    int up = 0;
+    for (int i = 0; i < num_netlink_ifaces; i++) {
+        if ((netlink_ifaces[i].flags & (IFF_UP | IFF_RUNNING)) == (IFF_UP | IFF_RUNNING)) up++;
+    }
+    metric_set(METRIC_INTERFACES, num_netlink_ifaces);
+    metric_set(METRIC_INTERFACES_UP, up);
+    metric_set(METRIC_NETLINK_EVENTS, (double)netlink_events);
+    metric_set(METRIC_NETLINK_OVERRUNS, (double)netlink_overruns);
+}
+
+static void netlink_remove_iface(netlink_iface_t *iface) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Interface %s removed", iface->name);
+    netlink_log(LOG_INFO, msg, iface->index);
+    *iface = netlink_ifaces[--num_netlink_ifaces];
+}
+
+static void netlink_handle_link(const struct nlmsghdr *nh) {
+    const struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    int len = (int)nh->nlmsg_len - (int)NLMSG_LENGTH(sizeof(*ifi));
+    if (len < 0 || ifi->ifi_family == AF_BRIDGE) return;
+    netlink_iface_t *iface = netlink_iface_find(ifi->ifi_index);
+    if (nh->nlmsg_type == RTM_DELLINK) {
+        if (iface) netlink_remove_iface(iface);
+        return;
+    }
+    
+    const char *name = NULL;
+    unsigned int mtu = 0;
+    for (const struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME) name = RTA_DATA(rta);
+        else if (rta->rta_type == IFLA_MTU && RTA_PAYLOAD(rta) >= sizeof(mtu)) memcpy(&mtu, RTA_DATA(rta), sizeof(mtu));
+    }
+    char msg[256];
+    if (!iface) {
+        if (num_netlink_ifaces == MAX_INTERFACES) return;
+        iface = &netlink_ifaces[num_netlink_ifaces++];
+        memset(iface, 0, sizeof(*iface));
+        iface->index = ifi->ifi_index;
+        snprintf(iface->name, sizeof(iface->name), "%s", name ? name : "?");
+        iface->flags = ifi->ifi_flags;
+        iface->mtu = mtu;
+        snprintf(msg, sizeof(msg), "Interface %s added, %s, mtu %u", iface->name, netlink_link_state(iface->flags), mtu);
+        netlink_log(LOG_INFO, msg, iface->index);
+    }
+    iface->seen = 1;
+    if (name && strncmp(iface->name, name, sizeof(iface->name) - 1) != 0) {
+        snprintf(msg, sizeof(msg), "Interface %s renamed to %.*s", iface->name, IFNAMSIZ - 1, name);
+        netlink_log(LOG_INFO, msg, iface->index);
+        snprintf(iface->name, sizeof(iface->name), "%s", name);
+    }
+    const char *was = netlink_link_state(iface->flags), *now = netlink_link_state(ifi->ifi_flags);
+    if (strcmp(was, now) != 0) {
+        snprintf(msg, sizeof(msg), "Interface %s is %s (was %s)", iface->name, now, was);
+        netlink_log(strcmp(was, "up") == 0 ? LOG_WARNING : LOG_INFO, msg, iface->index);
+    }
+    if (mtu && iface->mtu && mtu != iface->mtu) {
+        snprintf(msg, sizeof(msg), "Interface %s mtu changed from %u to %u", iface->name, iface->mtu, mtu);
+        netlink_log(LOG_INFO, msg, iface->index);
+    }
+    iface->flags = ifi->ifi_flags;
+    if (mtu) iface->mtu = mtu;
+}
+
+static void netlink_format_addr(char *buf, size_t size, int family, const void *bytes, int prefix) {
+    char text[INET6_ADDRSTRLEN] = "?";
+    inet_ntop(family, bytes, text, sizeof(text));
+    snprintf(buf, size, "%s/%d", text, prefix);
+}
+
+static void netlink_handle_addr(const struct nlmsghdr *nh) {
+    const struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+    int len = (int)nh->nlmsg_len - (int)NLMSG_LENGTH(sizeof(*ifa));
+    if (len < 0 || (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)) return;
+    const void *local = NULL, *address = NULL;
+    for (const struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFA_LOCAL) local = RTA_DATA(rta);
+        else if (rta->rta_type == IFA_ADDRESS) address = RTA_DATA(rta);
+    }
+    /* On point-to-point links IFA_ADDRESS is the peer and IFA_LOCAL our own address */
+    const void *bytes = local ? local : address;
+    netlink_iface_t *iface = netlink_iface_find((int)ifa->ifa_index);
+    if (!bytes || !iface) return;
+    size_t addr_len = (ifa->ifa_family == AF_INET) ? 4 : 16;
+    
+    netlink_addr_t *entry = NULL;
+    for (int i = 0; i < iface->num_addrs && !entry; i++) {
+        netlink_addr_t *a = &iface->addrs[i];
+        if (a->family == ifa->ifa_family && a->prefix == ifa->ifa_prefixlen && memcmp(a->bytes, bytes, addr_len) == 0) entry = a;
+    }
+    char text[INET6_ADDRSTRLEN + 8], msg[256];
+    netlink_format_addr(text, sizeof(text), ifa->ifa_family, bytes, ifa->ifa_prefixlen);
+    if (nh->nlmsg_type == RTM_DELADDR) {
+        if (!entry) return;
+        snprintf(msg, sizeof(msg), "Address %s removed from %s", text, iface->name);
+        netlink_log(LOG_INFO, msg, iface->index);
+        *entry = iface->addrs[--iface->num_addrs];
+        return;
+    }
+    if (!entry) {
+        snprintf(msg, sizeof(msg), "Address %s added on %s", text, iface->name);
+        netlink_log(LOG_INFO, msg, iface->index);
+        if (iface->num_addrs == MAX_INTERFACE_ADDRS) return;
+        entry = &iface->addrs[iface->num_addrs++];
+        memset(entry, 0, sizeof(*entry));
+        entry->family = ifa->ifa_family;
+        entry->prefix = ifa->ifa_prefixlen;
+        memcpy(entry->bytes, bytes, addr_len);
+    }
+    entry->seen = 1;
+}
+
+static void netlink_handle_route(const struct nlmsghdr *nh) {
+    const struct rtmsg *rtm = NLMSG_DATA(nh);
+    int len = (int)nh->nlmsg_len - (int)NLMSG_LENGTH(sizeof(*rtm));
+    if (len < 0 || rtm->rtm_table != RT_TABLE_MAIN || rtm->rtm_type != RTN_UNICAST || (rtm->rtm_flags & RTM_F_CLONED)) return;
+    if (rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6) return;
+    const void *dst = NULL, *gateway = NULL;
+    int oif = 0;
+    for (const struct rtattr *rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == RTA_DST) dst = RTA_DATA(rta);
+        else if (rta->rta_type == RTA_GATEWAY) gateway = RTA_DATA(rta);
+        else if (rta->rta_type == RTA_OIF && RTA_PAYLOAD(rta) >= sizeof(oif)) memcpy(&oif, RTA_DATA(rta), sizeof(oif));
+    }
+    char route[INET6_ADDRSTRLEN + 8] = "default", via[INET6_ADDRSTRLEN + 8] = "", msg[256];
+    if (dst) netlink_format_addr(route, sizeof(route), rtm->rtm_family, dst, rtm->rtm_dst_len);
+    if (gateway) {
+        char text[INET6_ADDRSTRLEN] = "?";
+        inet_ntop(rtm->rtm_family, gateway, text, sizeof(text));
+        snprintf(via, sizeof(via), " via %s", text);
+    }
+    const netlink_iface_t *iface = netlink_iface_find(oif);
+    snprintf(msg, sizeof(msg), "Route %s%s dev %s %s", route, via, iface ? iface->name : "?",
+             nh->nlmsg_type == RTM_NEWROUTE ? "added" : "removed");
+    netlink_log(LOG_INFO, msg, oif);
+}
+
+static int netlink_request_dump(int type) {
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(type == RTM_GETLINK ? sizeof(struct ifinfomsg) : sizeof(struct ifaddrmsg));
+    req.nh.nlmsg_type = (unsigned short)type;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nh.nlmsg_seq = ++netlink_seq;
+    req.ifi.ifi_family = AF_UNSPEC;
+    struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    if (sendto(netlink_fd, &req, req.nh.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        netlink_dump = netlink_quiet = 0;
+        return -1;
+    }
+    netlink_dump = type;
+    return 0;
+}
+
+/* Notifications lost while a dump runs are caught by another dump once this one is done */
+static void netlink_resync(void) {
+    if (netlink_dump) {
+        netlink_resync_pending = 1;
+        return;
+    }
+    netlink_resync_pending = 0;
+    for (int i = 0; i < num_netlink_ifaces; i++) {
+        netlink_ifaces[i].seen = 0;
+        for (int j = 0; j < netlink_ifaces[i].num_addrs; j++) netlink_ifaces[i].addrs[j].seen = 0;
+    }
+    netlink_request_dump(RTM_GETLINK);
+}
+
+/* The link dump is followed by the address dump; entries neither dump mentioned are gone */
+static void netlink_dump_done(void) {
+    if (netlink_dump == RTM_GETLINK) {
+        for (int i = num_netlink_ifaces - 1; i >= 0; i--) {
+            if (!netlink_ifaces[i].seen) netlink_remove_iface(&netlink_ifaces[i]);
+        }
+        netlink_request_dump(RTM_GETADDR);
+        return;
+    }
+    char msg[256];
+    for (int i = 0; i < num_netlink_ifaces; i++) {
+        netlink_iface_t *iface = &netlink_ifaces[i];
+        for (int j = iface->num_addrs - 1; j >= 0; j--) {
+            if (iface->addrs[j].seen) continue;
+            char text[INET6_ADDRSTRLEN + 8];
+            netlink_format_addr(text, sizeof(text), iface->addrs[j].family, iface->addrs[j].bytes, iface->addrs[j].prefix);
+            snprintf(msg, sizeof(msg), "Address %s removed from %s", text, iface->name);
+            netlink_log(LOG_INFO, msg, iface->index);
+            iface->addrs[j] = iface->addrs[--iface->num_addrs];
+        }
+    }
+    netlink_dump = 0;
+    if (netlink_resync_pending) netlink_resync();
+    if (netlink_quiet) {
+        netlink_quiet = 0;
+        size_t used = (size_t)snprintf(msg, sizeof(msg), "Interfaces:");
+        for (int i = 0; i < num_netlink_ifaces && used < sizeof(msg); i++) {
+            used += (size_t)snprintf(msg + used, sizeof(msg) - used, "%s %s (%s)", i ? "," : "",
+                                     netlink_ifaces[i].name, netlink_link_state(netlink_ifaces[i].flags));
+        }
+        netlink_log(LOG_INFO, msg, 0);
+    }
+}
+
+static void netlink_handle_message(const struct nlmsghdr *nh) {
+    switch (nh->nlmsg_type) {
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        netlink_handle_link(nh);
+        break;
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        netlink_handle_addr(nh);
+        break;
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE:
+        netlink_handle_route(nh);
+        break;
+    case NLMSG_DONE:
+        if (netlink_dump && nh->nlmsg_seq == netlink_seq) netlink_dump_done();
+        return;
+    case NLMSG_ERROR:
+        if (netlink_dump && nh->nlmsg_seq == netlink_seq) netlink_dump = netlink_quiet = 0;
+        return;
+    default:
+        return;
+    }
+    if (!nh->nlmsg_seq) netlink_events++;
+}
+
+static void netlink_handler(int fd, short revents __attribute__((unused)), void *arg __attribute__((unused))) {
+    for (int i = 0; i < NETLINK_BATCH; i++) {
+        struct sockaddr_nl sender;
+        socklen_t sender_len = sizeof(sender);
+        ssize_t n = recvfrom(fd, netlink_buffer, sizeof(netlink_buffer), MSG_DONTWAIT, (struct sockaddr *)&sender, &sender_len);
+        if (n < 0 && errno == ENOBUFS) {
+            netlink_overruns++;
+            if (!netlink_dump && log_enabled(COLLECTOR_NETLINK, LOG_WARNING)) {
+                log_record("netlink", "Netlink notifications were lost, resynchronizing the interface table", LOG_WARNING, NULL);
+            }
+            netlink_resync();
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (sender.nl_pid != 0) continue;
+        
+        sink_defer_wakeups(1);
+        int len = (int)n;
+        for (const struct nlmsghdr *nh = (const struct nlmsghdr *)netlink_buffer; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+            netlink_handle_message(nh);
+        }
+        sink_defer_wakeups(0);
+    }
+    netlink_update_metrics();
+}
+
+/* The table is filled from a first dump without logging each entry; a summary is logged instead */
+int init_netlink(void) {
+    if (!netlink_enabled) return 0;
+    netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (netlink_fd < 0) return -1;
+    int rcvbuf = NETLINK_RCVBUF;
+    setsockopt(netlink_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_nl addr = {.nl_family = AF_NETLINK,
+                               .nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+                                            RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE};
+    if (bind(netlink_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        poll_register(netlink_fd, POLLIN, netlink_handler, NULL) != 0) {
+        close(netlink_fd);
+        netlink_fd = -1;
+        return -1;
+    }
+    netlink_quiet = 1;
+    netlink_resync();
+    return 0;
+}
+
+static volatile sig_atomic_t receive_paused = 0;
+
+static void receive_toggle_pause(int sig __attribute__((unused))) {
+    receive_paused = !receive_paused;
+}
+
+/*
+ * Stand-in aggregator: prints received records to stdout and acknowledges them. SIGUSR1 toggles
+ * a pause in which nothing is read or acknowledged, so the sender's window and spool fill up.
+ */
+int run_receive(int argc, char *argv[]) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (argc < 3 || parse_socket_address(argv[2], &addr, &addr_len) != 0) {
+        fprintf(stderr, "Usage: %s receive <host:port|unix:/path>\n", argv[0]);
+        return 2;
+    }
+    int listen_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (listen_fd >= 0) setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (addr.ss_family == AF_UNIX) unlink(argv[2] + 5);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, addr_len) != 0 || listen(listen_fd, 4) != 0) {
+        fprintf(stderr, "Error listening on %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = receive_toggle_pause;
+    sigaction(SIGUSR1, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Receiving on %s, pid %d (SIGUSR1 pauses and resumes)\n", argv[2], (int)getpid());
+    
+    char *buf = malloc(RECEIVE_BUFFER_SIZE);
+    uint64_t last_seq = 0;
+    while (buf) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        size_t have = 0;
+        while (1) {
+            if (receive_paused) {
+                usleep(100000);
+                continue;
+            }
+            ssize_t n = recv(fd, buf + have, RECEIVE_BUFFER_SIZE - have, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            have += (size_t)n;
+            
+            size_t offset = 0;
+            int framed = 0;
+            while (have - offset >= FORWARD_FRAME_HEADER) {
+                uint32_t len;
+                uint64_t seq;
+                memcpy(&len, buf + offset, sizeof(len));
+                memcpy(&seq, buf + offset + 4, sizeof(seq));
+                size_t frame = FORWARD_FRAME_HEADER + be32toh(len);
+                if (have - offset < frame) break;
+                if (be64toh(seq) > last_seq) {
+                    fwrite(buf + offset + FORWARD_FRAME_HEADER, 1, be32toh(len), stdout);
+                    last_seq = be64toh(seq);
+                }
+                offset += frame;
+                framed = 1;
+            }
+            memmove(buf, buf + offset, have - offset);
+            have -= offset;
+            if (have == RECEIVE_BUFFER_SIZE) break;
+            if (framed) {
+                fflush(stdout);
+                uint64_t ack = htobe64(last_seq);
+                if (send(fd, &ack, sizeof(ack), MSG_NOSIGNAL) != (ssize_t)sizeof(ack)) break;
+            }
+        }
+        close(fd);
+    }
+    free(buf);
+    return 1;
+}
+
+/* Series key used for directory names and the query CLI, e.g. directory_events_total_var_log */
+static void tsdb_series_key(int id, char *buf, size_t size) {
+    const char *name = metrics[id].name;
+    if (strncmp(name, "system_logger_", 14) == 0) name += 14;
+    size_t len = (size_t)snprintf(buf, size, "%s", name);
+    
+    const char *labels = metrics[id].labels;
+    const char *value = labels ? strchr(labels, '=') : NULL;
+    if (!value) return;
+    for (value++; *value && len + 1 < size; value++) {
+        char c = *value;
+        if (c == '"') continue;
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) c = '_';
+        if (c == '_' && len > 0 && buf[len - 1] == '_') continue;
+        buf[len++] = c;
+    }
+    buf[len] = '\0';
+}
+
+static int tsdb_find_series(const char *key) {
+    char candidate[128];
+    for (int i = 0; i < NUM_METRICS; i++) {
+        tsdb_series_key(i, candidate, sizeof(candidate));
+        if (strcmp(candidate, key) == 0) return i;
+    }
+    return -1;
+}
+
+static void tsdb_day_path(int id, int64_t day, char *buf, size_t size) {
+    char key[128];
+    tsdb_series_key(id, key, sizeof(key));
+    snprintf(buf, size, "%s/%s/%lld.gor", TSDB_DIR, key, (long long)day);
+}
+
+static void bits_write(uint8_t *data, uint32_t *pos, uint64_t value, int nbits) {
+    for (int i = nbits - 1; i >= 0; i--) {
+        uint8_t mask = (uint8_t)(0x80 >> (*pos & 7));
+        if ((value >> i) & 1) data[*pos >> 3] |= mask;
+        else data[*pos >> 3] &= (uint8_t)~mask;
+        (*pos)++;
+    }
+}
+
+static uint64_t bits_read(tsdb_decoder_t *d, int nbits) {
+    uint64_t value = 0;
+    for (int i = 0; i < nbits; i++) {
+        int bit = 0;
+        if (d->pos < d->limit) bit = (d->data[d->pos >> 3] >> (7 - (d->pos & 7))) & 1;
+        value = (value << 1) | (uint64_t)bit;
+        d->pos++;
+    }
+    return value;
+}
+
+static int64_t sign_extend(uint64_t value, int nbits) {
+    uint64_t sign = 1ULL << (nbits - 1);
+    return (int64_t)((value ^ sign) - sign);
+}
+
+static void tsdb_decoder_init(tsdb_decoder_t *d, const tsdb_chunk_header_t *chunk) {
+    uint64_t commit = __atomic_load_n(&chunk->commit, __ATOMIC_ACQUIRE);
+    memset(d, 0, sizeof(*d));
+    d->data = (const uint8_t *)(chunk + 1);
+    d->limit = (uint32_t)commit;
+    if (d->limit > TSDB_CHUNK_BITS) d->limit = TSDB_CHUNK_BITS;
+    d->remaining = (uint32_t)(commit >> 32);
+    d->ts = chunk->start_ts;
+}
+
+static int tsdb_decode_next(tsdb_decoder_t *d, int64_t *ts, double *value) {
+    if (d->remaining == 0) return 0;
+    d->remaining--;
+    
+    if (!d->started) {
+        d->started = 1;
+        d->value = bits_read(d, 64);
+    } else {
+        int64_t dod;
+        if (bits_read(d, 1) == 0) dod = 0;
+        else if (bits_read(d, 1) == 0) dod = sign_extend(bits_read(d, 7), 7);
+        else if (bits_read(d, 1) == 0) dod = sign_extend(bits_read(d, 9), 9);
+        else if (bits_read(d, 1) == 0) dod = sign_extend(bits_read(d, 12), 12);
+        else dod = sign_extend(bits_read(d, 32), 32);
+        d->delta += dod;
+        d->ts += d->delta;
+        
+        if (bits_read(d, 1) == 1) {
+            if (bits_read(d, 1) == 1) {
+                d->leading = (int)bits_read(d, 5);
+                int length = (int)bits_read(d, 6);
+                if (length == 0) length = 64;
+                d->trailing = 64 - d->leading - length;
+            }
+            int length = 64 - d->leading - d->trailing;
+            d->value ^= bits_read(d, length) << d->trailing;
+        }
+    }
+    if (d->pos > d->limit) return 0;
+    
+    *ts = d->ts;
+    memcpy(value, &d->value, sizeof(*value));
+    return 1;
+}
+
+static void tsdb_close_series(tsdb_series_t *series) {
+    if (series->chunk) munmap(series->chunk, TSDB_CHUNK_SIZE);
+    if (series->fd >= 0) close(series->fd);
+    series->chunk = NULL;
+    series->fd = -1;
+}
+
+static int tsdb_new_chunk(tsdb_series_t *series) {
+    if (series->chunk) {
+        msync(series->chunk, TSDB_CHUNK_SIZE, MS_ASYNC);
+        munmap(series->chunk, TSDB_CHUNK_SIZE);
+        series->chunk = NULL;
+    }
+    if (posix_fallocate(series->fd, series->file_size, TSDB_CHUNK_SIZE) != 0) return -1;
+    void *map = mmap(NULL, TSDB_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, series->fd, series->file_size);
+    if (map == MAP_FAILED) return -1;
+    series->file_size += TSDB_CHUNK_SIZE;
+    series->chunk = map;
+    series->chunk->magic = TSDB_CHUNK_MAGIC;
+    series->count = 0;
+    series->bits = 0;
+    return 0;
+}
+
+/* Maps the last chunk of the day file and replays it to restore the encoder state */
+static int tsdb_open_day(int id, int64_t day) {
+    tsdb_series_t *series = &tsdb_series[id];
+    tsdb_close_series(series);
+    
+    char path[MAX_PATH_LEN];
+    char key[128];
+    tsdb_series_key(id, key, sizeof(key));
+    snprintf(path, sizeof(path), "%s/%s", TSDB_DIR, key);
+    if (mkdir(TSDB_DIR, 0755) != 0 && errno != EEXIST) return -1;
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) return -1;
+    
+    tsdb_day_path(id, day, path, sizeof(path));
+    series->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (series->fd < 0) return -1;
+    series->day = day;
+    
+    struct stat st;
+    if (fstat(series->fd, &st) != 0) {
+        tsdb_close_series(series);
+        return -1;
+    }
+    series->file_size = st.st_size - st.st_size % TSDB_CHUNK_SIZE;
+    if (series->file_size == 0) return tsdb_new_chunk(series);
+    
+    /* The last chunk may be sparse if an older version extended the file with ftruncate */
+    if (posix_fallocate(series->fd, series->file_size - TSDB_CHUNK_SIZE, TSDB_CHUNK_SIZE) != 0) {
+        tsdb_close_series(series);
+        return -1;
+    }
+    void *map = mmap(NULL, TSDB_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, series->fd,
+                     series->file_size - TSDB_CHUNK_SIZE);
+    if (map == MAP_FAILED) {
+        tsdb_close_series(series);
+        return -1;
+    }
+    series->chunk = map;
+    series->chunk->magic = TSDB_CHUNK_MAGIC;
+    
+    tsdb_decoder_t decoder;
+    int64_t ts;
+    double value;
+    tsdb_decoder_init(&decoder, series->chunk);
+    series->count = 0;
+    series->bits = 0;
+    while (tsdb_decode_next(&decoder, &ts, &value)) {
+        series->count++;
+        series->bits = decoder.pos;
+        series->prev_ts = decoder.ts;
+        series->prev_delta = decoder.delta;
+        series->prev_value = decoder.value;
+        series->prev_leading = decoder.leading;
+        series->prev_trailing = decoder.trailing;
+    }
+    if (series->bits + TSDB_MAX_SAMPLE_BITS > TSDB_CHUNK_BITS) return tsdb_new_chunk(series);
+    return 0;
+}
+
+static void tsdb_encode_value(uint8_t *data, uint32_t *pos, tsdb_series_t *series, uint64_t value) {
+    uint64_t xor = value ^ series->prev_value;
+    if (xor == 0) {
+        bits_write(data, pos, 0, 1);
+        return;
+    }
+    int leading = __builtin_clzll(xor);
+    int trailing = __builtin_ctzll(xor);
+    if (leading > 31) leading = 31;
+    
+    if (series->count > 1 && leading >= series->prev_leading && trailing >= series->prev_trailing) {
+        bits_write(data, pos, 2, 2);
+        bits_write(data, pos, xor >> series->prev_trailing, 64 - series->prev_leading - series->prev_trailing);
+        return;
+    }
+    int length = 64 - leading - trailing;
+    bits_write(data, pos, 3, 2);
+    bits_write(data, pos, (uint64_t)leading, 5);
+    bits_write(data, pos, (uint64_t)(length == 64 ? 0 : length), 6);
+    bits_write(data, pos, xor >> trailing, length);
+    series->prev_leading = leading;
+    series->prev_trailing = trailing;
+}
+
+int tsdb_append(int id, int64_t ts, double value) {
+    tsdb_series_t *series = &tsdb_series[id];
+    int64_t day = ts / SECONDS_PER_DAY;
+    if (!series->chunk || series->day != day) {
+        if (tsdb_open_day(id, day) != 0) return -1;
+    }
+    if (series->count > 0 && ts <= series->prev_ts) return 0;
+    if (series->bits + TSDB_MAX_SAMPLE_BITS > TSDB_CHUNK_BITS && tsdb_new_chunk(series) != 0) return -1;
+    
+    tsdb_chunk_header_t *chunk = series->chunk;
+    uint8_t *data = (uint8_t *)(chunk + 1);
+    uint32_t pos = series->bits;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    
+    if (series->count == 0) {
+        chunk->start_ts = ts;
+        bits_write(data, &pos, bits, 64);
+        series->prev_delta = 0;
+        series->prev_leading = 0;
+        series->prev_trailing = 0;
+    } else {
+        int64_t delta = ts - series->prev_ts;
+        int64_t dod = delta - series->prev_delta;
+        if (dod == 0) {
+            bits_write(data, &pos, 0, 1);
+        } else if (dod >= -64 && dod <= 63) {
+            bits_write(data, &pos, 2, 2);
+            bits_write(data, &pos, (uint64_t)dod, 7);
+        } else if (dod >= -256 && dod <= 255) {
+            bits_write(data, &pos, 6, 3);
+            bits_write(data, &pos, (uint64_t)dod, 9);
+        } else if (dod >= -2048 && dod <= 2047) {
+            bits_write(data, &pos, 14, 4);
+            bits_write(data, &pos, (uint64_t)dod, 12);
+        } else {
+            bits_write(data, &pos, 15, 4);
+            bits_write(data, &pos, (uint64_t)dod, 32);
+        }
+        series->prev_delta = delta;
+        tsdb_encode_value(data, &pos, series, bits);
+    }
+    
+    series->count++;
+    series->bits = pos;
+    series->prev_ts = ts;
+    series->prev_value = bits;
+    chunk->end_ts = ts;
+    __atomic_store_n(&chunk->commit, ((uint64_t)series->count << 32) | pos, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Calls cb for every stored sample of the series with from <= ts <= to, in time order */
+int tsdb_query(int id, int64_t from, int64_t to, tsdb_sample_cb cb, void *arg) {
+    int found = 0;
+    for (int64_t day = from / SECONDS_PER_DAY; day <= to / SECONDS_PER_DAY; day++) {
+        char path[MAX_PATH_LEN];
+        tsdb_day_path(id, day, path, sizeof(path));
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < TSDB_CHUNK_SIZE) {
+            close(fd);
+            continue;
+        }
+        size_t size = (size_t)(st.st_size - st.st_size % TSDB_CHUNK_SIZE);
+        const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) continue;
+        
+        for (size_t offset = 0; offset < size; offset += TSDB_CHUNK_SIZE) {
+            const tsdb_chunk_header_t *chunk = (const tsdb_chunk_header_t *)(map + offset);
+            if (chunk->magic != TSDB_CHUNK_MAGIC || chunk->start_ts > to) continue;
+            
+            tsdb_decoder_t decoder;
+            int64_t ts;
+            double value;
+            tsdb_decoder_init(&decoder, chunk);
+            if (decoder.remaining == 0 || chunk->end_ts < from) continue;
+            while (tsdb_decode_next(&decoder, &ts, &value)) {
+                if (ts > to) break;
+                if (ts < from) continue;
+                cb(ts, value, arg);
+                found++;
+            }
+        }
+        munmap((void *)map, size);
+    }
+    return found;
+}
+
+static int rollup_path(int id, int level, char *buf, size_t size) {
+    char key[128];
+    tsdb_series_key(id, key, sizeof(key));
+    return snprintf(buf, size, "%s/%s/rollup_%lld.dat", TSDB_DIR, key,
+                    (long long)rollup_levels[level].resolution) < (int)size ? 0 : -1;
+}
+
+static rollup_slot_t *rollup_slots(const rollup_header_t *header) {
+    return (rollup_slot_t *)(header + 1);
+}
+
+static rollup_header_t *rollup_map(const char *path, int writable, size_t *size) {
+    int fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    rollup_header_t *header = NULL;
+    /* A writable map must be backed: an older file made sparse by ftruncate is allocated first */
+    int error = 0;
+    if (fstat(fd, &st) == 0 && writable && st.st_size > 0) error = posix_fallocate(fd, 0, st.st_size);
+    if (error) {
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(rollup_header_t)) {
+        void *map = mmap(NULL, (size_t)st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            header = map;
+            *size = (size_t)st.st_size;
+            if (header->magic != ROLLUP_MAGIC ||
+                sizeof(rollup_header_t) + header->capacity * sizeof(rollup_slot_t) > *size) {
+                munmap(map, *size);
+                header = NULL;
+            }
+        }
+    }
+    close(fd);
+    return header;
+}
+
+/* Creates the ring file, carrying over buckets from an existing file whose retention differs */
+static int rollup_open(int id, int level) {
+    rollup_file_t *file = &rollup_files[id][level];
+    const rollup_level_t *rollup = &rollup_levels[level];
+    uint64_t capacity = (uint64_t)(rollup->retention / rollup->resolution);
+    char path[MAX_PATH_LEN], tmp_path[MAX_PATH_LEN + 8];
+    if (rollup_path(id, level, path, sizeof(path)) != 0) return -1;
+    
+    errno = 0;
+    file->header = rollup_map(path, 1, &file->size);
+    if (file->header && file->header->capacity == capacity) return 0;
+    /* Only a missing or invalid file is recreated; one that cannot be mapped now keeps its buckets */
+    if (!file->header && errno != 0 && errno != ENOENT) return -1;
+    
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    size_t size = sizeof(rollup_header_t) + capacity * sizeof(rollup_slot_t);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    if (posix_fallocate(fd, 0, (off_t)size) != 0) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    rollup_header_t *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        unlink(tmp_path);
+        return -1;
+    }
+    header->magic = ROLLUP_MAGIC;
+    header->resolution = (uint32_t)rollup->resolution;
+    header->capacity = capacity;
+    
+    if (file->header) {
+        rollup_slot_t *old_slots = rollup_slots(file->header);
+        for (uint64_t i = 0; i < file->header->capacity; i++) {
+            if (old_slots[i].count == 0) continue;
+            rollup_slot_t *slot = &rollup_slots(header)[(uint64_t)(old_slots[i].start / rollup->resolution) % capacity];
+            if (old_slots[i].start > slot->start) *slot = old_slots[i];
+        }
+        munmap(file->header, file->size);
+    }
+    if (rename(tmp_path, path) != 0) {
+        munmap(header, size);
+        unlink(tmp_path);
+        file->header = NULL;
+        return -1;
+    }
+    file->header = header;
+    file->size = size;
+    return 0;
+}
+
+void rollup_update(int id, int64_t ts, double value) {
+    for (int level = 0; level < NUM_ROLLUPS; level++) {
+        rollup_file_t *file = &rollup_files[id][level];
+        if (!file->header && rollup_open(id, level) != 0) continue;
+        
+        int64_t resolution = rollup_levels[level].resolution;
+        int64_t start = ts - ts % resolution;
+        rollup_slot_t *slot = &rollup_slots(file->header)[(uint64_t)(start / resolution) % file->header->capacity];
+        if (slot->start != start || slot->count == 0) {
+            slot->count = 0;
+            slot->min = value;
+            slot->max = value;
+            slot->sum = 0;
+            slot->start = start;
+        }
+        if (value < slot->min) slot->min = value;
+        if (value > slot->max) slot->max = value;
+        slot->sum += value;
+        slot->count++;
+    }
+}
+
+/* Drops whole raw day files older than TSDB_RETENTION_RAW; rollup rings expire by themselves */
+void tsdb_enforce_retention(int64_t now) {
+    static int64_t last_day = -1;
+    int64_t today = now / SECONDS_PER_DAY;
+    if (today == last_day) return;
+    last_day = today;
+    
+    int64_t oldest_day = (now - tsdb_raw_retention) / SECONDS_PER_DAY;
+    for (int i = 0; i < NUM_METRICS; i++) {
+        char path[MAX_PATH_LEN], key[128];
+        tsdb_series_key(i, key, sizeof(key));
+        snprintf(path, sizeof(path), "%s/%s", TSDB_DIR, key);
+        DIR *dir = opendir(path);
+        if (!dir) continue;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            char *end;
+            long long day = strtoll(entry->d_name, &end, 10);
+            if (end == entry->d_name || strcmp(end, ".gor") != 0 || day >= oldest_day) continue;
+            char file_path[MAX_PATH_LEN + 300];
+            snprintf(file_path, sizeof(file_path), "%s/%s", path, entry->d_name);
+            unlink(file_path);
+        }
+        closedir(dir);
+    }
+}
+
+/*
+ * Picks the coarsest rollup whose resolution does not exceed step and whose retention still
+ * reaches back to from. Returns the resolution used, or 0 when the range must come from raw data.
+ */
+int64_t rollup_query(int id, int64_t from, int64_t to, int64_t step, rollup_cb cb, void *arg) {
+    int64_t now = time(NULL);
+    for (int level = NUM_ROLLUPS - 1; level >= 0; level--) {
+        const rollup_level_t *rollup = &rollup_levels[level];
+        if (rollup->resolution > step || now - rollup->retention > from) continue;
+        
+        char path[MAX_PATH_LEN];
+        size_t size;
+        if (rollup_path(id, level, path, sizeof(path)) != 0) continue;
+        rollup_header_t *header = rollup_map(path, 0, &size);
+        if (!header) continue;
+        
+        const rollup_slot_t *slots = rollup_slots(header);
+        for (int64_t start = from - from % rollup->resolution; start <= to; start += rollup->resolution) {
+            const rollup_slot_t *slot = &slots[(uint64_t)(start / rollup->resolution) % header->capacity];
+            if (slot->start == start && slot->count > 0) cb(slot, arg);
+        }
+        munmap(header, size);
+        return rollup->resolution;
+    }
+    return 0;
+}
+
+void init_tsdb(void) {
+    for (int i = 0; i < NUM_METRICS; i++) tsdb_series[i].fd = -1;
+}
+
+void tsdb_append_all(void) {
+    if (!tsdb_enabled) return;
+    int64_t now = time(NULL);
+    for (int i = 0; i < NUM_METRICS; i++) {
+        tsdb_append(i, now, metrics[i].value);
+        rollup_update(i, now, metrics[i].value);
+    }
+    tsdb_enforce_retention(now);
+}
+
+/*
+ * Online anomaly detection. Each watched series (ANOMALY_METRICS, by TSDB series key; counters
+ * are turned into per-second rates) keeps an exponentially weighted mean and variance in bucket
+ * 0 and, with ANOMALY_SEASONAL=1, one more per hour of day in buckets 1..24. A sample is scored
+ * against its hour bucket once that has seen ANOMALY_WARMUP samples, against bucket 0 before.
+ * Crossing ANOMALY_ZSCORE logs one WARNING; returning below it logs one INFO. The baselines are
+ * saved to ANOMALY_STATE_FILE every ANOMALY_SAVE_INTERVAL seconds and on shutdown.
+ */
+typedef struct {
+    double mean;
+    double var;
+    uint32_t count;
+    uint32_t reserved;
+} anomaly_baseline_t;
+
+typedef struct {
+    char key[128];
+    anomaly_baseline_t buckets[ANOMALY_BUCKETS];
+} anomaly_state_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t buckets;
+    uint32_t count;
+    uint32_t reserved;
+} anomaly_state_header_t;
+
+typedef struct {
+    int watched;
+    int flagged;
+    double last_value;
+    int64_t last_ts;
+    anomaly_state_t state;
+} anomaly_series_t;
+
+static anomaly_series_t anomaly_series[NUM_METRICS];
+static time_t anomaly_saved_at = 0;
+
+static void anomaly_update(anomaly_baseline_t *baseline, double value) {
+    if (baseline->count == 0) {
+        baseline->mean = value;
+        baseline->var = 0;
+    } else {
+        double diff = value - baseline->mean;
+        double increment = anomaly_alpha * diff;
+        baseline->mean += increment;
+        baseline->var = (1 - anomaly_alpha) * (baseline->var + diff * increment);
+    }
+    if (baseline->count < UINT32_MAX) baseline->count++;
+}
+
+void save_anomaly_state(void) {
+    if (anomaly_zscore <= 0) return;
+    char tmp_path[MAX_PATH_LEN];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", ANOMALY_STATE_FILE);
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) return;
+    anomaly_state_header_t header = {ANOMALY_STATE_MAGIC, ANOMALY_BUCKETS, 0, 0};
+    for (int i = 0; i < NUM_METRICS; i++) header.count += (uint32_t)anomaly_series[i].watched;
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; i < NUM_METRICS && ok; i++) {
+        if (anomaly_series[i].watched) ok = fwrite(&anomaly_series[i].state, sizeof(anomaly_state_t), 1, file) == 1;
+    }
+    if (fclose(file) != 0 || !ok || rename(tmp_path, ANOMALY_STATE_FILE) != 0) unlink(tmp_path);
+    anomaly_saved_at = time(NULL);
+}
+
+void init_anomaly_detection(void) {
+    if (anomaly_zscore <= 0) return;
+    char list[MAX_CONFIG_LINE];
+    snprintf(list, sizeof(list), "%s", anomaly_metrics);
+    char *save = NULL;
+    for (char *key = strtok_r(list, ", ", &save); key; key = strtok_r(NULL, ", ", &save)) {
+        int id = tsdb_find_series(key);
+        if (id < 0) continue;
+        anomaly_series[id].watched = 1;
+        tsdb_series_key(id, anomaly_series[id].state.key, sizeof(anomaly_series[id].state.key));
+    }
+    
+    FILE *file = fopen(ANOMALY_STATE_FILE, "r");
+    if (!file) return;
+    anomaly_state_header_t header;
+    anomaly_state_t state;
+    if (fread(&header, sizeof(header), 1, file) == 1 && header.magic == ANOMALY_STATE_MAGIC &&
+        header.buckets == ANOMALY_BUCKETS) {
+        for (uint32_t i = 0; i < header.count && fread(&state, sizeof(state), 1, file) == 1; i++) {
+            state.key[sizeof(state.key) - 1] = '\0';
+            int id = tsdb_find_series(state.key);
+            if (id >= 0 && anomaly_series[id].watched) anomaly_series[id].state = state;
+        }
+    }
+    fclose(file);
+    anomaly_saved_at = time(NULL);
+}
+
+static void anomaly_check(const char *username, int id, int64_t now, int hour) {
+    anomaly_series_t *series = &anomaly_series[id];
+    double value = metrics[id].value;
+    if (strcmp(metrics[id].type, "counter") == 0) {
+        double raw = value;
+        int64_t elapsed = now - series->last_ts;
+        int valid = series->last_ts > 0 && elapsed > 0 && raw >= series->last_value;
+        value = valid ? (raw - series->last_value) / (double)elapsed : 0;
+        series->last_value = raw;
+        series->last_ts = now;
+        if (!valid) return;
+    }
+    
+    anomaly_baseline_t *overall = &series->state.buckets[0];
+    anomaly_baseline_t *seasonal = anomaly_seasonal ? &series->state.buckets[1 + hour] : NULL;
+    anomaly_baseline_t *baseline = (seasonal && seasonal->count >= (uint32_t)anomaly_warmup) ? seasonal : overall;
+    if (baseline->count >= (uint32_t)anomaly_warmup) {
+        double stddev = sqrt(baseline->var);
+        double min_stddev = fmax(anomaly_min_stddev, 0.01 * fabs(baseline->mean));
+        double zscore = (value - baseline->mean) / fmax(stddev, min_stddev);
+        int flagged = fabs(zscore) >= anomaly_zscore;
+        if (flagged != series->flagged && log_enabled(COLLECTOR_ANOMALY, flagged ? LOG_WARNING : LOG_INFO)) {
+            char msg[512];
+            snprintf(msg, sizeof(msg), flagged ? "Anomaly in %s: %.6g, baseline %.6g +/- %.3g (z-score %.1f)"
+                                                : "%s back to baseline: %.6g, baseline %.6g +/- %.3g (z-score %.1f)",
+                     series->state.key, value, baseline->mean, stddev, zscore);
+            record_metric_t values[] = {{"value", value}, {"mean", baseline->mean}, {"stddev", stddev}, {"zscore", zscore}};
+            record_fields_t fields = {"anomaly_detection", values, 4, NULL, NULL, NULL};
+            log_record(username, msg, flagged ? LOG_WARNING : LOG_INFO, &fields);
+        }
+        series->flagged = flagged;
+    }
+    anomaly_update(overall, value);
+    if (seasonal) anomaly_update(seasonal, value);
+}
+
+void check_anomalies(const char *username) {
+    if (anomaly_zscore <= 0) return;
+    time_t now = time(NULL);
+    int hour = localtime(&now)->tm_hour;
+    for (int i = 0; i < NUM_METRICS; i++) {
+        if (anomaly_series[i].watched) anomaly_check(username, i, now, hour);
+    }
+    if (now - anomaly_saved_at >= ANOMALY_SAVE_INTERVAL) save_anomaly_state();
+}
+
+/*
+ * Alert rules: RULE=<name>: <expression> [for <duration>]. Expressions combine series (TSDB keys),
+ * numbers, + - * /, comparisons, and/or, and window functions avg/min/max/increase/rate over
+ * series[<duration>], e.g. "RULE=etc_churn: increase(directory_events_total_etc[1m]) > 100".
+ * Each rule compiles to stack bytecode. A rule is evaluated only in intervals where one of its
+ * series changed, or while it has windows or a pending "for"; windows are rings of samples shared
+ * by every rule that uses the same series and duration. Firing logs an ERROR, resolving a WARNING,
+ * so both take the priority lane.
+ */
+enum {
+    RULE_OP_CONST,
+    RULE_OP_SERIES,
+    RULE_OP_AVG,
+    RULE_OP_MIN,
+    RULE_OP_MAX,
+    RULE_OP_INCREASE,
+    RULE_OP_RATE,
+    RULE_OP_NEG,
+    RULE_OP_ADD,
+    RULE_OP_SUB,
+    RULE_OP_MUL,
+    RULE_OP_DIV,
+    RULE_OP_GT,
+    RULE_OP_LT,
+    RULE_OP_GE,
+    RULE_OP_LE,
+    RULE_OP_EQ,
+    RULE_OP_NE,
+    RULE_OP_AND,
+    RULE_OP_OR
+};
+
+typedef struct {
+    uint8_t op;
+    uint32_t arg;
+} rule_insn_t;
+
+typedef struct {
+    int series;
+    int64_t seconds;
+    int64_t *ts;
+    double *values;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+    double sum;
+    int extremes_valid;
+    double min;
+    double max;
+} rule_window_t;
+
+typedef struct {
+    char name[64];
+    rule_insn_t code[RULE_MAX_CODE];
+    double consts[RULE_MAX_CODE];
+    int code_len;
+    int num_consts;
+    int64_t for_seconds;
+    int has_window;
+    int dirty;
+    int64_t pending_since;
+    int firing;
+} rule_t;
+
+typedef struct {
+    const char *text;
+    const char *pos;
+    rule_t *rule;
+    const char *error;
+} rule_parser_t;
+
+static rule_t *rules = NULL;
+static int num_rules = 0;
+static rule_window_t *rule_windows = NULL;
+static int num_rule_windows = 0;
+static int *series_rules[NUM_METRICS];
+static int num_series_rules[NUM_METRICS];
+static double rule_last_values[NUM_METRICS];
+static int rules_primed = 0;
+
+static void rule_skip_space(rule_parser_t *p) {
+    while (*p->pos == ' ' || *p->pos == '\t') p->pos++;
+}
+
+static int rule_accept(rule_parser_t *p, const char *token) {
+    rule_skip_space(p);
+    size_t len = strlen(token);
+    if (strncmp(p->pos, token, len) != 0) return 0;
+    if (isalpha((unsigned char)token[0]) && (isalnum((unsigned char)p->pos[len]) || p->pos[len] == '_')) return 0;
+    p->pos += len;
+    return 1;
+}
+
+static size_t rule_identifier(rule_parser_t *p, char *buf, size_t size) {
+    rule_skip_space(p);
+    size_t len = 0;
+    while ((isalnum((unsigned char)p->pos[len]) || p->pos[len] == '_') && len + 1 < size) len++;
+    memcpy(buf, p->pos, len);
+    buf[len] = '\0';
+    p->pos += len;
+    return len;
+}
+
+static void rule_emit(rule_parser_t *p, uint8_t op, uint32_t arg) {
+    if (p->rule->code_len >= RULE_MAX_CODE) {
+        if (!p->error) p->error = "expression too long";
+        return;
+    }
+    p->rule->code[p->rule->code_len++] = (rule_insn_t){op, arg};
+}
+
+static void rule_depend(int series, int rule_id) {
+    for (int i = 0; i < num_series_rules[series]; i++) {
+        if (series_rules[series][i] == rule_id) return;
+    }
+    int *list = realloc(series_rules[series], (size_t)(num_series_rules[series] + 1) * sizeof(int));
+    if (!list) return;
+    series_rules[series] = list;
+    list[num_series_rules[series]++] = rule_id;
+}
+
+/* Windows with the same series and duration are shared between rules */
+static int rule_window(int series, int64_t seconds) {
+    for (int i = 0; i < num_rule_windows; i++) {
+        if (rule_windows[i].series == series && rule_windows[i].seconds == seconds) return i;
+    }
+    rule_window_t *windows = realloc(rule_windows, (size_t)(num_rule_windows + 1) * sizeof(rule_window_t));
+    if (!windows) return -1;
+    rule_windows = windows;
+    rule_window_t *window = &rule_windows[num_rule_windows];
+    memset(window, 0, sizeof(*window));
+    window->series = series;
+    window->seconds = seconds;
+    window->capacity = (uint32_t)(seconds / (log_interval > 0 ? log_interval : 1)) + 2;
+    window->ts = calloc(window->capacity, sizeof(int64_t));
+    window->values = calloc(window->capacity, sizeof(double));
+    if (!window->ts || !window->values) {
+        free(window->ts);
+        free(window->values);
+        return -1;
+    }
+    return num_rule_windows++;
+}
+
+static void rule_parse_or(rule_parser_t *p);
+
+static void rule_parse_primary(rule_parser_t *p) {
+    static const struct {
+        const char *name;
+        uint8_t op;
+    } functions[] = {
+        {"avg", RULE_OP_AVG}, {"min", RULE_OP_MIN}, {"max", RULE_OP_MAX},
+        {"increase", RULE_OP_INCREASE}, {"rate", RULE_OP_RATE}
+    };
+    rule_skip_space(p);
+    if (isdigit((unsigned char)*p->pos) || *p->pos == '.') {
+        char *end;
+        double value = strtod(p->pos, &end);
+        p->pos = end;
+        if (p->rule->num_consts >= RULE_MAX_CODE) {
+            if (!p->error) p->error = "too many constants";
+            return;
+        }
+        p->rule->consts[p->rule->num_consts] = value;
+        rule_emit(p, RULE_OP_CONST, (uint32_t)p->rule->num_consts++);
+        return;
+    }
+    if (rule_accept(p, "(")) {
+        rule_parse_or(p);
+        if (!rule_accept(p, ")") && !p->error) p->error = "expected ')'";
+        return;
+    }
+    
+    char name[128];
+    if (rule_identifier(p, name, sizeof(name)) == 0) {
+        if (!p->error) p->error = "expected a number, series or function";
+        return;
+    }
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        if (strcmp(name, functions[i].name) != 0 || !rule_accept(p, "(")) continue;
+        char series_key[128], duration[32];
+        rule_identifier(p, series_key, sizeof(series_key));
+        int series = tsdb_find_series(series_key);
+        if (series < 0 || !rule_accept(p, "[")) {
+            if (!p->error) p->error = series < 0 ? "unknown series" : "expected '[' after the series";
+            return;
+        }
+        size_t len = rule_identifier(p, duration, sizeof(duration));
+        int64_t seconds = len ? parse_duration(duration) : -1;
+        if (seconds <= 0 || !rule_accept(p, "]") || !rule_accept(p, ")")) {
+            if (!p->error) p->error = "expected <series>[<duration>])";
+            return;
+        }
+        int window = rule_window(series, seconds);
+        if (window < 0) {
+            if (!p->error) p->error = "out of memory";
+            return;
+        }
+        p->rule->has_window = 1;
+        rule_emit(p, functions[i].op, (uint32_t)window);
+        return;
+    }
+    int series = tsdb_find_series(name);
+    if (series < 0) {
+        if (!p->error) p->error = "unknown series";
+        return;
+    }
+    rule_emit(p, RULE_OP_SERIES, (uint32_t)series);
+}
+
+static void rule_parse_unary(rule_parser_t *p) {
+    if (rule_accept(p, "-")) {
+        rule_parse_unary(p);
+        rule_emit(p, RULE_OP_NEG, 0);
+    } else {
+        rule_parse_primary(p);
+    }
+}
+
+static void rule_parse_product(rule_parser_t *p) {
+    rule_parse_unary(p);
+    while (!p->error) {
+        if (rule_accept(p, "*")) {
+            rule_parse_unary(p);
+            rule_emit(p, RULE_OP_MUL, 0);
+        } else if (rule_accept(p, "/")) {
+            rule_parse_unary(p);
+            rule_emit(p, RULE_OP_DIV, 0);
+        } else {
+            break;
+        }
+    }
+}
+
+static void rule_parse_sum(rule_parser_t *p) {
+    rule_parse_product(p);
+    while (!p->error) {
+        if (rule_accept(p, "+")) {
+            rule_parse_product(p);
+            rule_emit(p, RULE_OP_ADD, 0);
+        } else if (rule_accept(p, "-")) {
+            rule_parse_product(p);
+            rule_emit(p, RULE_OP_SUB, 0);
+        } else {
+            break;
+        }
+    }
+}
+
+static void rule_parse_comparison(rule_parser_t *p) {
+    static const struct {
+        const char *token;
+        uint8_t op;
+    } comparisons[] = {
+        {">=", RULE_OP_GE}, {"<=", RULE_OP_LE}, {"==", RULE_OP_EQ}, {"!=", RULE_OP_NE},
+        {">", RULE_OP_GT}, {"<", RULE_OP_LT}
+    };
+    rule_parse_sum(p);
+    for (size_t i = 0; i < sizeof(comparisons) / sizeof(comparisons[0]) && !p->error; i++) {
+        if (!rule_accept(p, comparisons[i].token)) continue;
+        rule_parse_sum(p);
+        rule_emit(p, comparisons[i].op, 0);
+        break;
+    }
+}
+
+static void rule_parse_and(rule_parser_t *p) {
+    rule_parse_comparison(p);
+    while (!p->error && rule_accept(p, "and")) {
+        rule_parse_comparison(p);
+        rule_emit(p, RULE_OP_AND, 0);
+    }
+}
+
+static void rule_parse_or(rule_parser_t *p) {
+    rule_parse_and(p);
+    while (!p->error && rule_accept(p, "or")) {
+        rule_parse_and(p);
+        rule_emit(p, RULE_OP_OR, 0);
+    }
+}
+
+/*
+ * Returns NULL on success or a description of the first error, with *offset set to where it is.
+ * Only a rule that compiled is registered with its series; a failed one leaves no windows behind,
+ * since its id goes to the next rule.
+ */
+static const char *compile_rule(const char *text, int rule_id, size_t *offset) {
+    rule_t *rule = &rules[rule_id];
+    memset(rule, 0, sizeof(*rule));
+    rule_parser_t p = {text, text, rule, NULL};
+    int windows_before = num_rule_windows;
+    const char *colon = strchr(text, ':');
+    if (!colon || colon == text || (size_t)(colon - text) >= sizeof(rule->name)) {
+        *offset = 0;
+        return "expected <name>: <expression>";
+    }
+    memcpy(rule->name, text, (size_t)(colon - text));
+    p.pos = colon + 1;
+    rule_parse_or(&p);
+    if (!p.error && rule_accept(&p, "for")) {
+        char duration[32];
+        size_t len = rule_identifier(&p, duration, sizeof(duration));
+        rule->for_seconds = len ? parse_duration(duration) : -1;
+        if (rule->for_seconds < 0) p.error = "expected a duration after 'for'";
+    }
+    rule_skip_space(&p);
+    if (!p.error && *p.pos) p.error = "unexpected text";
+    *offset = (size_t)(p.pos - text);
+    if (p.error) {
+        for (; num_rule_windows > windows_before; num_rule_windows--) {
+            free(rule_windows[num_rule_windows - 1].ts);
+            free(rule_windows[num_rule_windows - 1].values);
+        }
+        return p.error;
+    }
+    for (int pc = 0; pc < rule->code_len; pc++) {
+        const rule_insn_t *insn = &rule->code[pc];
+        if (insn->op == RULE_OP_SERIES) rule_depend((int)insn->arg, rule_id);
+        else if (insn->op >= RULE_OP_AVG && insn->op <= RULE_OP_RATE) rule_depend(rule_windows[insn->arg].series, rule_id);
+    }
+    rule->dirty = 1;
+    return NULL;
+}
+
+/* min/max are found once per interval however many rules ask for them */
+static double rule_window_value(rule_window_t *window, uint8_t op) {
+    if (window->count == 0) return 0;
+    uint32_t first = (window->head + window->capacity - window->count) % window->capacity;
+    uint32_t last = (window->head + window->capacity - 1) % window->capacity;
+    if (op == RULE_OP_AVG) return window->sum / window->count;
+    if (op == RULE_OP_INCREASE || op == RULE_OP_RATE) {
+        double increase = window->values[last] - window->values[first];
+        if (increase < 0) increase = window->values[last];
+        if (op == RULE_OP_INCREASE) return increase;
+        int64_t span = window->ts[last] - window->ts[first];
+        return span > 0 ? increase / (double)span : 0;
+    }
+    if (!window->extremes_valid) {
+        window->min = window->max = window->values[first];
+        for (uint32_t i = 1; i < window->count; i++) {
+            double value = window->values[(first + i) % window->capacity];
+            if (value < window->min) window->min = value;
+            if (value > window->max) window->max = value;
+        }
+        window->extremes_valid = 1;
+    }
+    return op == RULE_OP_MIN ? window->min : window->max;
+}
+
+static double run_rule(const rule_t *rule) {
+    double stack[RULE_MAX_CODE];
+    int top = 0;
+    for (int pc = 0; pc < rule->code_len; pc++) {
+        const rule_insn_t *insn = &rule->code[pc];
+        double b = top > 0 ? stack[top - 1] : 0;
+        double a = top > 1 ? stack[top - 2] : 0;
+        switch (insn->op) {
+            case RULE_OP_CONST: stack[top++] = rule->consts[insn->arg]; continue;
+            case RULE_OP_SERIES: stack[top++] = metrics[insn->arg].value; continue;
+            case RULE_OP_AVG:
+            case RULE_OP_MIN:
+            case RULE_OP_MAX:
+            case RULE_OP_INCREASE:
+            case RULE_OP_RATE: stack[top++] = rule_window_value(&rule_windows[insn->arg], insn->op); continue;
+            case RULE_OP_NEG: stack[top - 1] = -b; continue;
+            case RULE_OP_ADD: a += b; break;
+            case RULE_OP_SUB: a -= b; break;
+            case RULE_OP_MUL: a *= b; break;
+            case RULE_OP_DIV: a = b != 0 ? a / b : 0; break;
+            case RULE_OP_GT: a = a > b; break;
+            case RULE_OP_LT: a = a < b; break;
+            case RULE_OP_GE: a = a >= b; break;
+            case RULE_OP_LE: a = a <= b; break;
+            case RULE_OP_EQ: a = a == b; break;
+            case RULE_OP_NE: a = a != b; break;
+            case RULE_OP_AND: a = a != 0 && b != 0; break;
+            case RULE_OP_OR: a = a != 0 || b != 0; break;
+        }
+        stack[--top - 1] = a;
+    }
+    return top > 0 ? stack[top - 1] : 0;
+}
+
+void init_rules(const char *username) {
+    if (num_rule_texts == 0) return;
+    rules = calloc((size_t)num_rule_texts, sizeof(rule_t));
+    if (!rules) return;
+    for (int i = 0; i < num_rule_texts; i++) {
+        size_t offset;
+        const char *error = compile_rule(rule_texts[i], num_rules, &offset);
+        if (error) {
+            char msg[MAX_CONFIG_LINE + 128];
+            snprintf(msg, sizeof(msg), "Rule ignored: %s at offset %zu in \"%s\"", error, offset, rule_texts[i]);
+            log_message(username, msg, LOG_WARNING);
+            continue;
+        }
+        num_rules++;
+    }
+}
+
+static void rule_fire(const char *username, rule_t *rule, int firing) {
+    rule->firing = firing;
+    metric_add(METRIC_ALERTS_FIRING, firing ? 1 : -1);
+    char msg[256];
+    snprintf(msg, sizeof(msg), firing ? "Alert %s firing" : "Alert %s resolved", rule->name);
+    record_fields_t fields = {"alert_rules", NULL, 0, NULL, NULL, firing ? "firing" : "resolved"};
+    log_record(username, msg, firing ? LOG_ERR : LOG_WARNING, &fields);
+}
+
+/* Feeds this interval's samples into the windows, marks the rules of changed series, runs the dirty ones */
+void evaluate_rules(const char *username) {
+    if (num_rules == 0) return;
+    int64_t now = time(NULL);
+    for (int i = 0; i < num_rule_windows; i++) {
+        rule_window_t *window = &rule_windows[i];
+        double value = metrics[window->series].value;
+        if (window->count == window->capacity) {
+            window->sum -= window->values[(window->head + window->capacity - window->count) % window->capacity];
+            window->count--;
+        }
+        window->ts[window->head] = now;
+        window->values[window->head] = value;
+        window->head = (window->head + 1) % window->capacity;
+        window->count++;
+        window->sum += value;
+        window->extremes_valid = 0;
+        while (window->count > 1) {
+            uint32_t first = (window->head + window->capacity - window->count) % window->capacity;
+            if (window->ts[first] >= now - window->seconds) break;
+            window->sum -= window->values[first];
+            window->count--;
+        }
+    }
+    for (int i = 0; i < NUM_METRICS; i++) {
+        if (rules_primed && metrics[i].value == rule_last_values[i]) continue;
+        rule_last_values[i] = metrics[i].value;
+        for (int j = 0; j < num_series_rules[i]; j++) rules[series_rules[i][j]].dirty = 1;
+    }
+    rules_primed = 1;
+    
+    for (int i = 0; i < num_rules; i++) {
+        rule_t *rule = &rules[i];
+        int waiting = rule->pending_since && !rule->firing;
+        if (!rule->dirty && !rule->has_window && !waiting) continue;
+        rule->dirty = 0;
+        if (run_rule(rule) != 0) {
+            if (!rule->pending_since) rule->pending_since = now;
+            if (!rule->firing && now - rule->pending_since >= rule->for_seconds) rule_fire(username, rule, 1);
+        } else {
+            rule->pending_since = 0;
+            if (rule->firing) rule_fire(username, rule, 0);
+        }
+    }
+}
+
+/* Accepts epoch seconds, "now", relative "-30s/-15m/-24h/-7d" and "YYYY-MM-DD[ HH:MM[:SS]]" local time */
+int64_t parse_time_arg(const char *arg, int64_t now) {
+    if (strcmp(arg, "now") == 0) return now;
+    if (arg[0] == '-') {
+        int64_t offset = parse_duration(arg + 1);
+        return offset < 0 ? -1 : now - offset;
+    }
+    
+    char *end;
+    long long epoch = strtoll(arg, &end, 10);
+    if (*end == '\0' && end != arg) return epoch;
+    
+    static const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *rest = strptime(arg, formats[i], &tm);
+        if (rest && *rest == '\0') {
+            tm.tm_isdst = -1;
+            return (int64_t)mktime(&tm);
+        }
+    }
+    return -1;
+}
+
+static void print_sample(int64_t ts, double value, void *arg __attribute__((unused))) {
+    char time_str[64];
+    time_t t = (time_t)ts;
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("%s %.15g\n", time_str, value);
+}
+
+static void print_rollup(const rollup_slot_t *slot, void *arg __attribute__((unused))) {
+    char time_str[64];
+    time_t t = (time_t)slot->start;
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("%s avg %.15g min %.15g max %.15g count %llu\n", time_str, slot->sum / (double)slot->count,
+           slot->min, slot->max, (unsigned long long)slot->count);
+}
+
+int run_query(int argc, char *argv[]) {
+    if (argc < 3 || strcmp(argv[2], "--list") == 0) {
+        char key[128];
+        for (int i = 0; i < NUM_METRICS; i++) {
+            tsdb_series_key(i, key, sizeof(key));
+            printf("%s\n", key);
+        }
+        return argc < 3 ? 1 : 0;
+    }
+    
+    int id = tsdb_find_series(argv[2]);
+    if (id < 0) {
+        fprintf(stderr, "Unknown series: %s (see 'system_logger query --list')\n", argv[2]);
+        return 1;
+    }
+    read_config();
+    int64_t now = time(NULL);
+    int64_t from = now - 3600, to = now, step = 0;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        int64_t value = -1;
+        if (strcmp(argv[i], "--since") == 0) value = from = parse_time_arg(argv[i + 1], now);
+        else if (strcmp(argv[i], "--until") == 0) value = to = parse_time_arg(argv[i + 1], now);
+        else if (strcmp(argv[i], "--step") == 0) value = step = parse_duration(argv[i + 1]);
+        if (value < 0) {
+            fprintf(stderr, "Invalid argument: %s %s\n", argv[i], argv[i + 1]);
+            return 1;
+        }
+    }
+    if (step > 0 && rollup_query(id, from, to, step, print_rollup, NULL) > 0) return 0;
+    tsdb_query(id, from, to, print_sample, NULL);
+    return 0;
+}
+
+/* Returns the offset of the last indexed record with ts < since (0 if none) and the first entry time */
+static uint64_t log_index_lookup(const char *index_path, int64_t since, int64_t *first_ts) {
+    *first_ts = -1;
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    size_t count = (fstat(fd, &st) == 0) ? (size_t)st.st_size / sizeof(log_index_entry_t) : 0;
+    if (count == 0) {
+        close(fd);
+        return 0;
+    }
+    const log_index_entry_t *entries = mmap(NULL, count * sizeof(log_index_entry_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (entries == MAP_FAILED) return 0;
+    
+    *first_ts = entries[0].ts;
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].ts < since) lo = mid + 1;
+        else hi = mid;
+    }
+    uint64_t offset = lo > 0 ? entries[lo - 1].offset : 0;
+    munmap((void *)entries, count * sizeof(log_index_entry_t));
+    return offset;
+}
+
+typedef struct {
+    int min_level;
+    const char *source;
+    size_t source_len;
+} log_filter_t;
+
+typedef struct {
+    int64_t since;
+    int64_t until;
+    int64_t last_ts;
+    int done;
+    const log_filter_t *filter;
+} log_range_t;
+
+static int level_rank(const char *level, size_t len) {
+    if (len == 5 && memcmp(level, "ERROR", 5) == 0) return 3;
+    if (len == 7 && memcmp(level, "WARNING", 7) == 0) return 2;
+    if (len == 4 && memcmp(level, "INFO", 4) == 0) return 1;
+    return 0;
+}
+
+/* Checks "[time] [LEVEL] [source] ..." (or the jsonl level/user keys) without copying the record */
+static int json_record_matches(const log_filter_t *filter, const char *line, size_t len) {
+    static const char level_key[] = "\"level\":\"", user_key[] = "\",\"user\":\"";
+    const char *level = memmem(line, len, level_key, sizeof(level_key) - 1);
+    if (!level) return 0;
+    level += sizeof(level_key) - 1;
+    const char *level_end = memchr(level, '"', (size_t)(line + len - level));
+    if (!level_end || level_rank(level, (size_t)(level_end - level)) < filter->min_level) return 0;
+    if (!filter->source) return 1;
+    
+    if ((size_t)(line + len - level_end) < sizeof(user_key) - 1 + filter->source_len + 1) return 0;
+    if (memcmp(level_end, user_key, sizeof(user_key) - 1) != 0) return 0;
+    const char *source = level_end + sizeof(user_key) - 1;
+    return memcmp(source, filter->source, filter->source_len) == 0 && source[filter->source_len] == '"';
+}
+
+static int record_matches(const log_filter_t *filter, const char *line, size_t len) {
+    if (filter->min_level == 0 && !filter->source) return 1;
+    if (len > 0 && line[0] == '{') return json_record_matches(filter, line, len);
+    if (len < 25 || line[21] != ' ' || line[22] != '[') return 0;
+    
+    const char *level = line + 23;
+    const char *level_end = memchr(level, ']', len - 23);
+    if (!level_end || level_rank(level, (size_t)(level_end - level)) < filter->min_level) return 0;
+    if (!filter->source) return 1;
+    
+    const char *source = level_end + 3;
+    if (source >= line + len || source[-1] != '[') return 0;
+    const char *source_end = memchr(source, ']', (size_t)(line + len - source));
+    return source_end && (size_t)(source_end - source) == filter->source_len &&
+           memcmp(source, filter->source, filter->source_len) == 0;
+}
+
+/* Emits the line if it falls in the range; lines without a timestamp inherit the previous one */
+static void log_range_line(log_range_t *range, const char *line, size_t len) {
+    int64_t ts = record_timestamp(line, len);
+    if (ts >= 0) range->last_ts = ts;
+    if (range->last_ts > range->until) {
+        range->done = 1;
+        return;
+    }
+    if (range->last_ts >= range->since && record_matches(range->filter, line, len)) fwrite(line, 1, len, stdout);
+}
+
+/* Runs "gzip -dc path" without a shell and returns its stdout */
+static FILE *open_decompressor(const char *path, pid_t *child) {
+    int fds[2];
+    if (pipe(fds) != 0) return NULL;
+    *child = fork();
+    if (*child < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+    if (*child == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execlp("gzip", "gzip", "-dc", path, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    FILE *stream = fdopen(fds[0], "r");
+    if (!stream) close(fds[0]);
+    return stream;
+}
+
+static void close_decompressor(FILE *stream, pid_t child) {
+    fclose(stream);
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+}
+
+/* Inflates only the frames from the one holding start (or the first one reaching since) on */
+static void stream_frames_range(const log_frames_t *frames, uint64_t start, log_range_t *range) {
+    size_t lo = 0, hi = frames->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (frames->entries[mid].raw_offset + frames->entries[mid].raw_len <= start) lo = mid + 1;
+        else hi = mid;
+    }
+    char *raw = NULL;
+    size_t capacity = 0;
+    for (size_t i = lo; i < frames->count && !range->done; i++) {
+        const log_frame_entry_t *entry = &frames->entries[i];
+        if (i + 1 < frames->count && frames->entries[i + 1].first_ts < range->since) continue;
+        if (entry->raw_len > capacity) {
+            char *grown = realloc(raw, entry->raw_len);
+            if (!grown) break;
+            raw = grown;
+            capacity = entry->raw_len;
+        }
+        if (inflate_frame(frames->data + entry->gz_offset, entry->gz_len, raw, entry->raw_len) != 0) break;
+        
+        const char *p = raw + (start > entry->raw_offset ? start - entry->raw_offset : 0), *end = raw + entry->raw_len;
+        while (!range->done && p < end) {
+            const char *newline = memchr(p, '\n', (size_t)(end - p));
+            const char *next = newline ? newline + 1 : end;
+            log_range_line(range, p, (size_t)(next - p));
+            p = next;
+        }
+    }
+    free(raw);
+}
+
+static void stream_segment_range(const log_segment_t *segment, uint64_t start, log_range_t *range) {
+    if (segment->compressed) {
+        log_frames_t frames;
+        if (map_log_frames(segment, &frames) == 0) {
+            stream_frames_range(&frames, start, range);
+            unmap_log_frames(&frames);
+            return;
+        }
+        pid_t child;
+        FILE *pipe = open_decompressor(segment->path, &child);
+        if (!pipe) return;
+        char *line = NULL;
+        size_t capacity = 0;
+        uint64_t offset = 0;
+        ssize_t len;
+        while (!range->done && (len = getline(&line, &capacity, pipe)) > 0) {
+            offset += (uint64_t)len;
+            if (offset > start) log_range_line(range, line, (size_t)len);
+        }
+        free(line);
+        close_decompressor(pipe, child);
+        return;
+    }
+    
+    int fd = open(segment->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size <= start) {
+        close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    
+    const char *p = map + start, *end = map + size;
+    while (!range->done && p < end) {
+        const char *newline = memchr(p, '\n', (size_t)(end - p));
+        const char *next = newline ? newline + 1 : end;
+        log_range_line(range, p, (size_t)(next - p));
+        p = next;
+    }
+    munmap((void *)map, size);
+}
+
+static void print_log_range(log_range_t *range) {
+    log_segment_t *segments;
+    int count = list_log_segments(&segments);
+    if (count < 0) {
+        fprintf(stderr, "Error reading %s: %s\n", LOG_DIR, strerror(errno));
+        return;
+    }
+    
+    int64_t *first_ts = calloc((size_t)count, sizeof(int64_t));
+    uint64_t *starts = calloc((size_t)count, sizeof(uint64_t));
+    if (first_ts && starts) {
+        for (int i = 0; i < count; i++) starts[i] = log_index_lookup(segments[i].index_path, range->since, &first_ts[i]);
+        for (int i = 0; i < count && !range->done; i++) {
+            if (i + 1 < count && first_ts[i + 1] >= 0 && first_ts[i + 1] < range->since) continue;
+            if (first_ts[i] > range->until) break;
+            stream_segment_range(&segments[i], starts[i], range);
+        }
+    }
+    fflush(stdout);
+    free(first_ts);
+    free(starts);
+    free(segments);
+}
+
+typedef struct {
+    const char *start;
+    size_t len;
+} line_ref_t;
+
+/*
+ * Prints the last wanted matching records by scanning each mapped segment backwards from EOF
+ * with memrchr, newest segment first; compressed segments end the scan.
+ */
+static void print_log_tail(const log_filter_t *filter, int wanted) {
+    log_segment_t *segments;
+    int count = list_log_segments(&segments);
+    if (count < 0 || wanted <= 0) {
+        if (count >= 0) free(segments);
+        return;
+    }
+    
+    line_ref_t *lines = calloc((size_t)wanted, sizeof(line_ref_t));
+    void **maps = calloc((size_t)count, sizeof(void *));
+    size_t *sizes = calloc((size_t)count, sizeof(size_t));
+    int found = 0;
+    
+    for (int i = count - 1; i >= 0 && found < wanted && lines && maps && sizes; i--) {
+        if (segments[i].compressed) break;
+        int fd = open(segments[i].path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            continue;
+        }
+        const char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) continue;
+        maps[i] = (void *)map;
+        sizes[i] = (size_t)st.st_size;
+        
+        const char *end = map + st.st_size;
+        while (end > map && found < wanted) {
+            const char *newline = (end - 1 > map) ? memrchr(map, '\n', (size_t)(end - 1 - map)) : NULL;
+            const char *start = newline ? newline + 1 : map;
+            if (record_matches(filter, start, (size_t)(end - start))) {
+                lines[found].start = start;
+                lines[found].len = (size_t)(end - start);
+                found++;
+            }
+            end = start;
+        }
+    }
+    
+    for (int i = found - 1; i >= 0; i--) {
+        fwrite(lines[i].start, 1, lines[i].len, stdout);
+        if (lines[i].len > 0 && lines[i].start[lines[i].len - 1] != '\n') fputc('\n', stdout);
+    }
+    fflush(stdout);
+    
+    for (int i = 0; maps && sizes && i < count; i++) {
+        if (maps[i]) munmap(maps[i], sizes[i]);
+    }
+    free(maps);
+    free(sizes);
+    free(lines);
+    free(segments);
+}
+
+typedef struct {
+    int fd;
+    ino_t inode;
+    uint64_t offset;
+    char partial[FOLLOW_CHUNK_SIZE];
+    size_t partial_len;
+} follow_state_t;
+
+static void follow_emit(follow_state_t *state, const log_filter_t *filter, const char *data, size_t len) {
+    while (len > 0) {
+        const char *newline = memchr(data, '\n', len);
+        if (!newline) {
+            size_t room = sizeof(state->partial) - state->partial_len;
+            size_t take = len < room ? len : room;
+            memcpy(state->partial + state->partial_len, data, take);
+            state->partial_len += take;
+            return;
+        }
+        size_t line_len = (size_t)(newline - data) + 1;
+        if (state->partial_len > 0) {
+            size_t room = sizeof(state->partial) - state->partial_len;
+            size_t take = line_len < room ? line_len : room;
+            memcpy(state->partial + state->partial_len, data, take);
+            if (record_matches(filter, state->partial, state->partial_len + take)) {
+                fwrite(state->partial, 1, state->partial_len + take, stdout);
+            }
+            state->partial_len = 0;
+        } else if (record_matches(filter, data, line_len)) {
+            fwrite(data, 1, line_len, stdout);
+        }
+        data += line_len;
+        len -= line_len;
+    }
+}
+
+static void follow_drain(follow_state_t *state, const log_filter_t *filter) {
+    struct stat st;
+    if (fstat(state->fd, &st) == 0 && (uint64_t)st.st_size < state->offset) {
+        state->offset = 0;
+        state->partial_len = 0;
+    }
+    char buffer[FOLLOW_CHUNK_SIZE];
+    ssize_t n;
+    while ((n = pread(state->fd, buffer, sizeof(buffer), (off_t)state->offset)) > 0) {
+        state->offset += (uint64_t)n;
+        follow_emit(state, filter, buffer, (size_t)n);
+    }
+    fflush(stdout);
+}
+
+/* Waits for IN_MODIFY on LOG_FILE and reopens it when rotation gives the path a new inode */
+static int follow_log(const log_filter_t *filter) {
+    static follow_state_t state;
+    state.fd = open(LOG_FILE, O_RDONLY | O_CLOEXEC);
+    if (state.fd < 0) {
+        fprintf(stderr, "Error opening file %s: %s\n", LOG_FILE, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    fstat(state.fd, &st);
+    state.inode = st.st_ino;
+    state.offset = (uint64_t)st.st_size;
+    
+    int notify_fd = inotify_init1(IN_CLOEXEC);
+    if (notify_fd < 0) {
+        fprintf(stderr, "Error initializing inotify: %s\n", strerror(errno));
+        return 1;
+    }
+    int file_wd = inotify_add_watch(notify_fd, LOG_FILE, IN_MODIFY);
+    inotify_add_watch(notify_fd, LOG_DIR, IN_CREATE | IN_MOVED_TO);
+    
+    while (1) {
+        struct pollfd pfd = {notify_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) > 0) {
+            char events[4096];
+            if (read(notify_fd, events, sizeof(events)) < 0 && errno != EINTR) break;
+        }
+        follow_drain(&state, filter);
+        
+        if (stat(LOG_FILE, &st) == 0 && st.st_ino != state.inode) {
+            int fd = open(LOG_FILE, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) continue;
+            close(state.fd);
+            state.fd = fd;
+            state.inode = st.st_ino;
+            state.offset = 0;
+            state.partial_len = 0;
+            if (file_wd >= 0) inotify_rm_watch(notify_fd, file_wd);
+            file_wd = inotify_add_watch(notify_fd, LOG_FILE, IN_MODIFY);
+            follow_drain(&state, filter);
+        }
+    }
+    close(notify_fd);
+    close(state.fd);
+    return 1;
+}
+
+int run_logs(int argc, char *argv[]) {
+    int64_t now = time(NULL);
+    log_filter_t filter = {0, NULL, 0};
+    log_range_t range = {now - 3600, INT64_MAX, -1, 0, &filter};
+    int ranged = 0, follow = 0, tail = LOG_TAIL_DEFAULT;
+    
+    for (int i = 2; i < argc; i++) {
+        const char *option = argv[i];
+        if (strcmp(option, "-f") == 0) {
+            follow = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", option);
+            return 1;
+        }
+        const char *value = argv[++i];
+        int64_t parsed = 0;
+        if (strcmp(option, "--since") == 0) {
+            parsed = range.since = parse_time_arg(value, now);
+            ranged = 1;
+        } else if (strcmp(option, "--until") == 0) {
+            parsed = range.until = parse_time_arg(value, now);
+            ranged = 1;
+        } else if (strcmp(option, "-n") == 0) {
+            parsed = tail = atoi(value);
+        } else if (strcmp(option, "--level") == 0) {
+            filter.min_level = level_rank(value, strlen(value));
+            if (filter.min_level == 0 && strcmp(value, "DEBUG") != 0) parsed = -1;
+        } else if (strcmp(option, "--source") == 0) {
+            filter.source = value;
+            filter.source_len = strlen(value);
+        } else {
+            parsed = -1;
+        }
+        if (parsed < 0) {
+            fprintf(stderr, "Invalid argument: %s %s\n", option, value);
+            return 1;
+        }
+    }
+    
+    if (ranged) print_log_range(&range);
+    else print_log_tail(&filter, tail);
+    return follow ? follow_log(&filter) : 0;
+}
 
 typedef struct {
-    char path[MAX_PATH_LEN];
-    int wd;
-    time_t last_check;
-} watch_dir_t;
+    const char *data;
+    size_t len;
+    int owned;
+} grep_source_t;
 
-static watch_dir_t watch_dirs[] = {
-    {"/etc", -1, 0},
-    {"/var/log", -1, 0},
-    {"/tmp", -1, 0}
-};
-#define NUM_WATCH_DIRS (sizeof(watch_dirs) / sizeof(watch_dirs[0]))
+typedef struct {
+    int source;
+    size_t start;
+    size_t end;
+    char *out;
+    size_t out_len;
+    size_t out_capacity;
+    uint64_t matches;
+} grep_task_t;
 
-static const char* get_username(void) {
-    const char *user = getenv("USER");
-    return user ? user : (getenv("USERNAME") ? getenv("USERNAME") : "unknown");
+typedef struct {
+    const char *start;
+    size_t len;
+    uint64_t hash;
+} query_token_t;
+
+typedef struct {
+    const char *pattern;
+    size_t pattern_len;
+    int64_t since;
+    int64_t until;
+    int timed;
+    int whole_tokens;
+    int no_filters;
+    query_token_t tokens[MAX_QUERY_TOKENS];
+    int num_tokens;
+    const log_filter_t *filter;
+    grep_source_t *sources;
+    grep_task_t *tasks;
+    int num_tasks;
+    int task_capacity;
+    int next_task;
+    uint64_t segments_skipped;
+    uint64_t blocks_skipped;
+} grep_job_t;
+
+/*
+ * Collects the tokens a matching record must contain. For a substring pattern only tokens
+ * bounded by separators inside the pattern qualify, since the ends may be partial tokens.
+ */
+static void grep_add_query_tokens(grep_job_t *job, const char *text, int complete_ends) {
+    const char *p = text;
+    while (*p && job->num_tokens < MAX_QUERY_TOKENS) {
+        while (*p && !is_token_char(*p)) p++;
+        const char *start = p;
+        while (*p && is_token_char(*p)) p++;
+        if (p == start) continue;
+        if (!complete_ends && (start == text || *p == '\0')) continue;
+        query_token_t *token = &job->tokens[job->num_tokens++];
+        token->start = start;
+        token->len = (size_t)(p - start);
+        token->hash = token_hash(start, token->len);
+    }
 }
 
-int read_config(void) {
-    FILE *config = fopen(CONFIG_FILE, "r");
-    if (!config) return 0;
-    
-    char line[MAX_CONFIG_LINE];
-    while (fgets(line, sizeof(line), config)) {
-        size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
-        if (len == 0 || line[0] == '#') continue;
+static int filter_has_tokens(const grep_job_t *job, const uint8_t *bits, uint64_t nbits, int hashes) {
+    for (int i = 0; i < job->num_tokens; i++) {
+        if (!bloom_test(bits, nbits, hashes, job->tokens[i].hash)) return 0;
+    }
+    return 1;
+}
+
+static int line_has_token(const char *line, size_t len, const query_token_t *token) {
+    const char *p = line, *end = line + len;
+    while (p < end) {
+        const char *hit = memmem(p, (size_t)(end - p), token->start, token->len);
+        if (!hit) return 0;
+        const char *after = hit + token->len;
+        if ((hit == line || !is_token_char(hit[-1])) && (after == end || !is_token_char(*after))) return 1;
+        p = hit + 1;
+    }
+    return 0;
+}
+
+static void grep_append(grep_task_t *task, const char *line, size_t len) {
+    if (task->out_len + len + 1 > task->out_capacity) {
+        size_t capacity = task->out_capacity ? task->out_capacity * 2 : 65536;
+        while (capacity < task->out_len + len + 1) capacity *= 2;
+        char *grown = realloc(task->out, capacity);
+        if (!grown) return;
+        task->out = grown;
+        task->out_capacity = capacity;
+    }
+    memcpy(task->out + task->out_len, line, len);
+    task->out_len += len;
+    if (len == 0 || line[len - 1] != '\n') task->out[task->out_len++] = '\n';
+    task->matches++;
+}
+
+/*
+ * Runs memmem over the whole chunk rather than line by line, so the scan speed is that of
+ * glibc's vectorized two-way search; only hits are expanded to their line and filtered.
+ */
+static void grep_scan(const grep_job_t *job, grep_task_t *task) {
+    const char *base = job->sources[task->source].data;
+    const char *p = base + task->start, *end = base + task->end;
+    while (p < end) {
+        const char *hit = memmem(p, (size_t)(end - p), job->pattern, job->pattern_len);
+        if (!hit) break;
+        const char *line = (hit > p) ? memrchr(p, '\n', (size_t)(hit - p)) : NULL;
+        line = line ? line + 1 : p;
+        const char *newline = memchr(hit, '\n', (size_t)(end - hit));
+        const char *next = newline ? newline + 1 : end;
+        size_t len = (size_t)(next - line);
         
-        if (strncmp(line, "LOG_INTERVAL=", 13) == 0) {
-            int interval = atoi(line + 13);
-            if (interval > 0 && interval <= 3600) log_interval = interval;
-        } else if (strncmp(line, "USE_SYSLOG=", 11) == 0) {
-            use_syslog = (atoi(line + 11) != 0);
+        int wanted = record_matches(job->filter, line, len);
+        if (wanted && job->timed) {
+            int64_t ts = record_timestamp(line, len);
+            wanted = (ts < 0 || (ts >= job->since && ts <= job->until));
+        }
+        for (int i = 0; wanted && job->whole_tokens && i < job->num_tokens; i++) {
+            wanted = line_has_token(line, len, &job->tokens[i]);
         }
+        if (wanted) grep_append(task, line, len);
+        p = next;
     }
-    fclose(config);
+}
+
+static void *grep_worker(void *arg) {
+    grep_job_t *job = arg;
+    while (1) {
+        int index = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED);
+        if (index >= job->num_tasks) break;
+        grep_scan(job, &job->tasks[index]);
+    }
+    return NULL;
+}
+
+static int grep_load_compressed(const char *path, grep_source_t *source) {
+    pid_t child;
+    FILE *stream = open_decompressor(path, &child);
+    if (!stream) return -1;
+    size_t capacity = 1 << 20, len = 0;
+    char *data = malloc(capacity);
+    size_t n;
+    while (data && (n = fread(data + len, 1, capacity - len, stream)) > 0) {
+        len += n;
+        if (len == capacity) {
+            char *grown = realloc(data, capacity * 2);
+            if (!grown) break;
+            data = grown;
+            capacity *= 2;
+        }
+    }
+    close_decompressor(stream, child);
+    if (!data) return -1;
+    source->data = data;
+    source->len = len;
+    source->owned = 1;
     return 0;
 }
 
-int open_log_file(void) {
-    log_file = fopen(LOG_FILE, "a");
-    if (!log_file) {
-        fprintf(stderr, "Error opening file %s: %s\n", LOG_FILE, strerror(errno));
+/*
+ * Frames that end before start are not inflated and read as zeros: calloc hands out fresh zero pages
+ * for a buffer this size, so skipping them costs neither inflate time nor memory. A start past the
+ * end is scanned from 0 by the caller, so then every frame is inflated.
+ */
+static int grep_load_frames(const log_segment_t *segment, size_t start, grep_source_t *source) {
+    log_frames_t frames;
+    if (map_log_frames(segment, &frames) != 0) return -1;
+    const log_frame_entry_t *last = &frames.entries[frames.count - 1];
+    size_t len = (size_t)(last->raw_offset + last->raw_len);
+    if (start >= len) start = 0;
+    char *data = calloc(1, len);
+    int ok = (data != NULL);
+    for (size_t i = 0; ok && i < frames.count; i++) {
+        const log_frame_entry_t *entry = &frames.entries[i];
+        if (entry->raw_offset + entry->raw_len <= start) continue;
+        ok = inflate_frame(frames.data + entry->gz_offset, entry->gz_len, data + entry->raw_offset, entry->raw_len) == 0;
+    }
+    unmap_log_frames(&frames);
+    if (!ok) {
+        free(data);
         return -1;
     }
-    setvbuf(log_file, NULL, _IOLBF, 0);
+    source->data = data;
+    source->len = len;
+    source->owned = 1;
     return 0;
 }
 
-void close_log_file(void) {
-    if (log_file) {
-        fclose(log_file);
-        log_file = NULL;
+static int grep_load_segment(const log_segment_t *segment, size_t start, grep_source_t *source) {
+    if (segment->compressed) {
+        if (grep_load_frames(segment, start, source) == 0) return 0;
+        return grep_load_compressed(segment->path, source);
     }
+    int fd = open(segment->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+            source->data = map;
+            source->len = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+    return source->data ? 0 : -1;
 }
 
-void log_message(const char *username, const char *message, int priority) {
-    char time_str[64];
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
-    
-    if (log_file) {
-        const char *level_str = "INFO";
-        if (priority == LOG_WARNING) level_str = "WARNING";
-        else if (priority == LOG_ERR) level_str = "ERROR";
-        else if (priority == LOG_DEBUG) level_str = "DEBUG";
-        fprintf(log_file, "[%s] [%s] [%s] %s\n", time_str, level_str, username, message);
-        fflush(log_file);
-    }
-    
-    if (use_syslog) {
-        syslog(priority, "[%s] %s", username, message);
+static const void *map_sidecar(const char *base, const char *suffix, size_t *size) {
+    char path[MAX_PATH_LEN + 8];
+    snprintf(path, sizeof(path), "%s%s", base, suffix);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    const void *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) map = NULL;
+        else *size = (size_t)st.st_size;
     }
+    close(fd);
+    return map;
 }
 
-void log_uptime(const char *username) {
-    FILE *file = fopen("/proc/uptime", "r");
-    if (!file) {
-        char msg[256];
-        snprintf(msg, sizeof(msg), "Error reading /proc/uptime: %s", strerror(errno));
-        log_message(username, msg, LOG_WARNING);
-        return;
+/* Whole segment can be skipped when its finalized Bloom filter lacks a required token */
+static int grep_segment_excluded(const grep_job_t *job, const log_segment_t *segment) {
+    if (job->num_tokens == 0 || job->no_filters) return 0;
+    size_t size = 0;
+    const bloom_header_t *header = map_sidecar(segment->base, LOG_BLOOM_SUFFIX, &size);
+    if (!header) return 0;
+    int excluded = 0;
+    if (size >= sizeof(*header) && header->magic == BLOOM_MAGIC && size - sizeof(*header) >= header->bits / 8) {
+        excluded = !filter_has_tokens(job, (const uint8_t *)(header + 1), header->bits, (int)header->hashes);
     }
-    
-    double uptime_seconds;
-    if (fscanf(file, "%lf", &uptime_seconds) == 1) {
-        int days = (int)(uptime_seconds / 86400);
-        int hours = (int)((uptime_seconds - days * 86400) / 3600);
-        int minutes = (int)((uptime_seconds - days * 86400 - hours * 3600) / 60);
-        char msg[256];
-        snprintf(msg, sizeof(msg), "Uptime: %d days, %d hours, %d minutes (%.0f seconds)", 
-                days, hours, minutes, uptime_seconds);
-        log_message(username, msg, LOG_INFO);
+    munmap((void *)header, size);
+    return excluded;
+}
+
+static void grep_add_tasks(grep_job_t *job, int source_index, size_t start, size_t end) {
+    const grep_source_t *source = &job->sources[source_index];
+    while (start < end) {
+        size_t stop = start + GREP_CHUNK_SIZE;
+        if (stop >= end) {
+            stop = end;
+        } else {
+            const char *newline = memchr(source->data + stop, '\n', end - stop);
+            stop = newline ? (size_t)(newline - source->data) + 1 : end;
+        }
+        if (job->num_tasks == job->task_capacity) {
+            int capacity = job->task_capacity ? job->task_capacity * 2 : 64;
+            grep_task_t *grown = realloc(job->tasks, (size_t)capacity * sizeof(grep_task_t));
+            if (!grown) return;
+            job->tasks = grown;
+            job->task_capacity = capacity;
+        }
+        grep_task_t *task = &job->tasks[job->num_tasks++];
+        memset(task, 0, sizeof(*task));
+        task->source = source_index;
+        task->start = start;
+        task->end = stop;
+        start = stop;
     }
-    fclose(file);
 }
 
-void log_free_inodes(const char *username) {
-    struct statfs fs_info;
-    if (statfs("/", &fs_info) == 0) {
-        unsigned long long free_inodes = fs_info.f_bavail;
-        unsigned long long total_inodes = fs_info.f_files;
-        char msg[256];
-        snprintf(msg, sizeof(msg), "Free inodes: %llu out of %llu", 
-                free_inodes, total_inodes);
-        log_message(username, msg, LOG_INFO);
+/*
+ * Queues [start, len) of a loaded segment, leaving out index blocks whose block filter rules the
+ * tokens out. Adjacent candidate blocks are merged before being cut into chunks.
+ */
+static void grep_add_segment(grep_job_t *job, int source_index, const log_segment_t *segment, size_t start) {
+    size_t len = job->sources[source_index].len;
+    size_t index_size = 0, blocks_size = 0;
+    const log_index_entry_t *entries = NULL;
+    const block_filter_t *filters = NULL;
+    if (job->num_tokens > 0 && !job->no_filters) {
+        entries = map_sidecar(segment->base, LOG_INDEX_SUFFIX, &index_size);
+        filters = map_sidecar(segment->base, LOG_BLOCKS_SUFFIX, &blocks_size);
+    }
+    if (!entries || !filters) {
+        grep_add_tasks(job, source_index, start, len);
     } else {
-        char msg[256];
-        snprintf(msg, sizeof(msg), "Error getting inode information: %s", strerror(errno));
-        log_message(username, msg, LOG_WARNING);
+        size_t num_entries = index_size / sizeof(log_index_entry_t);
+        size_t num_filters = blocks_size / sizeof(block_filter_t);
+        size_t filter = 0, run_start = start, run_end = start;
+        if (num_entries == 0) run_end = len;
+        else if (entries[0].offset > start) run_end = entries[0].offset < len ? (size_t)entries[0].offset : len;
+        
+        for (size_t i = 0; i < num_entries; i++) {
+            size_t block_start = (size_t)entries[i].offset;
+            size_t block_end = (i + 1 < num_entries) ? (size_t)entries[i + 1].offset : len;
+            if (block_end > len) block_end = len;
+            if (block_start < start) block_start = start;
+            if (block_start >= block_end) continue;
+            
+            while (filter < num_filters && filters[filter].offset < entries[i].offset) filter++;
+            if (filter < num_filters && filters[filter].offset == entries[i].offset &&
+                !filter_has_tokens(job, filters[filter].bits, BLOOM_BLOCK_BITS, BLOOM_BLOCK_HASHES)) {
+                job->blocks_skipped++;
+                continue;
+            }
+            if (block_start != run_end) {
+                if (run_end > run_start) grep_add_tasks(job, source_index, run_start, run_end);
+                run_start = block_start;
+            }
+            run_end = block_end;
+        }
+        if (run_end > run_start) grep_add_tasks(job, source_index, run_start, run_end);
     }
+    if (entries) munmap((void *)entries, index_size);
+    if (filters) munmap((void *)filters, blocks_size);
 }
 
-void log_network_connections(const char *username) {
-    FILE *file = fopen("/proc/net/tcp", "r");
-    if (!file) {
-        char msg[256];
-        snprintf(msg, sizeof(msg), "Error opening /proc/net/tcp: %s", strerror(errno));
-        log_message(username, msg, LOG_WARNING);
-        return;
+/*
+ * Shared by grep (substring) and search (whole tokens). Segments outside the time range are
+ * skipped from their index, segments and index blocks whose Bloom filters lack a required token
+ * are skipped from their filters, and the rest is cut into line-aligned chunks scanned by N
+ * threads; results are printed in chunk order, which is time order.
+ */
+static int run_log_scan(grep_job_t *job, int argc, char *argv[], int first_option) {
+    int64_t now = time(NULL);
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    log_filter_t *filter = (log_filter_t *)job->filter;
+    job->since = 0;
+    job->until = INT64_MAX;
+    /* A plain scan of every block, to check that the filters never rule out a match */
+    job->no_filters = (getenv("SYSTEM_LOGGER_NO_FILTERS") != NULL);
+    
+    for (int i = first_option; i + 1 < argc; i += 2) {
+        const char *option = argv[i], *value = argv[i + 1];
+        int64_t parsed = 0;
+        if (strcmp(option, "--since") == 0) {
+            parsed = job->since = parse_time_arg(value, now);
+            job->timed = 1;
+        } else if (strcmp(option, "--until") == 0) {
+            parsed = job->until = parse_time_arg(value, now);
+            job->timed = 1;
+        } else if (strcmp(option, "--level") == 0) {
+            filter->min_level = level_rank(value, strlen(value));
+            if (filter->min_level == 0 && strcmp(value, "DEBUG") != 0) parsed = -1;
+        } else if (strcmp(option, "--source") == 0) {
+            filter->source = value;
+            filter->source_len = strlen(value);
+        } else if (strcmp(option, "-j") == 0) {
+            parsed = threads = atol(value);
+        } else {
+            parsed = -1;
+        }
+        if (parsed < 0) {
+            fprintf(stderr, "Invalid argument: %s %s\n", option, value);
+            return 2;
+        }
     }
+    if (threads < 1) threads = 1;
+    if (threads > GREP_MAX_THREADS) threads = GREP_MAX_THREADS;
     
-    char line[MAX_LINE_LEN];
-    int connection_count = 0, established_count = 0;
+    log_segment_t *segments;
+    int count = list_log_segments(&segments);
+    if (count < 0) {
+        fprintf(stderr, "Error reading %s: %s\n", LOG_DIR, strerror(errno));
+        return 2;
+    }
+    int64_t *first_ts = calloc((size_t)count, sizeof(int64_t));
+    uint64_t *starts = calloc((size_t)count, sizeof(uint64_t));
+    job->sources = calloc((size_t)count, sizeof(grep_source_t));
+    if (!first_ts || !starts || !job->sources) return 2;
+    for (int i = 0; i < count; i++) starts[i] = log_index_lookup(segments[i].index_path, job->since, &first_ts[i]);
     
-    if (fgets(line, sizeof(line), file)) {
-        while (fgets(line, sizeof(line), file)) {
-            connection_count++;
-            if (strstr(line, ": 01 ") != NULL) established_count++;
+    for (int i = 0; i < count; i++) {
+        int64_t segment_max = (i + 1 < count && first_ts[i + 1] >= 0) ? first_ts[i + 1] : now;
+        if (job->timed && (segment_max < job->since || first_ts[i] > job->until)) continue;
+        if (grep_segment_excluded(job, &segments[i])) {
+            job->segments_skipped++;
+            continue;
         }
+        size_t start = job->timed ? (size_t)starts[i] : 0;
+        if (grep_load_segment(&segments[i], start, &job->sources[i]) != 0) continue;
+        if (start >= job->sources[i].len) start = 0;
+        grep_add_segment(job, i, &segments[i], start);
     }
-    fclose(file);
     
-    char msg[256];
-    snprintf(msg, sizeof(msg), "TCP network connections: total %d, established %d", 
-            connection_count, established_count);
-    log_message(username, msg, LOG_INFO);
+    pthread_t workers[GREP_MAX_THREADS];
+    int started = 0;
+    if (threads > job->num_tasks) threads = job->num_tasks;
+    for (long t = 1; t < threads; t++) {
+        if (pthread_create(&workers[started], NULL, grep_worker, job) == 0) started++;
+    }
+    grep_worker(job);
+    for (int t = 0; t < started; t++) pthread_join(workers[t], NULL);
+    
+    uint64_t matches = 0;
+    for (int i = 0; i < job->num_tasks; i++) {
+        fwrite(job->tasks[i].out, 1, job->tasks[i].out_len, stdout);
+        matches += job->tasks[i].matches;
+        free(job->tasks[i].out);
+    }
+    fflush(stdout);
+    if (getenv("SYSTEM_LOGGER_SCAN_STATS")) {
+        fprintf(stderr, "segments skipped %llu, blocks skipped %llu, chunks scanned %d\n",
+                (unsigned long long)job->segments_skipped, (unsigned long long)job->blocks_skipped, job->num_tasks);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (!job->sources[i].data) continue;
+        if (job->sources[i].owned) free((void *)job->sources[i].data);
+        else munmap((void *)job->sources[i].data, job->sources[i].len);
+    }
+    free(job->tasks);
+    free(job->sources);
+    free(first_ts);
+    free(starts);
+    free(segments);
+    return matches > 0 ? 0 : 1;
 }
 
-int init_directory_monitoring(void) {
-    inotify_fd = inotify_init();
-    if (inotify_fd < 0) return -1;
-    
-    for (size_t i = 0; i < NUM_WATCH_DIRS; i++) {
-        int wd = inotify_add_watch(inotify_fd, watch_dirs[i].path, 
-                                   IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
-        if (wd >= 0) {
-            watch_dirs[i].wd = wd;
-            watch_dirs[i].last_check = time(NULL);
-        }
+/* system_logger grep PATTERN [--since T] [--until T] [--level L] [--source S] [-j N] */
+int run_grep(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: system_logger grep PATTERN [--since T] [--until T] [--level L] [--source S] [-j N]\n");
+        return 2;
     }
-    return 0;
+    log_filter_t filter = {0, NULL, 0};
+    grep_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.pattern = argv[2];
+    job.pattern_len = strlen(argv[2]);
+    job.filter = &filter;
+    grep_add_query_tokens(&job, argv[2], 0);
+    return run_log_scan(&job, argc, argv, 3);
 }
 
-void check_directory_changes(const char *username) {
-    if (inotify_fd < 0) return;
-    
-    fd_set read_fds;
-    struct timeval timeout = {0, 0};
-    FD_ZERO(&read_fds);
-    FD_SET(inotify_fd, &read_fds);
-    
-    if (select(inotify_fd + 1, &read_fds, NULL, NULL, &timeout) > 0) {
-        char buffer[4096];
-        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
-        
-        if (length > 0) {
-            int i = 0;
-            while (i < length) {
-                struct inotify_event *event = (struct inotify_event *)&buffer[i];
-                
-                for (size_t j = 0; j < NUM_WATCH_DIRS; j++) {
-                    if (watch_dirs[j].wd == event->wd) {
-                        if (event->len > 0 && strcmp(event->name, "system_logger.log") == 0) break;
-                        
-                        const char *event_type = "modification";
-                        if (event->mask & IN_CREATE) event_type = "creation";
-                        else if (event->mask & IN_DELETE) event_type = "deletion";
-                        else if (event->mask & IN_MODIFY) event_type = "modification";
-                        else if (event->mask & IN_MOVED_FROM) event_type = "moved from";
-                        else if (event->mask & IN_MOVED_TO) event_type = "moved to";
-                        
-                        char msg[1024];
-                        if (event->len > 0) {
-                            snprintf(msg, sizeof(msg), "%s: %s of file %s", 
-                                    watch_dirs[j].path, event_type, event->name);
-                        } else {
-                            snprintf(msg, sizeof(msg), "%s: %s", 
-                                    watch_dirs[j].path, event_type);
-                        }
-                        log_message(username, msg, LOG_INFO);
-                        break;
-                    }
-                }
-                i += sizeof(struct inotify_event) + event->len;
-            }
-        }
+/*
+ * system_logger search TERM [options] finds records containing every token of TERM, so
+ * "/etc/sudoers" matches "/etc: modification of file sudoers".
+ */
+int run_search(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: system_logger search TERM [--since T] [--until T] [--level L] [--source S] [-j N]\n");
+        return 2;
     }
+    log_filter_t filter = {0, NULL, 0};
+    grep_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.filter = &filter;
+    job.whole_tokens = 1;
+    grep_add_query_tokens(&job, argv[2], 1);
+    if (job.num_tokens == 0) {
+        fprintf(stderr, "No searchable tokens in: %s\n", argv[2]);
+        return 2;
+    }
+    const query_token_t *longest = &job.tokens[0];
+    for (int i = 1; i < job.num_tokens; i++) {
+        if (job.tokens[i].len > longest->len) longest = &job.tokens[i];
+    }
+    job.pattern = longest->start;
+    job.pattern_len = longest->len;
+    return run_log_scan(&job, argc, argv, 3);
 }
 
-void check_directory_changes_periodic(const char *username) {
-    static time_t last_check = 0;
-    time_t now = time(NULL);
-    if (now - last_check < 30) return;
-    last_check = now;
+int run_top(int argc, char *argv[]) {
+    int once = (argc > 2 && strcmp(argv[2], "--once") == 0);
+    int fd = open(SHM_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening %s: %s (is system_logger running?)\n", SHM_PATH, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(shm_segment_t)) {
+        fprintf(stderr, "Invalid metrics segment %s\n", SHM_PATH);
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    const shm_segment_t *segment = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s: %s\n", SHM_PATH, strerror(errno));
+        return 1;
+    }
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || segment->version != SHM_VERSION ||
+        segment->metric_size != sizeof(shm_metric_t) ||
+        sizeof(shm_segment_t) + (size_t)segment->num_metrics * sizeof(shm_metric_t) > size) {
+        fprintf(stderr, "Unsupported metrics segment layout in %s\n", SHM_PATH);
+        munmap((void *)segment, size);
+        return 1;
+    }
     
-    for (size_t i = 0; i < NUM_WATCH_DIRS; i++) {
-        struct stat st;
-        if (stat(watch_dirs[i].path, &st) == 0) {
-            if (strcmp(watch_dirs[i].path, "/var/log") == 0) {
-                struct stat log_st;
-                char log_path[MAX_PATH_LEN + 32];
-                snprintf(log_path, sizeof(log_path), "%s/system_logger.log", watch_dirs[i].path);
-                if (stat(log_path, &log_st) == 0 && st.st_mtime == log_st.st_mtime && watch_dirs[i].last_check > 0) {
-                    watch_dirs[i].last_check = st.st_mtime;
-                    continue;
-                }
-            }
-            
-            if (watch_dirs[i].last_check > 0 && st.st_mtime > watch_dirs[i].last_check) {
-                char msg[1024];
-                snprintf(msg, sizeof(msg), "Changes detected in directory: %s", watch_dirs[i].path);
-                log_message(username, msg, LOG_INFO);
-            }
-            watch_dirs[i].last_check = st.st_mtime;
+    uint32_t count = segment->num_metrics;
+    double *values = calloc(count, sizeof(double));
+    if (!values) return 1;
+    
+    while (1) {
+        uint64_t seq_before, seq_after;
+        int64_t updated;
+        do {
+            seq_before = __atomic_load_n(&segment->seq, __ATOMIC_ACQUIRE);
+            for (uint32_t i = 0; i < count; i++) values[i] = segment->metrics[i].value;
+            updated = segment->updated_sec;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            seq_after = __atomic_load_n(&segment->seq, __ATOMIC_RELAXED);
+        } while ((seq_before & 1) || seq_before != seq_after);
+        
+        if (!once) printf("\033[H\033[2J");
+        printf("system_logger (pid %d, interval %d s), updated %lld s ago\n\n",
+               segment->pid, segment->interval, (long long)(time(NULL) - updated));
+        for (uint32_t i = 0; i < count; i++) {
+            char label[SHM_NAME_LEN + SHM_LABELS_LEN + 3];
+            snprintf(label, sizeof(label), "%.*s%s%.*s%s", SHM_NAME_LEN, segment->metrics[i].name,
+                     segment->metrics[i].labels[0] ? "{" : "", SHM_LABELS_LEN, segment->metrics[i].labels,
+                     segment->metrics[i].labels[0] ? "}" : "");
+            printf("%-80s %18.12g\n", label, values[i]);
         }
+        fflush(stdout);
+        if (once) break;
+        usleep(TOP_REFRESH_US);
     }
+    
+    free(values);
+    munmap((void *)segment, size);
+    return 0;
 }
 
 void signal_handler(int sig) {
-    const char *username = get_username();
-    if (sig == SIGTERM || sig == SIGINT) {
-        log_message(username, "Termination signal received. Program is stopping.", LOG_INFO);
-        if (inotify_fd >= 0) close(inotify_fd);
-        close_log_file();
-        if (use_syslog) closelog();
-        exit(0);
-    }
+    if (sig == SIGTERM || sig == SIGINT) stop_requested = 1;
 }
 
-int main(int argc __attribute__((unused)), char *argv[] __attribute__((unused))) {
+int main(int argc, char *argv[]) {
     const char *username = get_username();
     char message[512];
     
+    if (argc > 1 && strcmp(argv[1], "top") == 0) return run_top(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "query") == 0) return run_query(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "logs") == 0) return run_logs(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "grep") == 0) return run_grep(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "search") == 0) return run_search(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "receive") == 0) return run_receive(argc, argv);
+    
     signal(SIGTERM, signal_handler);
     signal(SIGINT, signal_handler);
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
     
-    if (use_syslog) openlog("system_logger", LOG_PID | LOG_CONS, LOG_DAEMON);
     read_config();
     
+    if (init_sinks() < 0) {
+        fprintf(stderr, "Failed to start output sinks: %s\n", strerror(errno));
+    }
+    
     if (open_log_file() != 0) {
         fprintf(stderr, "Failed to open log file. Program is terminating.\n");
         return 1;
     }
+    if (log_recovered_bytes > 0) {
+        snprintf(message, sizeof(message), "Recovered %s: cut %llu bytes of torn records at the tail",
+                 LOG_FILE, (unsigned long long)log_recovered_bytes);
+        log_message(username, message, LOG_WARNING);
+    }
     
     if (init_directory_monitoring() < 0) {
         snprintf(message, sizeof(message), "Failed to initialize directory monitoring: %s", strerror(errno));
         log_message(username, message, LOG_WARNING);
+    } else {
+        poll_register(inotify_fd, POLLIN, inotify_handler, NULL);
+    }
+    
+    if (init_tails() < 0) {
+        log_message(username, "Some TAIL files could not be opened yet; they are picked up when they appear", LOG_WARNING);
+    }
+    if (init_logins() < 0) {
+        snprintf(message, sizeof(message), "Failed to open %s: %s", _PATH_WTMP, strerror(errno));
+        log_message(username, message, LOG_WARNING);
+    }
+    
+    if (init_metrics_server() < 0) {
+        snprintf(message, sizeof(message), "Failed to start metrics endpoint on %.256s: %s", metrics_listen, strerror(errno));
+        log_message(username, message, LOG_WARNING);
+    }
+    
+    if (init_statsd_sink() < 0) {
+        snprintf(message, sizeof(message), "Failed to set up StatsD sink %.256s: %s", statsd_target, strerror(errno));
+        log_message(username, message, LOG_WARNING);
+    }
+    
+    if (init_forwarder() < 0) {
+        snprintf(message, sizeof(message), "Failed to set up forwarding to %.256s: %s", forward_target, strerror(errno));
+        log_message(username, message, LOG_WARNING);
+    }
+    
+    init_tsdb();
+    init_anomaly_detection();
+    init_rules(username);
+    
+    if (init_kmsg() < 0) {
+        snprintf(message, sizeof(message), "Failed to open /dev/kmsg: %s", strerror(errno));
+        log_message(username, message, LOG_WARNING);
+    }
+    init_syslog_receiver(username);
+    if (init_netlink() < 0) {
+        snprintf(message, sizeof(message), "Failed to subscribe to rtnetlink: %s", strerror(errno));
+        log_message(username, message, LOG_WARNING);
+    }
+    
+    if (init_redaction() < 0) {
+        log_message(username, "Failed to build the redaction automaton, records are not redacted", LOG_ERR);
+    }
+    
+    if (init_shm_segment() < 0) {
+        snprintf(message, sizeof(message), "Failed to create metrics segment %s: %s", SHM_PATH, strerror(errno));
+        log_message(username, message, LOG_WARNING);
     }
     
     log_message(username, "------------------------------", LOG_INFO);
@@ -298,16 +7282,44 @@ int main(int argc __attribute__((unused)), char *argv[] __attribute__((unused)))
     snprintf(message, sizeof(message), "Logging interval: %d seconds", log_interval);
     log_message(username, message, LOG_INFO);
     
-    while (1) {
-        log_uptime(username);
-        log_network_connections(username);
-        log_free_inodes(username);
-        check_directory_changes(username);
-        check_directory_changes_periodic(username);
-        sleep(log_interval);
+    while (!stop_requested) {
+        TIMED(HIST_UPTIME, log_uptime(username));
+        TIMED(HIST_NETWORK, log_network_connections(username));
+        TIMED(HIST_INODES, log_free_inodes(username));
+        TIMED(HIST_INOTIFY, check_directory_changes(username));
+        TIMED(HIST_DIR_PERIODIC, check_directory_changes_periodic(username));
+        log_self_stats(username);
+        forward_tick(username);
+        update_self_metrics();
+        check_anomalies(username);
+        evaluate_rules(username);
+        save_kmsg_state();
+        tail_tick();
+        logins_tick();
+        publish_metrics_snapshot();
+        publish_shm_metrics();
+        emit_statsd_metrics();
+        tsdb_append_all();
+        recompress_aged_segments();
+        run_event_loop_until(monotonic_ns() + (uint64_t)log_interval * 1000000000ULL);
     }
     
+    log_message(username, "Termination signal received. Program is stopping.", LOG_INFO);
+    forward_shutdown();
+    save_anomaly_state();
+    save_kmsg_state();
+    save_logins_state();
+    close_syslog_receiver();
+    if (netlink_fd >= 0) close(netlink_fd);
+    stop_recompress();
+    stop_sinks();
+    save_tail_state();
+    if (inotify_fd >= 0) close(inotify_fd);
+    if (metrics_listen_fd >= 0) close(metrics_listen_fd);
+    if (strncmp(metrics_listen, "unix:", 5) == 0) unlink(metrics_listen + 5);
+    if (shm_segment) unlink(SHM_PATH);
+    if (journald_fd >= 0) close(journald_fd);
     close_log_file();
-    if (use_syslog) closelog();
+    if (sinks[SINK_SYSLOG].enabled) closelog();
     return 0;
 }